@@ -0,0 +1,775 @@
+/* Measures how fast FrameWriter encodes frames from the synthetic capture
+ * source, without a compositor. Every combination of the selected formats,
+ * resolutions, contents, codecs, threading policies and regions of interest
+ * runs in its own process, so that a failing case doesn't stop the others and
+ * the peak memory usage is its own.
+ * The results are written as JSON. */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cerrno>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "frame-writer.hpp"
+#include "capture-source.hpp"
+#include "metrics.hpp"
+
+/* The allocator of glibc under the functions the bench replaces */
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+}
+
+/* Heap allocations of every thread, libav and the encoders included, while
+ * counting is on */
+static std::atomic<bool> count_heap{false};
+static std::atomic<long> heap_allocations{0};
+static std::atomic<long> heap_bytes{0};
+
+static void count_allocation(size_t size)
+{
+    if (!count_heap.load(std::memory_order_relaxed))
+        return;
+
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    heap_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+extern "C" void *malloc(size_t size)
+{
+    count_allocation(size);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    count_allocation(count * size);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    count_allocation(size);
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void *memalign(size_t alignment, size_t size)
+{
+    count_allocation(size);
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" void *aligned_alloc(size_t alignment, size_t size)
+{
+    count_allocation(size);
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    count_allocation(size);
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr || !size ? 0 : ENOMEM;
+}
+
+struct bench_format
+{
+    const char *name;
+    uint32_t format;
+};
+
+static const std::vector<bench_format> formats = {
+    {"xrgb8888",      WL_SHM_FORMAT_XRGB8888},
+    {"xbgr8888",      WL_SHM_FORMAT_XBGR8888},
+    {"bgr888",        WL_SHM_FORMAT_BGR888},
+    {"rgb565",        WL_SHM_FORMAT_RGB565},
+    {"bgr565",        WL_SHM_FORMAT_BGR565},
+    {"xrgb2101010",   WL_SHM_FORMAT_XRGB2101010},
+    {"xbgr2101010",   WL_SHM_FORMAT_XBGR2101010},
+    {"xbgr16161616",  WL_SHM_FORMAT_XBGR16161616},
+    {"xrgb16161616",  WL_SHM_FORMAT_XRGB16161616},
+    {"xbgr16161616f", WL_SHM_FORMAT_XBGR16161616F},
+};
+
+struct bench_resolution
+{
+    const char *name;
+    int width, height;
+};
+
+static const std::vector<bench_resolution> resolutions = {
+    {"720p",  1280, 720},
+    {"1080p", 1920, 1080},
+    {"1440p", 2560, 1440},
+    {"4k",    3840, 2160},
+    {"8k",    7680, 4320},
+};
+
+static const std::vector<std::string> contents = {"static", "bar", "scrolling", "video"};
+
+struct bench_case
+{
+    bench_format format;
+    bench_resolution resolution;
+    std::string content;
+    std::string codec;
+    std::string threading;
+    std::string roi;
+};
+
+struct bench_options
+{
+    int frames = 120;
+    int framerate = 60;
+    std::string pix_fmt = DEFAULT_PIX_FMT;
+    /* Heap allocations per frame after the warm-up which fail a case. libav
+     * allocates the references to the frame and packet buffers of every
+     * frame, so it can't be 0. */
+    long max_allocations = 64;
+    std::map<std::string, std::string> codec_options;
+};
+
+/* Latencies of a stage in microseconds */
+struct stage_stats
+{
+    double mean, p50, p90, p99, max;
+};
+
+/* Sent from the process which ran the case, so it must be plain data */
+struct bench_result
+{
+    bool ok;
+    int frames;
+    double wall_sec;
+    double fps;
+    stage_stats generate; // producing the frame in the synthetic source
+    stage_stats encode; // FrameWriter::add_frame
+    stage_stats delay; // frames given to the encoder which it has not returned yet
+    /* The stages inside FrameWriter, from its metrics */
+    stage_stats convert, encoder, handoff, mux;
+    double flush_usec; // destroying the FrameWriter, which drains the encoder
+    double user_cpu_sec, system_cpu_sec;
+    long max_rss_kb;
+    /* Frames and packets FrameWriter allocated after the warm-up, its pools
+     * should make this 0 */
+    long steady_allocations;
+    /* Heap allocations of the whole process after the warm-up, until the
+     * last frame, and their size */
+    long steady_heap_allocations, steady_heap_bytes;
+    /* Size of the encoded video and its luma PSNR as reported by the
+     * encoder, to compare the quality per bit with and without regions of
+     * interest. The PSNR is 0 if the encoder doesn't report it. */
+    long video_bytes;
+    double psnr_y;
+};
+
+static double elapsed_usec(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+static stage_stats get_stats(std::vector<double> samples)
+{
+    stage_stats stats{};
+    if (samples.empty())
+        return stats;
+
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&] (double p)
+    {
+        size_t index = std::min(samples.size() - 1, size_t(p * samples.size()));
+        return samples[index];
+    };
+
+    double sum = 0;
+    for (auto sample : samples)
+        sum += sample;
+
+    stats.mean = sum / samples.size();
+    stats.p50 = percentile(0.50);
+    stats.p90 = percentile(0.90);
+    stats.p99 = percentile(0.99);
+    stats.max = samples.back();
+    return stats;
+}
+
+/* The percentiles are the upper bounds of their histogram buckets */
+static stage_stats get_stats(const LatencyHistogram& histogram)
+{
+    stage_stats stats{};
+    if (!histogram.count())
+        return stats;
+
+    stats.mean = 1.0 * histogram.sum() / histogram.count();
+    stats.p50 = histogram.quantile(0.50);
+    stats.p90 = histogram.quantile(0.90);
+    stats.p99 = histogram.quantile(0.99);
+    stats.max = histogram.max();
+    return stats;
+}
+
+static double timeval_to_sec(const timeval& tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static bench_result run_case(const bench_case& bench, const bench_options& options)
+{
+    bench_result result{};
+    /* Each case runs in its own process, so the stages start empty */
+    metrics.enabled = true;
+
+    CaptureSourceParams source_params;
+    source_params.backend = "synthetic";
+    source_params.width = bench.resolution.width;
+    source_params.height = bench.resolution.height;
+    source_params.format = bench.format.format;
+    source_params.content = bench.content;
+    std::unique_ptr<CaptureSource> source(CaptureSource::create(source_params));
+    if (source->is_stopped())
+        return result;
+
+    std::atomic<bool> write_aborted{false};
+    FrameWriterParams params(write_aborted);
+    params.file = "/dev/null";
+    params.muxer = "null";
+    params.codec = bench.codec;
+    params.pix_fmt = options.pix_fmt;
+    params.codec_options = options.codec_options;
+    params.audio_codec = DEFAULT_AUDIO_CODEC;
+    params.sample_rate = DEFAULT_AUDIO_SAMPLE_RATE;
+    params.framerate = options.framerate;
+    params.enable_ffmpeg_debug_output = false;
+    params.enable_audio = false;
+    params.bframes = -1;
+    parse_threading(bench.threading, params.threading);
+    params.roi = bench.roi == "on";
+    /* The encoders which support it report the error of every frame */
+    if (!params.codec_options.count("flags"))
+        params.codec_options["flags"] = "+psnr";
+    params.width = source_params.width & ~1;
+    params.height = source_params.height & ~1;
+    params.format = get_shm_input_format(bench.format.format).value();
+    params.drm_format = wl_shm_to_drm_format(bench.format.format);
+
+    /* Two buffers, so that the damage tracking of the source is used like
+     * when recording */
+    wf_buffer buffers[2];
+    std::vector<double> generate, encode, delay;
+    std::unique_ptr<FrameWriter> writer;
+
+    /* The pools fill up while the encoder and the outputs start */
+    int warmup_frames = std::max(1, options.frames / 4);
+    size_t warmup_allocations = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < options.frames && !write_aborted; i++)
+    {
+        if (i == warmup_frames && writer)
+        {
+            warmup_allocations = writer->get_allocations();
+            heap_allocations = 0;
+            heap_bytes = 0;
+            count_heap = true;
+        }
+
+        auto& buffer = buffers[i % 2];
+        auto stage = std::chrono::steady_clock::now();
+        source->request_frame(&buffer);
+        if (!source->oldest_done_frame())
+            break;
+        generate.push_back(elapsed_usec(stage));
+
+        if (!writer)
+        {
+            params.stride = buffer.stride;
+            writer = std::make_unique<FrameWriter>(params);
+        }
+
+        writer->add_damage(RoiRect{buffer.damage.x, buffer.damage.y,
+            buffer.damage.width, buffer.damage.height});
+        stage = std::chrono::steady_clock::now();
+        bool ok = writer->add_frame((const uint8_t*)buffer.data,
+            1000000ll * i / options.framerate, buffer.y_invert);
+        encode.push_back(elapsed_usec(stage));
+        /* The bench has no audio, so every packet is a frame */
+        delay.push_back(i + 1.0 - metrics.counters[METRICS_PACKETS_ENCODED].load());
+        source->release_frame();
+        if (!ok)
+            break;
+    }
+
+    count_heap = false;
+    int steady_frames = encode.size() - warmup_frames;
+    if (writer && steady_frames > 0)
+    {
+        result.steady_allocations = writer->get_allocations() - warmup_allocations;
+        result.steady_heap_allocations = heap_allocations;
+        result.steady_heap_bytes = heap_bytes;
+    }
+
+    auto flush = std::chrono::steady_clock::now();
+    writer.reset();
+    result.flush_usec = elapsed_usec(flush);
+    result.wall_sec = elapsed_usec(start) / 1e6;
+
+    for (auto& buffer : buffers)
+        source->free_buffer(buffer);
+
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    result.user_cpu_sec = timeval_to_sec(usage.ru_utime);
+    result.system_cpu_sec = timeval_to_sec(usage.ru_stime);
+    result.max_rss_kb = usage.ru_maxrss;
+
+    /* Every packet counts the error of one frame, for 8 bit luma */
+    uint64_t squared_error = metrics.counters[METRICS_VIDEO_LUMA_SQUARED_ERROR].load();
+    uint64_t packets = metrics.counters[METRICS_PACKETS_ENCODED].load();
+    result.video_bytes = metrics.counters[METRICS_VIDEO_BYTES_ENCODED].load();
+    if (squared_error && packets)
+    {
+        double pixels = 1.0 * params.width * params.height * packets;
+        result.psnr_y = 10 * log10(255.0 * 255.0 * pixels / squared_error);
+    }
+
+    result.frames = encode.size();
+    result.fps = result.frames / result.wall_sec;
+    result.generate = get_stats(generate);
+    result.encode = get_stats(encode);
+    result.delay = get_stats(delay);
+    result.convert = get_stats(metrics.stages[METRICS_STAGE_CONVERT]);
+    result.encoder = get_stats(metrics.stages[METRICS_STAGE_ENCODE]);
+    result.handoff = get_stats(metrics.stages[METRICS_STAGE_HANDOFF]);
+    result.mux = get_stats(metrics.stages[METRICS_STAGE_MUX]);
+    result.ok = result.frames == options.frames && !write_aborted;
+    if (result.steady_allocations)
+    {
+        std::cerr << "FrameWriter allocated " << result.steady_allocations <<
+            " frames and packets after the warm-up" << std::endl;
+        result.ok = false;
+    }
+
+    if (steady_frames > 0 &&
+        result.steady_heap_allocations > options.max_allocations * steady_frames)
+    {
+        std::cerr << result.steady_heap_allocations << " heap allocations in " <<
+            steady_frames << " frames after the warm-up, more than " <<
+            options.max_allocations << " per frame" << std::endl;
+        result.ok = false;
+    }
+    return result;
+}
+
+/* Run the case in a child process, FrameWriter exits on errors */
+static bench_result run_case_isolated(const bench_case& bench, const bench_options& options)
+{
+    bench_result result{};
+
+    int fds[2];
+    if (pipe(fds) < 0)
+    {
+        perror("pipe");
+        return result;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return result;
+    }
+
+    if (pid == 0)
+    {
+        close(fds[0]);
+        result = run_case(bench, options);
+        if (write(fds[1], &result, sizeof(result)) != sizeof(result))
+            _exit(EXIT_FAILURE);
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(fds[1]);
+    if (read(fds[0], &result, sizeof(result)) != sizeof(result))
+        result = bench_result{};
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    return result;
+}
+
+static std::string json_string(const std::string& str)
+{
+    std::ostringstream out;
+    out << '"';
+    for (unsigned char c : str)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out << '\\' << c;
+        } else if (c < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out << escaped;
+        } else
+        {
+            out << c;
+        }
+    }
+
+    out << '"';
+    return out.str();
+}
+
+static void write_stats(std::ostream& out, const char *name, const stage_stats& stats)
+{
+    out << "        " << json_string(name) << ": {"
+        << "\"mean\": " << stats.mean << ", "
+        << "\"p50\": " << stats.p50 << ", "
+        << "\"p90\": " << stats.p90 << ", "
+        << "\"p99\": " << stats.p99 << ", "
+        << "\"max\": " << stats.max << "},\n";
+}
+
+static void write_result(std::ostream& out, const bench_case& bench, const bench_result& result)
+{
+    out << "      {\n"
+        << "        \"format\": " << json_string(bench.format.name) << ",\n"
+        << "        \"resolution\": " << json_string(bench.resolution.name) << ",\n"
+        << "        \"width\": " << bench.resolution.width << ",\n"
+        << "        \"height\": " << bench.resolution.height << ",\n"
+        << "        \"content\": " << json_string(bench.content) << ",\n"
+        << "        \"codec\": " << json_string(bench.codec) << ",\n"
+        << "        \"threading\": " << json_string(bench.threading) << ",\n"
+        << "        \"roi\": " << json_string(bench.roi) << ",\n"
+        << "        \"ok\": " << (result.ok ? "true" : "false") << ",\n"
+        << "        \"frames\": " << result.frames << ",\n"
+        << "        \"wall_sec\": " << result.wall_sec << ",\n"
+        << "        \"fps\": " << result.fps << ",\n";
+    write_stats(out, "generate_usec", result.generate);
+    write_stats(out, "encode_usec", result.encode);
+    write_stats(out, "delay_frames", result.delay);
+    write_stats(out, "convert_usec", result.convert);
+    write_stats(out, "encoder_usec", result.encoder);
+    write_stats(out, "handoff_usec", result.handoff);
+    write_stats(out, "mux_usec", result.mux);
+    out << "        \"flush_usec\": " << result.flush_usec << ",\n"
+        << "        \"user_cpu_sec\": " << result.user_cpu_sec << ",\n"
+        << "        \"system_cpu_sec\": " << result.system_cpu_sec << ",\n"
+        << "        \"max_rss_kb\": " << result.max_rss_kb << ",\n"
+        << "        \"steady_allocations\": " << result.steady_allocations << ",\n"
+        << "        \"steady_heap_allocations\": " << result.steady_heap_allocations << ",\n"
+        << "        \"steady_heap_bytes\": " << result.steady_heap_bytes << ",\n"
+        << "        \"video_bytes\": " << result.video_bytes << ",\n"
+        << "        \"psnr_y\": " << result.psnr_y << "\n"
+        << "      }";
+}
+
+static std::vector<std::string> split(const std::string& list)
+{
+    std::vector<std::string> items;
+    std::istringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        if (!item.empty())
+            items.push_back(item);
+    }
+
+    return items;
+}
+
+/* Items of the table which are named in the list, all if the list is "all" */
+template<class T, class Name>
+static std::vector<T> select_items(const std::vector<T>& table, const std::string& list,
+    const char *what, Name get_name)
+{
+    if (list == "all")
+        return table;
+
+    std::vector<T> selected;
+    for (auto& name : split(list))
+    {
+        auto it = std::find_if(table.begin(), table.end(),
+            [&] (const T& item) { return name == get_name(item); });
+        if (it == table.end())
+        {
+            std::cerr << "Unknown " << what << ": " << name << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+
+        selected.push_back(*it);
+    }
+
+    return selected;
+}
+
+static void help()
+{
+    printf(R"(Usage: wf-recorder-bench [OPTION]...
+Encode frames of the synthetic capture source with FrameWriter and write the
+throughput, latencies, CPU time and peak memory of each case as JSON. A case
+fails if FrameWriter still allocates frames or packets after the first quarter
+of its frames, or if the process makes more heap allocations per frame than
+--max-allocations after it.
+
+  -F, --formats=LIST        Comma separated shm formats, or all (default: all)
+                            xrgb8888, xbgr8888, bgr888, rgb565, bgr565,
+                            xrgb2101010, xbgr2101010, xbgr16161616,
+                            xrgb16161616, xbgr16161616f
+
+  -s, --resolutions=LIST    Comma separated resolutions, or all
+                            (default: 720p,1080p,4k)
+                            720p, 1080p, 1440p, 4k, 8k
+
+  -C, --contents=LIST       Comma separated contents, or all
+                            (default: static,scrolling,video)
+                            static, bar, scrolling, video
+
+  -c, --codecs=LIST         Comma separated codecs (default: %s)
+
+  -t, --threading=LIST      Comma separated threading policies, see the
+                            --threading option of wf-recorder (default: auto)
+                            auto, latency, throughput, with an optional
+                            :THREADS
+
+  -R, --roi=LIST            Comma separated off or on, whether the damage of
+                            the synthetic frames is attached as regions of
+                            interest, to compare the video_bytes and psnr_y
+                            of both (default: off)
+
+  -p, --codec-param         Change the codec parameters.
+                            -p <option_name>=<option_value>
+
+  -x, --pixel-format        Set the output pixel format.
+
+  -n, --frames=N            Frames to encode in each case (default: 120)
+
+  -r, --framerate=FPS       Framerate of the encoded video (default: 60)
+
+  -A, --max-allocations=N   Heap allocations per frame after the first
+                            quarter of the frames which fail a case
+                            (default: 64)
+
+  -o, --output=FILE         Write the JSON to FILE instead of stdout
+
+  -h, --help                Print this help screen.
+)", DEFAULT_CODEC);
+}
+
+int main(int argc, char *argv[])
+{
+    bench_options options;
+    std::string format_list = "all";
+    std::string resolution_list = "720p,1080p,4k";
+    std::string content_list = "static,scrolling,video";
+    std::string codec_list = DEFAULT_CODEC;
+    std::string threading_list = "auto";
+    std::string roi_list = "off";
+    std::string output_file;
+
+    struct option opts[] = {
+        { "formats",         required_argument, NULL, 'F' },
+        { "resolutions",     required_argument, NULL, 's' },
+        { "contents",        required_argument, NULL, 'C' },
+        { "codecs",          required_argument, NULL, 'c' },
+        { "threading",       required_argument, NULL, 't' },
+        { "roi",             required_argument, NULL, 'R' },
+        { "codec-param",     required_argument, NULL, 'p' },
+        { "pixel-format",    required_argument, NULL, 'x' },
+        { "frames",          required_argument, NULL, 'n' },
+        { "framerate",       required_argument, NULL, 'r' },
+        { "max-allocations", required_argument, NULL, 'A' },
+        { "output",          required_argument, NULL, 'o' },
+        { "help",            no_argument,       NULL, 'h' },
+        { 0,                 0,                 NULL,  0  }
+    };
+
+    int c, i;
+    while ((c = getopt_long(argc, argv, "F:s:C:c:t:R:p:x:n:r:A:o:h", opts, &i)) != -1)
+    {
+        switch (c)
+        {
+            case 'F':
+                format_list = optarg;
+                break;
+
+            case 's':
+                resolution_list = optarg;
+                break;
+
+            case 'C':
+                content_list = optarg;
+                break;
+
+            case 'c':
+                codec_list = optarg;
+                break;
+
+            case 't':
+                threading_list = optarg;
+                break;
+
+            case 'R':
+                roi_list = optarg;
+                break;
+
+            case 'p':
+            {
+                std::string param = optarg;
+                size_t pos = param.find("=");
+                if (pos != std::string::npos && pos != param.length() - 1)
+                    options.codec_options[param.substr(0, pos)] = param.substr(pos + 1);
+                else
+                    std::cerr << "Invalid codec option " + param << std::endl;
+                break;
+            }
+
+            case 'x':
+                options.pix_fmt = optarg;
+                break;
+
+            case 'n':
+                options.frames = atoi(optarg);
+                break;
+
+            case 'r':
+                options.framerate = atoi(optarg);
+                break;
+
+            case 'A':
+                options.max_allocations = atol(optarg);
+                break;
+
+            case 'o':
+                output_file = optarg;
+                break;
+
+            case 'h':
+                help();
+                return EXIT_SUCCESS;
+
+            default:
+                help();
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (options.frames <= 0 || options.framerate <= 0)
+    {
+        std::cerr << "The frames and the framerate must be positive" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (options.max_allocations < 0)
+    {
+        std::cerr << "The allocations per frame can't be negative" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    auto selected_formats = select_items(formats, format_list, "format",
+        [] (const bench_format& f) { return std::string(f.name); });
+    auto selected_resolutions = select_items(resolutions, resolution_list, "resolution",
+        [] (const bench_resolution& r) { return std::string(r.name); });
+    auto selected_contents = select_items(contents, content_list, "content",
+        [] (const std::string& content) { return content; });
+
+    auto selected_threading = split(threading_list);
+    for (auto& threading : selected_threading)
+    {
+        ThreadingParams threading_params;
+        if (!parse_threading(threading, threading_params))
+        {
+            std::cerr << "Unknown threading: " << threading << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto selected_roi = split(roi_list);
+    for (auto& roi : selected_roi)
+    {
+        if (roi != "off" && roi != "on")
+        {
+            std::cerr << "Unknown roi: " << roi << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<bench_case> cases;
+    for (auto& codec : split(codec_list))
+    {
+        for (auto& threading : selected_threading)
+        {
+            for (auto& resolution : selected_resolutions)
+            {
+                for (auto& content : selected_contents)
+                {
+                    for (auto& format : selected_formats)
+                    {
+                        for (auto& roi : selected_roi)
+                            cases.push_back({format, resolution, content, codec, threading, roi});
+                    }
+                }
+            }
+        }
+    }
+
+    std::ofstream file;
+    if (!output_file.empty())
+    {
+        file.open(output_file);
+        if (!file)
+        {
+            std::cerr << "Failed to open " << output_file << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::ostream& out = output_file.empty() ? std::cout : file;
+    out << "{\n"
+        << "  \"version\": " << json_string(WFRECORDER_VERSION) << ",\n"
+        << "  \"frames\": " << options.frames << ",\n"
+        << "  \"framerate\": " << options.framerate << ",\n"
+        << "  \"results\": [\n";
+
+    bool all_ok = true;
+    for (size_t n = 0; n < cases.size(); n++)
+    {
+        auto& bench = cases[n];
+        std::cerr << "[" << n + 1 << "/" << cases.size() << "] " << bench.codec << " "
+            << bench.threading << " roi " << bench.roi << " " << bench.resolution.name << " " << bench.content << " " << bench.format.name
+            << std::endl;
+
+        /* The child would write out the buffered JSON again when it exits */
+        out.flush();
+        auto result = run_case_isolated(bench, options);
+        if (!result.ok)
+        {
+            std::cerr << "Case failed" << std::endl;
+            all_ok = false;
+        }
+
+        write_result(out, bench, result);
+        out << (n + 1 < cases.size() ? ",\n" : "\n");
+    }
+
+    out << "  ]\n"
+        << "}\n";
+
+    return all_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
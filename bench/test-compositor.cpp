@@ -0,0 +1,1440 @@
+/* A minimal compositor which serves generated frames over wlr-screencopy
+ * and ext-image-copy-capture-v1, so that wf-recorder can be tested and
+ * benchmarked without a GPU or a desktop session. It has no input and draws
+ * nothing on screen, the outputs only exist to be captured.
+ *
+ * Only shm buffers are supported. linux-dmabuf is not advertised, so clients
+ * have to fall back to shm like on compositors without dmabuf.
+ *
+ * ext-image-copy-capture frames only copy the damage of their session and
+ * the damage the client gives for the buffer, so a client which tracks the
+ * damage of its buffers wrongly records stale pixels. */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <algorithm>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+
+#include <wayland-server.h>
+#include "config.h"
+#include "xdg-output-unstable-v1-server-protocol.h"
+#include "wlr-screencopy-unstable-v1-server-protocol.h"
+#ifdef HAVE_EXT_IMAGE_COPY_CAPTURE
+#include "ext-image-capture-source-v1-server-protocol.h"
+#include "ext-image-copy-capture-v1-server-protocol.h"
+#endif
+
+#define BAR_WIDTH 64
+#define BAR_STEP 8
+
+enum damage_pattern
+{
+    /* Drawn once, nothing changes afterwards */
+    DAMAGE_NONE,
+    /* A bar which moves a little every frame */
+    DAMAGE_BAR,
+    /* Every pixel changes every frame */
+    DAMAGE_FULL,
+};
+
+struct rect
+{
+    int32_t x = 0, y = 0;
+    int32_t width = 0, height = 0;
+
+    bool empty() const
+    {
+        return width <= 0 || height <= 0;
+    }
+
+    /* Grow to the bounding box of both rectangles */
+    void add(const rect& other)
+    {
+        if (other.empty())
+            return;
+
+        if (empty())
+        {
+            *this = other;
+            return;
+        }
+
+        int32_t x2 = std::max(x + width, other.x + other.width);
+        int32_t y2 = std::max(y + height, other.y + other.height);
+        x = std::min(x, other.x);
+        y = std::min(y, other.y);
+        width = x2 - x;
+        height = y2 - y;
+    }
+
+    rect intersect(const rect& other) const
+    {
+        rect result;
+        result.x = std::max(x, other.x);
+        result.y = std::max(y, other.y);
+        result.width = std::min(x + width, other.x + other.width) - result.x;
+        result.height = std::min(y + height, other.y + other.height) - result.y;
+        if (result.empty())
+            return rect{};
+        return result;
+    }
+};
+
+struct test_output;
+
+struct screencopy_frame
+{
+    wl_resource *resource;
+    wl_client *client;
+    test_output *output;
+    rect region; // in output coordinates
+    wl_resource *buffer = NULL;
+    wl_listener buffer_destroy;
+    bool with_damage = false;
+    uint64_t requested_usec = 0;
+};
+
+#ifdef HAVE_EXT_IMAGE_COPY_CAPTURE
+struct ext_frame;
+
+struct ext_session
+{
+    wl_resource *resource;
+    test_output *output; // NULL once the session is stopped
+    rect damage; // since the last frame of the session, in output coordinates
+    ext_frame *frame = NULL; // a session has only one frame at a time
+};
+
+struct ext_frame
+{
+    wl_resource *resource;
+    ext_session *session;
+    wl_resource *buffer = NULL;
+    wl_listener buffer_destroy;
+    rect buffer_damage; // what the client says is out of date in the buffer
+    bool captured = false;
+    uint64_t requested_usec = 0;
+};
+#endif
+
+struct test_output
+{
+    int index;
+    std::string name;
+    int32_t x, width, height;
+    int32_t mode_width, mode_height; // the size given with --size
+    wl_global *global = NULL;
+    std::list<wl_resource*> resources;
+    std::list<wl_resource*> xdg_resources;
+
+    /* XRGB8888 pixels of the current frame */
+    std::vector<uint32_t> pixels;
+    uint64_t frame_count = 0;
+    rect bar;
+
+    /* Frames waiting for the next refresh */
+    std::list<screencopy_frame*> pending;
+    /* Damage since each client last copied with damage */
+    std::map<wl_client*, rect> client_damage;
+#ifdef HAVE_EXT_IMAGE_COPY_CAPTURE
+    std::list<ext_session*> ext_sessions;
+    /* Frames of the sessions waiting for the next refresh */
+    std::list<ext_frame*> ext_pending;
+#endif
+
+    /* Statistics */
+    uint64_t missed_refreshes = 0;
+    uint64_t copies = 0;
+    uint64_t ext_copies = 0; // of the copies, those of ext-image-copy-capture sessions
+    std::vector<double> latency_usec; // from the copy request to ready
+    std::vector<double> copy_usec; // copying the pixels into the buffer
+};
+
+static struct
+{
+    wl_display *display = NULL;
+    std::vector<std::unique_ptr<test_output>> outputs;
+    damage_pattern damage = DAMAGE_BAR;
+    double refresh = 60.0;
+    uint64_t start_usec = 0;
+    /* Seconds between switching the outputs to a smaller size and back */
+    double resize_interval = 0;
+    wl_event_source *resize_timer = NULL;
+
+    pid_t child = -1;
+    int child_status = 0;
+} compositor;
+
+static uint64_t get_monotonic_usec()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ll + ts.tv_nsec / 1000ll;
+}
+
+static uint32_t background(int32_t x, int32_t y, const test_output& output)
+{
+    uint32_t r = 255 * x / output.width;
+    uint32_t g = 255 * y / output.height;
+    uint32_t b = (x + y + 64 * output.index) & 0xff;
+    return 0xff000000 | r << 16 | g << 8 | b;
+}
+
+static void fill_background(test_output& output, const rect& area)
+{
+    for (int32_t y = area.y; y < area.y + area.height; y++)
+    {
+        uint32_t *row = &output.pixels[size_t(y) * output.width];
+        for (int32_t x = area.x; x < area.x + area.width; x++)
+            row[x] = background(x, y, output);
+    }
+}
+
+/* Draw the next frame of the output, returns its damage */
+static rect draw_frame(test_output& output)
+{
+    rect full{0, 0, output.width, output.height};
+    rect damage;
+    if (output.frame_count == 0)
+    {
+        fill_background(output, full);
+        damage = full;
+    }
+
+    switch (compositor.damage)
+    {
+      case DAMAGE_NONE:
+        break;
+      case DAMAGE_BAR:
+      {
+        /* Move the bar: restore the background where it was, then draw it */
+        int32_t width = std::min(BAR_WIDTH, output.width);
+        int32_t range = output.width - width + 1;
+        rect bar{int32_t(output.frame_count * BAR_STEP % range), 0, width, output.height};
+
+        fill_background(output, output.bar);
+        for (int32_t y = 0; y < bar.height; y++)
+        {
+            std::fill_n(&output.pixels[size_t(y) * output.width + bar.x], bar.width,
+                0xffffffff);
+        }
+
+        damage.add(output.bar);
+        damage.add(bar);
+        output.bar = bar;
+        break;
+      }
+      case DAMAGE_FULL:
+      {
+        uint32_t t = output.frame_count;
+        for (int32_t y = 0; y < output.height; y++)
+        {
+            uint32_t *row = &output.pixels[size_t(y) * output.width];
+            uint32_t g = (y + 2 * t) & 0xff;
+            for (int32_t x = 0; x < output.width; x++)
+                row[x] = 0xff000000 | ((x + 3 * t) & 0xff) << 16 | g << 8 | ((x ^ y) & 0xff);
+        }
+
+        damage = full;
+        break;
+      }
+    }
+
+    output.frame_count++;
+    return damage;
+}
+
+static void frame_handle_buffer_destroy(wl_listener *listener, void *)
+{
+    screencopy_frame *frame = wl_container_of(listener, frame, buffer_destroy);
+    wl_list_remove(&frame->buffer_destroy.link);
+    frame->buffer = NULL;
+}
+
+static void remove_pending(screencopy_frame *frame)
+{
+    if (frame->buffer)
+    {
+        wl_list_remove(&frame->buffer_destroy.link);
+        frame->buffer = NULL;
+    }
+
+    if (frame->output)
+        frame->output->pending.remove(frame);
+}
+
+/* Copy the current frame of the output into the buffer of the frame */
+static void finish_frame(screencopy_frame *frame, const timespec& presented)
+{
+    auto& output = *frame->output;
+    auto buffer = frame->buffer;
+    remove_pending(frame);
+
+    /* The client destroyed the buffer before the copy */
+    auto shm_buffer = buffer ? wl_shm_buffer_get(buffer) : NULL;
+    if (shm_buffer == NULL)
+    {
+        zwlr_screencopy_frame_v1_send_failed(frame->resource);
+        return;
+    }
+
+    uint64_t copy_start = get_monotonic_usec();
+    int32_t stride = wl_shm_buffer_get_stride(shm_buffer);
+    wl_shm_buffer_begin_access(shm_buffer);
+    auto data = (uint8_t*)wl_shm_buffer_get_data(shm_buffer);
+    for (int32_t y = 0; y < frame->region.height; y++)
+    {
+        memcpy(data + size_t(y) * stride,
+            &output.pixels[size_t(frame->region.y + y) * output.width + frame->region.x],
+            size_t(frame->region.width) * 4);
+    }
+    wl_shm_buffer_end_access(shm_buffer);
+
+    uint64_t now = get_monotonic_usec();
+    output.copy_usec.push_back(now - copy_start);
+    output.latency_usec.push_back(now - frame->requested_usec);
+    output.copies++;
+
+    zwlr_screencopy_frame_v1_send_flags(frame->resource, 0);
+    if (frame->with_damage)
+    {
+        auto& damage = output.client_damage[frame->client];
+        rect changed = damage.intersect(frame->region);
+        zwlr_screencopy_frame_v1_send_damage(frame->resource, changed.x - frame->region.x,
+            changed.y - frame->region.y, changed.width, changed.height);
+        damage = rect{};
+    }
+
+    uint64_t sec = presented.tv_sec;
+    zwlr_screencopy_frame_v1_send_ready(frame->resource, sec >> 32, sec & 0xffffffff,
+        presented.tv_nsec);
+}
+
+#ifdef HAVE_EXT_IMAGE_COPY_CAPTURE
+static void ext_frame_handle_buffer_destroy(wl_listener *listener, void *)
+{
+    ext_frame *frame = wl_container_of(listener, frame, buffer_destroy);
+    wl_list_remove(&frame->buffer_destroy.link);
+    frame->buffer = NULL;
+}
+
+static void ext_remove_buffer(ext_frame *frame)
+{
+    if (frame->buffer)
+    {
+        wl_list_remove(&frame->buffer_destroy.link);
+        frame->buffer = NULL;
+    }
+}
+
+static void ext_remove_pending(ext_frame *frame)
+{
+    if (frame->session && frame->session->output)
+        frame->session->output->ext_pending.remove(frame);
+}
+
+static void ext_fail_frame(ext_frame *frame, uint32_t reason)
+{
+    ext_remove_pending(frame);
+    ext_remove_buffer(frame);
+    ext_image_copy_capture_frame_v1_send_failed(frame->resource, reason);
+}
+
+/* Whether the buffer matches the constraints the session advertised */
+static bool ext_check_buffer(wl_resource *buffer, const test_output& output)
+{
+    auto shm_buffer = buffer ? wl_shm_buffer_get(buffer) : NULL;
+    return shm_buffer != NULL &&
+        wl_shm_buffer_get_format(shm_buffer) == WL_SHM_FORMAT_XRGB8888 &&
+        wl_shm_buffer_get_width(shm_buffer) == output.width &&
+        wl_shm_buffer_get_height(shm_buffer) == output.height &&
+        wl_shm_buffer_get_stride(shm_buffer) >= output.width * 4;
+}
+
+/* Copy what changed since the last frame of the session and what the client
+ * says is out of date in the buffer, nothing else */
+static void ext_finish_frame(ext_frame *frame, const timespec& presented)
+{
+    auto& session = *frame->session;
+    auto& output = *session.output;
+    auto buffer = frame->buffer;
+    ext_remove_pending(frame);
+    ext_remove_buffer(frame);
+
+    /* The client destroyed the buffer before the copy */
+    if (!ext_check_buffer(buffer, output))
+    {
+        ext_image_copy_capture_frame_v1_send_failed(frame->resource,
+            EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_UNKNOWN);
+        return;
+    }
+
+    rect full{0, 0, output.width, output.height};
+    rect damage = session.damage.intersect(full);
+    rect copied = damage;
+    copied.add(frame->buffer_damage.intersect(full));
+
+    uint64_t copy_start = get_monotonic_usec();
+    auto shm_buffer = wl_shm_buffer_get(buffer);
+    int32_t stride = wl_shm_buffer_get_stride(shm_buffer);
+    wl_shm_buffer_begin_access(shm_buffer);
+    auto data = (uint8_t*)wl_shm_buffer_get_data(shm_buffer);
+    for (int32_t y = copied.y; y < copied.y + copied.height; y++)
+    {
+        memcpy(data + size_t(y) * stride + size_t(copied.x) * 4,
+            &output.pixels[size_t(y) * output.width + copied.x], size_t(copied.width) * 4);
+    }
+    wl_shm_buffer_end_access(shm_buffer);
+
+    uint64_t now = get_monotonic_usec();
+    output.copy_usec.push_back(now - copy_start);
+    output.latency_usec.push_back(now - frame->requested_usec);
+    output.copies++;
+    output.ext_copies++;
+
+    ext_image_copy_capture_frame_v1_send_transform(frame->resource, WL_OUTPUT_TRANSFORM_NORMAL);
+    ext_image_copy_capture_frame_v1_send_damage(frame->resource, damage.x, damage.y,
+        damage.width, damage.height);
+    session.damage = rect{};
+
+    uint64_t sec = presented.tv_sec;
+    ext_image_copy_capture_frame_v1_send_presentation_time(frame->resource, sec >> 32,
+        sec & 0xffffffff, presented.tv_nsec);
+    ext_image_copy_capture_frame_v1_send_ready(frame->resource);
+}
+
+static void ext_refresh(test_output& output, const rect& damage, const timespec& presented)
+{
+    for (auto session : output.ext_sessions)
+        session->damage.add(damage);
+
+    /* Like screencopy frames with damage, they wait until the output changed */
+    auto pending = output.ext_pending;
+    for (auto frame : pending)
+    {
+        if (!frame->session->damage.empty())
+            ext_finish_frame(frame, presented);
+    }
+}
+#endif
+
+static int handle_refresh(int fd, uint32_t, void *data)
+{
+    auto& output = *(test_output*)data;
+
+    uint64_t expirations = 0;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return 0;
+    if (expirations > 1)
+        output.missed_refreshes += expirations - 1;
+
+    timespec presented;
+    clock_gettime(CLOCK_MONOTONIC, &presented);
+    rect damage = draw_frame(output);
+    for (auto& client : output.client_damage)
+        client.second.add(damage);
+
+    /* Frames with damage wait until their region changed */
+    auto pending = output.pending;
+    for (auto frame : pending)
+    {
+        if (frame->with_damage &&
+            output.client_damage[frame->client].intersect(frame->region).empty())
+        {
+            continue;
+        }
+
+        finish_frame(frame, presented);
+    }
+
+#ifdef HAVE_EXT_IMAGE_COPY_CAPTURE
+    ext_refresh(output, damage, presented);
+#endif
+    return 0;
+}
+
+static void frame_copy(wl_client*, wl_resource *resource, wl_resource *buffer, bool with_damage)
+{
+    auto frame = (screencopy_frame*)wl_resource_get_user_data(resource);
+
+    /* The output may have been resized since the frame was created */
+    if (frame->output == NULL ||
+        frame->region.x + frame->region.width > frame->output->width ||
+        frame->region.y + frame->region.height > frame->output->height)
+    {
+        zwlr_screencopy_frame_v1_send_failed(resource);
+        return;
+    }
+
+    if (frame->requested_usec)
+    {
+        wl_resource_post_error(resource, ZWLR_SCREENCOPY_FRAME_V1_ERROR_ALREADY_USED,
+            "frame already used");
+        return;
+    }
+
+    auto shm_buffer = wl_shm_buffer_get(buffer);
+    if (shm_buffer == NULL ||
+        wl_shm_buffer_get_format(shm_buffer) != WL_SHM_FORMAT_XRGB8888 ||
+        wl_shm_buffer_get_width(shm_buffer) != frame->region.width ||
+        wl_shm_buffer_get_height(shm_buffer) != frame->region.height ||
+        wl_shm_buffer_get_stride(shm_buffer) < frame->region.width * 4)
+    {
+        wl_resource_post_error(resource, ZWLR_SCREENCOPY_FRAME_V1_ERROR_INVALID_BUFFER,
+            "invalid buffer");
+        return;
+    }
+
+    frame->buffer = buffer;
+    frame->buffer_destroy.notify = frame_handle_buffer_destroy;
+    wl_resource_add_destroy_listener(buffer, &frame->buffer_destroy);
+    frame->with_damage = with_damage;
+    frame->requested_usec = get_monotonic_usec();
+    frame->output->pending.push_back(frame);
+}
+
+static void frame_handle_copy(wl_client *client, wl_resource *resource, wl_resource *buffer)
+{
+    frame_copy(client, resource, buffer, false);
+}
+
+static void frame_handle_copy_with_damage(wl_client *client, wl_resource *resource,
+    wl_resource *buffer)
+{
+    frame_copy(client, resource, buffer, true);
+}
+
+static void handle_destroy(wl_client*, wl_resource *resource)
+{
+    wl_resource_destroy(resource);
+}
+
+static const struct zwlr_screencopy_frame_v1_interface frame_impl = {
+    .copy = frame_handle_copy,
+    .destroy = handle_destroy,
+    .copy_with_damage = frame_handle_copy_with_damage,
+};
+
+static void frame_resource_destroy(wl_resource *resource)
+{
+    auto frame = (screencopy_frame*)wl_resource_get_user_data(resource);
+    remove_pending(frame);
+    delete frame;
+}
+
+static void client_handle_destroy(wl_listener *listener, void *data)
+{
+    auto client = (wl_client*)data;
+    for (auto& output : compositor.outputs)
+        output->client_damage.erase(client);
+
+    wl_list_remove(&listener->link);
+    delete listener;
+}
+
+static void capture(wl_client *client, wl_resource *manager, uint32_t id,
+    wl_resource *output_resource, rect region)
+{
+    auto frame = new screencopy_frame;
+    frame->resource = wl_resource_create(client, &zwlr_screencopy_frame_v1_interface,
+        wl_resource_get_version(manager), id);
+    if (frame->resource == NULL)
+    {
+        delete frame;
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    frame->client = client;
+    frame->output = (test_output*)wl_resource_get_user_data(output_resource);
+    wl_resource_set_implementation(frame->resource, &frame_impl, frame,
+        frame_resource_destroy);
+
+    auto& output = *frame->output;
+    frame->region = region.intersect(rect{0, 0, output.width, output.height});
+    if (frame->region.empty())
+    {
+        frame->output = NULL;
+        zwlr_screencopy_frame_v1_send_failed(frame->resource);
+        return;
+    }
+
+    /* The first copy with damage of a client has the whole output damaged */
+    if (!output.client_damage.count(client))
+    {
+        output.client_damage[client] = rect{0, 0, output.width, output.height};
+        if (!wl_client_get_destroy_listener(client, client_handle_destroy))
+        {
+            auto listener = new wl_listener;
+            listener->notify = client_handle_destroy;
+            wl_client_add_destroy_listener(client, listener);
+        }
+    }
+
+    zwlr_screencopy_frame_v1_send_buffer(frame->resource, WL_SHM_FORMAT_XRGB8888,
+        frame->region.width, frame->region.height, frame->region.width * 4);
+    if (wl_resource_get_version(frame->resource) >= 3)
+        zwlr_screencopy_frame_v1_send_buffer_done(frame->resource);
+}
+
+static void manager_handle_capture_output(wl_client *client, wl_resource *resource,
+    uint32_t frame, int32_t, wl_resource *output)
+{
+    capture(client, resource, frame, output, rect{0, 0, INT32_MAX, INT32_MAX});
+}
+
+static void manager_handle_capture_output_region(wl_client *client, wl_resource *resource,
+    uint32_t frame, int32_t, wl_resource *output, int32_t x, int32_t y,
+    int32_t width, int32_t height)
+{
+    capture(client, resource, frame, output, rect{x, y, width, height});
+}
+
+static const struct zwlr_screencopy_manager_v1_interface screencopy_manager_impl = {
+    .capture_output = manager_handle_capture_output,
+    .capture_output_region = manager_handle_capture_output_region,
+    .destroy = handle_destroy,
+};
+
+static void bind_screencopy_manager(wl_client *client, void *, uint32_t version, uint32_t id)
+{
+    auto resource = wl_resource_create(client, &zwlr_screencopy_manager_v1_interface,
+        version, id);
+    if (resource == NULL)
+    {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    wl_resource_set_implementation(resource, &screencopy_manager_impl, NULL, NULL);
+}
+
+#ifdef HAVE_EXT_IMAGE_COPY_CAPTURE
+static void ext_frame_handle_attach_buffer(wl_client*, wl_resource *resource,
+    wl_resource *buffer)
+{
+    auto frame = (ext_frame*)wl_resource_get_user_data(resource);
+    if (frame->captured)
+    {
+        wl_resource_post_error(resource, EXT_IMAGE_COPY_CAPTURE_FRAME_V1_ERROR_ALREADY_CAPTURED,
+            "frame already captured");
+        return;
+    }
+
+    ext_remove_buffer(frame);
+    frame->buffer = buffer;
+    frame->buffer_destroy.notify = ext_frame_handle_buffer_destroy;
+    wl_resource_add_destroy_listener(buffer, &frame->buffer_destroy);
+}
+
+static void ext_frame_handle_damage_buffer(wl_client*, wl_resource *resource,
+    int32_t x, int32_t y, int32_t width, int32_t height)
+{
+    auto frame = (ext_frame*)wl_resource_get_user_data(resource);
+    if (frame->captured)
+    {
+        wl_resource_post_error(resource, EXT_IMAGE_COPY_CAPTURE_FRAME_V1_ERROR_ALREADY_CAPTURED,
+            "frame already captured");
+        return;
+    }
+
+    if (x < 0 || y < 0 || width <= 0 || height <= 0)
+    {
+        wl_resource_post_error(resource,
+            EXT_IMAGE_COPY_CAPTURE_FRAME_V1_ERROR_INVALID_BUFFER_DAMAGE, "invalid buffer damage");
+        return;
+    }
+
+    frame->buffer_damage.add(rect{x, y, width, height});
+}
+
+static void ext_frame_handle_capture(wl_client*, wl_resource *resource)
+{
+    auto frame = (ext_frame*)wl_resource_get_user_data(resource);
+    if (frame->captured)
+    {
+        wl_resource_post_error(resource, EXT_IMAGE_COPY_CAPTURE_FRAME_V1_ERROR_ALREADY_CAPTURED,
+            "frame already captured");
+        return;
+    }
+
+    if (frame->buffer == NULL)
+    {
+        wl_resource_post_error(resource, EXT_IMAGE_COPY_CAPTURE_FRAME_V1_ERROR_NO_BUFFER,
+            "no buffer attached");
+        return;
+    }
+
+    frame->captured = true;
+    if (frame->session == NULL || frame->session->output == NULL)
+    {
+        ext_fail_frame(frame, EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_STOPPED);
+        return;
+    }
+
+    /* A buffer allocated for constraints which changed since */
+    auto& output = *frame->session->output;
+    if (!ext_check_buffer(frame->buffer, output))
+    {
+        ext_fail_frame(frame, EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_BUFFER_CONSTRAINTS);
+        return;
+    }
+
+    frame->requested_usec = get_monotonic_usec();
+    output.ext_pending.push_back(frame);
+}
+
+static const struct ext_image_copy_capture_frame_v1_interface ext_frame_impl = {
+    .destroy = handle_destroy,
+    .attach_buffer = ext_frame_handle_attach_buffer,
+    .damage_buffer = ext_frame_handle_damage_buffer,
+    .capture = ext_frame_handle_capture,
+};
+
+static void ext_frame_resource_destroy(wl_resource *resource)
+{
+    auto frame = (ext_frame*)wl_resource_get_user_data(resource);
+    ext_remove_pending(frame);
+    ext_remove_buffer(frame);
+    if (frame->session)
+        frame->session->frame = NULL;
+    delete frame;
+}
+
+static void ext_session_handle_create_frame(wl_client *client, wl_resource *resource,
+    uint32_t id)
+{
+    auto session = (ext_session*)wl_resource_get_user_data(resource);
+    if (session->frame)
+    {
+        wl_resource_post_error(resource, EXT_IMAGE_COPY_CAPTURE_SESSION_V1_ERROR_DUPLICATE_FRAME,
+            "session already has a frame");
+        return;
+    }
+
+    auto frame = new ext_frame;
+    frame->resource = wl_resource_create(client, &ext_image_copy_capture_frame_v1_interface,
+        wl_resource_get_version(resource), id);
+    if (frame->resource == NULL)
+    {
+        delete frame;
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    frame->session = session;
+    session->frame = frame;
+    wl_resource_set_implementation(frame->resource, &ext_frame_impl, frame,
+        ext_frame_resource_destroy);
+}
+
+static const struct ext_image_copy_capture_session_v1_interface ext_session_impl = {
+    .create_frame = ext_session_handle_create_frame,
+    .destroy = handle_destroy,
+};
+
+static void ext_session_resource_destroy(wl_resource *resource)
+{
+    auto session = (ext_session*)wl_resource_get_user_data(resource);
+    if (session->frame)
+    {
+        ext_remove_pending(session->frame);
+        session->frame->session = NULL;
+    }
+
+    if (session->output)
+        session->output->ext_sessions.remove(session);
+    delete session;
+}
+
+static void ext_send_constraints(ext_session *session)
+{
+    auto& output = *session->output;
+    ext_image_copy_capture_session_v1_send_buffer_size(session->resource,
+        output.width, output.height);
+    ext_image_copy_capture_session_v1_send_shm_format(session->resource,
+        WL_SHM_FORMAT_XRGB8888);
+    ext_image_copy_capture_session_v1_send_done(session->resource);
+}
+
+static void ext_copy_manager_handle_create_session(wl_client *client, wl_resource *resource,
+    uint32_t id, wl_resource *source, uint32_t options)
+{
+    /* There is no cursor, so painting it changes nothing */
+    if (options & ~EXT_IMAGE_COPY_CAPTURE_MANAGER_V1_OPTIONS_PAINT_CURSORS)
+    {
+        wl_resource_post_error(resource, EXT_IMAGE_COPY_CAPTURE_MANAGER_V1_ERROR_INVALID_OPTION,
+            "invalid options");
+        return;
+    }
+
+    auto session = new ext_session;
+    session->resource = wl_resource_create(client, &ext_image_copy_capture_session_v1_interface,
+        wl_resource_get_version(resource), id);
+    if (session->resource == NULL)
+    {
+        delete session;
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    session->output = (test_output*)wl_resource_get_user_data(source);
+    wl_resource_set_implementation(session->resource, &ext_session_impl, session,
+        ext_session_resource_destroy);
+    if (session->output == NULL)
+    {
+        ext_image_copy_capture_session_v1_send_stopped(session->resource);
+        return;
+    }
+
+    /* The first frame of a session has the whole output damaged */
+    session->damage = rect{0, 0, session->output->width, session->output->height};
+    session->output->ext_sessions.push_back(session);
+    ext_send_constraints(session);
+}
+
+static void ext_copy_manager_handle_create_pointer_cursor_session(wl_client *client,
+    wl_resource*, uint32_t, wl_resource*, wl_resource*)
+{
+    /* Without a seat, clients have no pointer to ask for */
+    wl_client_post_implementation_error(client, "pointer cursor sessions are not supported");
+}
+
+static const struct ext_image_copy_capture_manager_v1_interface ext_copy_manager_impl = {
+    .create_session = ext_copy_manager_handle_create_session,
+    .create_pointer_cursor_session = ext_copy_manager_handle_create_pointer_cursor_session,
+    .destroy = handle_destroy,
+};
+
+static void bind_ext_copy_manager(wl_client *client, void *, uint32_t version, uint32_t id)
+{
+    auto resource = wl_resource_create(client, &ext_image_copy_capture_manager_v1_interface,
+        version, id);
+    if (resource == NULL)
+    {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    wl_resource_set_implementation(resource, &ext_copy_manager_impl, NULL, NULL);
+}
+
+static const struct ext_image_capture_source_v1_interface ext_source_impl = {
+    .destroy = handle_destroy,
+};
+
+static void ext_source_manager_handle_create_source(wl_client *client, wl_resource *resource,
+    uint32_t id, wl_resource *output_resource)
+{
+    auto source = wl_resource_create(client, &ext_image_capture_source_v1_interface,
+        wl_resource_get_version(resource), id);
+    if (source == NULL)
+    {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    /* The outputs are never removed, so the source can point to its output */
+    wl_resource_set_implementation(source, &ext_source_impl,
+        wl_resource_get_user_data(output_resource), NULL);
+}
+
+static const struct ext_output_image_capture_source_manager_v1_interface
+ext_source_manager_impl = {
+    .create_source = ext_source_manager_handle_create_source,
+    .destroy = handle_destroy,
+};
+
+static void bind_ext_source_manager(wl_client *client, void *, uint32_t version, uint32_t id)
+{
+    auto resource = wl_resource_create(client,
+        &ext_output_image_capture_source_manager_v1_interface, version, id);
+    if (resource == NULL)
+    {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    wl_resource_set_implementation(resource, &ext_source_manager_impl, NULL, NULL);
+}
+#endif
+
+static const struct zxdg_output_v1_interface xdg_output_impl = {
+    .destroy = handle_destroy,
+};
+
+static void xdg_output_resource_destroy(wl_resource *resource)
+{
+    auto output = (test_output*)wl_resource_get_user_data(resource);
+    if (output)
+        output->xdg_resources.remove(resource);
+}
+
+static void xdg_output_manager_handle_get_xdg_output(wl_client *client,
+    wl_resource *resource, uint32_t id, wl_resource *output_resource)
+{
+    auto xdg_output = wl_resource_create(client, &zxdg_output_v1_interface,
+        wl_resource_get_version(resource), id);
+    if (xdg_output == NULL)
+    {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    auto output = (test_output*)wl_resource_get_user_data(output_resource);
+    wl_resource_set_implementation(xdg_output, &xdg_output_impl, output,
+        xdg_output_resource_destroy);
+    if (output == NULL)
+        return;
+
+    output->xdg_resources.push_back(xdg_output);
+    int version = wl_resource_get_version(xdg_output);
+    zxdg_output_v1_send_logical_position(xdg_output, output->x, 0);
+    zxdg_output_v1_send_logical_size(xdg_output, output->width, output->height);
+    if (version >= ZXDG_OUTPUT_V1_NAME_SINCE_VERSION)
+    {
+        zxdg_output_v1_send_name(xdg_output, output->name.c_str());
+        zxdg_output_v1_send_description(xdg_output, "wf-recorder test output");
+    }
+
+    /* Since version 3, the changes are applied with wl_output.done */
+    if (version < 3)
+        zxdg_output_v1_send_done(xdg_output);
+    else if (wl_resource_get_version(output_resource) >= WL_OUTPUT_DONE_SINCE_VERSION)
+        wl_output_send_done(output_resource);
+}
+
+static const struct zxdg_output_manager_v1_interface xdg_output_manager_impl = {
+    .destroy = handle_destroy,
+    .get_xdg_output = xdg_output_manager_handle_get_xdg_output,
+};
+
+static void bind_xdg_output_manager(wl_client *client, void *, uint32_t version, uint32_t id)
+{
+    auto resource = wl_resource_create(client, &zxdg_output_manager_v1_interface,
+        version, id);
+    if (resource == NULL)
+    {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    wl_resource_set_implementation(resource, &xdg_output_manager_impl, NULL, NULL);
+}
+
+static void output_handle_release(wl_client*, wl_resource *resource)
+{
+    wl_resource_destroy(resource);
+}
+
+static const struct wl_output_interface output_impl = {
+    .release = output_handle_release,
+};
+
+static void output_resource_destroy(wl_resource *resource)
+{
+    auto output = (test_output*)wl_resource_get_user_data(resource);
+    if (output)
+        output->resources.remove(resource);
+}
+
+static void bind_output(wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+    auto& output = *(test_output*)data;
+    auto resource = wl_resource_create(client, &wl_output_interface, version, id);
+    if (resource == NULL)
+    {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    wl_resource_set_implementation(resource, &output_impl, &output, output_resource_destroy);
+    output.resources.push_back(resource);
+
+    wl_output_send_geometry(resource, output.x, 0, 0, 0, WL_OUTPUT_SUBPIXEL_UNKNOWN,
+        "wf-recorder", "test output", WL_OUTPUT_TRANSFORM_NORMAL);
+    wl_output_send_mode(resource, WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED,
+        output.width, output.height, int32_t(compositor.refresh * 1000));
+    if (version >= WL_OUTPUT_SCALE_SINCE_VERSION)
+        wl_output_send_scale(resource, 1);
+    if (version >= WL_OUTPUT_NAME_SINCE_VERSION)
+    {
+        wl_output_send_name(resource, output.name.c_str());
+        wl_output_send_description(resource, "wf-recorder test output");
+    }
+    if (version >= WL_OUTPUT_DONE_SINCE_VERSION)
+        wl_output_send_done(resource);
+}
+
+/* Change the mode of the output. The captures which were requested for the
+ * old size fail, and the ext-image-copy-capture sessions get new buffer
+ * constraints, so the clients have to allocate new buffers. */
+static void resize_output(test_output& output, int32_t width, int32_t height)
+{
+    output.width = width;
+    output.height = height;
+    output.pixels.assign(size_t(width) * height, 0);
+    output.frame_count = 0;
+    output.bar = rect{};
+    draw_frame(output);
+
+    rect full{0, 0, width, height};
+    for (auto& client : output.client_damage)
+        client.second = full;
+
+    for (auto resource : output.resources)
+    {
+        wl_output_send_mode(resource, WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED,
+            width, height, int32_t(compositor.refresh * 1000));
+    }
+
+    for (auto xdg_output : output.xdg_resources)
+    {
+        zxdg_output_v1_send_logical_size(xdg_output, width, height);
+        if (wl_resource_get_version(xdg_output) < 3)
+            zxdg_output_v1_send_done(xdg_output);
+    }
+
+    for (auto resource : output.resources)
+    {
+        if (wl_resource_get_version(resource) >= WL_OUTPUT_DONE_SINCE_VERSION)
+            wl_output_send_done(resource);
+    }
+
+    auto pending = output.pending;
+    for (auto frame : pending)
+    {
+        remove_pending(frame);
+        frame->output = NULL;
+        zwlr_screencopy_frame_v1_send_failed(frame->resource);
+    }
+
+#ifdef HAVE_EXT_IMAGE_COPY_CAPTURE
+    for (auto session : output.ext_sessions)
+    {
+        session->damage = full;
+        ext_send_constraints(session);
+    }
+
+    auto ext_pending = output.ext_pending;
+    for (auto frame : ext_pending)
+        ext_fail_frame(frame, EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_BUFFER_CONSTRAINTS);
+#endif
+}
+
+/* Switch between the size given with --size and three quarters of it */
+static int handle_resize(void *)
+{
+    for (auto& output : compositor.outputs)
+    {
+        if (output->width == output->mode_width)
+        {
+            resize_output(*output, (output->mode_width * 3 / 4) & ~1,
+                (output->mode_height * 3 / 4) & ~1);
+        } else
+            resize_output(*output, output->mode_width, output->mode_height);
+    }
+
+    wl_event_source_timer_update(compositor.resize_timer, int(compositor.resize_interval * 1000));
+    return 0;
+}
+
+static void create_output(int index, int32_t width, int32_t height)
+{
+    auto output = std::make_unique<test_output>();
+    output->index = index;
+    output->name = "TEST-" + std::to_string(index + 1);
+    output->x = index * width;
+    output->width = width;
+    output->height = height;
+    output->mode_width = width;
+    output->mode_height = height;
+    output->pixels.resize(size_t(width) * height);
+    output->global = wl_global_create(compositor.display, &wl_output_interface, 4,
+        output.get(), bind_output);
+
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("timerfd_create");
+        exit(EXIT_FAILURE);
+    }
+
+    long period = long(1e9 / compositor.refresh);
+    itimerspec timer{};
+    timer.it_interval.tv_sec = period / 1000000000;
+    timer.it_interval.tv_nsec = period % 1000000000;
+    timer.it_value = timer.it_interval;
+    timerfd_settime(fd, 0, &timer, NULL);
+
+    wl_event_loop_add_fd(wl_display_get_event_loop(compositor.display), fd,
+        WL_EVENT_READABLE, handle_refresh, output.get());
+
+    /* The first frame is ready before the first refresh */
+    draw_frame(*output);
+    compositor.outputs.push_back(std::move(output));
+}
+
+static int handle_terminate(int, void *)
+{
+    if (compositor.child > 0)
+        kill(compositor.child, SIGINT);
+    else
+        wl_display_terminate(compositor.display);
+
+    return 0;
+}
+
+static int handle_timeout(void *)
+{
+    return handle_terminate(0, NULL);
+}
+
+static int handle_sigchld(int, void *)
+{
+    if (compositor.child > 0 && waitpid(compositor.child, &compositor.child_status, WNOHANG) > 0)
+    {
+        compositor.child = -1;
+        wl_display_terminate(compositor.display);
+    }
+
+    return 0;
+}
+
+static pid_t spawn(char **argv, const char *socket)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        /* The event loop blocks the signals it handles */
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+
+        setenv("WAYLAND_DISPLAY", socket, 1);
+        execvp(argv[0], argv);
+        fprintf(stderr, "Failed to run %s: %m\n", argv[0]);
+        _exit(127);
+    }
+
+    if (pid < 0)
+        perror("fork");
+
+    return pid;
+}
+
+/* Latencies in microseconds as a JSON object */
+static std::string stats_json(std::vector<double> samples)
+{
+    if (samples.empty())
+        return "null";
+
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&] (double p)
+    {
+        return samples[std::min(samples.size() - 1, size_t(p * samples.size()))];
+    };
+
+    double sum = 0;
+    for (auto sample : samples)
+        sum += sample;
+
+    char json[256];
+    snprintf(json, sizeof(json),
+        "{\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}",
+        sum / samples.size(), percentile(0.5), percentile(0.9), percentile(0.99),
+        samples.back());
+    return json;
+}
+
+static void write_stats(std::ostream& out)
+{
+    double duration = (get_monotonic_usec() - compositor.start_usec) / 1e6;
+    out << "{\n"
+        << "  \"duration_sec\": " << duration << ",\n"
+        << "  \"refresh\": " << compositor.refresh << ",\n"
+        << "  \"outputs\": [\n";
+
+    for (size_t i = 0; i < compositor.outputs.size(); i++)
+    {
+        auto& output = *compositor.outputs[i];
+        out << "    {\n"
+            << "      \"name\": \"" << output.name << "\",\n"
+            << "      \"width\": " << output.width << ",\n"
+            << "      \"height\": " << output.height << ",\n"
+            << "      \"frames\": " << output.frame_count << ",\n"
+            << "      \"missed_refreshes\": " << output.missed_refreshes << ",\n"
+            << "      \"copies\": " << output.copies << ",\n"
+            << "      \"ext_copies\": " << output.ext_copies << ",\n"
+            << "      \"copies_per_sec\": " << output.copies / duration << ",\n"
+            << "      \"latency_usec\": " << stats_json(output.latency_usec) << ",\n"
+            << "      \"copy_usec\": " << stats_json(output.copy_usec) << "\n"
+            << "    }" << (i + 1 < compositor.outputs.size() ? ",\n" : "\n");
+    }
+
+    out << "  ]\n"
+        << "}\n";
+}
+
+static void help()
+{
+    printf(R"(Usage: wf-recorder-test-compositor [OPTION]... [-- COMMAND [ARG]...]
+Serve generated frames over wlr-screencopy and ext-image-copy-capture-v1 for
+testing and benchmarking wf-recorder without a GPU or a desktop session. If a
+command is given, it is run with WAYLAND_DISPLAY set and the compositor exits
+when it exits.
+
+  -s, --size=WxH            Size of the outputs (default: 1920x1080)
+
+  -r, --refresh=HZ          Refresh rate of the outputs (default: 60)
+
+  -n, --outputs=N           Number of outputs, placed side by side (default: 1)
+
+  -d, --damage=PATTERN      What changes every frame (default: bar)
+                            none  nothing after the first frame
+                            bar   a bar which moves a little
+                            full  every pixel
+
+  -p, --protocols=LIST      Comma separated capture protocols to advertise, to
+                            test the fallback of the clients (default: all)
+                            ext         ext-image-copy-capture-v1
+                            screencopy  wlr-screencopy-unstable-v1
+
+  -R, --resize=SECONDS      Switch the outputs to three quarters of their size
+                            and back every SECONDS, which changes the buffer
+                            constraints of the capture sessions
+
+  -S, --socket=NAME         Name of the Wayland socket (default: the first free one)
+
+  -t, --time=SECONDS        Stop after this long, sending SIGINT to the command
+
+  -o, --stats=FILE          Write the statistics to FILE instead of stdout
+
+  -h, --help                Print this help screen.
+)");
+}
+
+int main(int argc, char *argv[])
+{
+    int32_t width = 1920, height = 1080;
+    int output_count = 1;
+    std::string socket;
+    double duration = 0;
+    std::string stats_file;
+    bool ext_capture = true, screencopy = true;
+
+    struct option opts[] = {
+        { "size",    required_argument, NULL, 's' },
+        { "refresh", required_argument, NULL, 'r' },
+        { "outputs", required_argument, NULL, 'n' },
+        { "damage",  required_argument, NULL, 'd' },
+        { "protocols", required_argument, NULL, 'p' },
+        { "resize",  required_argument, NULL, 'R' },
+        { "socket",  required_argument, NULL, 'S' },
+        { "time",    required_argument, NULL, 't' },
+        { "stats",   required_argument, NULL, 'o' },
+        { "help",    no_argument,       NULL, 'h' },
+        { 0,         0,                 NULL,  0  }
+    };
+
+    int c, i;
+    while ((c = getopt_long(argc, argv, "+s:r:n:d:p:R:S:t:o:h", opts, &i)) != -1)
+    {
+        switch (c)
+        {
+            case 's':
+                if (sscanf(optarg, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+                {
+                    std::cerr << "Invalid size " << optarg << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'r':
+                compositor.refresh = atof(optarg);
+                if (compositor.refresh <= 0)
+                {
+                    std::cerr << "Invalid refresh rate " << optarg << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'n':
+                output_count = atoi(optarg);
+                if (output_count <= 0)
+                {
+                    std::cerr << "Invalid number of outputs " << optarg << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'd':
+                if (strcmp(optarg, "none") == 0)
+                    compositor.damage = DAMAGE_NONE;
+                else if (strcmp(optarg, "bar") == 0)
+                    compositor.damage = DAMAGE_BAR;
+                else if (strcmp(optarg, "full") == 0)
+                    compositor.damage = DAMAGE_FULL;
+                else
+                {
+                    std::cerr << "Unknown damage pattern " << optarg << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'p':
+            {
+                ext_capture = screencopy = false;
+                std::istringstream list(optarg);
+                std::string protocol;
+                while (std::getline(list, protocol, ','))
+                {
+                    if (protocol == "all")
+                        ext_capture = screencopy = true;
+#ifdef HAVE_EXT_IMAGE_COPY_CAPTURE
+                    else if (protocol == "ext")
+                        ext_capture = true;
+#endif
+                    else if (protocol == "screencopy")
+                        screencopy = true;
+                    else
+                    {
+                        std::cerr << "Unknown capture protocol " << protocol << std::endl;
+                        return EXIT_FAILURE;
+                    }
+                }
+
+                if (!ext_capture && !screencopy)
+                {
+                    std::cerr << "No capture protocol given" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+
+            case 'R':
+                compositor.resize_interval = atof(optarg);
+                if (compositor.resize_interval <= 0)
+                {
+                    std::cerr << "Invalid resize interval " << optarg << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'S':
+                socket = optarg;
+                break;
+
+            case 't':
+                duration = atof(optarg);
+                break;
+
+            case 'o':
+                stats_file = optarg;
+                break;
+
+            case 'h':
+                help();
+                return EXIT_SUCCESS;
+
+            default:
+                help();
+                return EXIT_FAILURE;
+        }
+    }
+
+    compositor.display = wl_display_create();
+    if (socket.empty())
+    {
+        const char *name = wl_display_add_socket_auto(compositor.display);
+        if (name)
+            socket = name;
+    } else if (wl_display_add_socket(compositor.display, socket.c_str()) < 0)
+    {
+        socket.clear();
+    }
+
+    if (socket.empty())
+    {
+        std::cerr << "Failed to create the Wayland socket, is XDG_RUNTIME_DIR set?" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    wl_display_init_shm(compositor.display);
+    wl_global_create(compositor.display, &zxdg_output_manager_v1_interface, 3, NULL,
+        bind_xdg_output_manager);
+    if (screencopy)
+    {
+        wl_global_create(compositor.display, &zwlr_screencopy_manager_v1_interface, 3, NULL,
+            bind_screencopy_manager);
+    }
+#ifdef HAVE_EXT_IMAGE_COPY_CAPTURE
+    if (ext_capture)
+    {
+        wl_global_create(compositor.display, &ext_output_image_capture_source_manager_v1_interface,
+            1, NULL, bind_ext_source_manager);
+        wl_global_create(compositor.display, &ext_image_copy_capture_manager_v1_interface, 1,
+            NULL, bind_ext_copy_manager);
+    }
+#endif
+    for (int n = 0; n < output_count; n++)
+        create_output(n, width, height);
+
+    auto loop = wl_display_get_event_loop(compositor.display);
+    wl_event_loop_add_signal(loop, SIGINT, handle_terminate, NULL);
+    wl_event_loop_add_signal(loop, SIGTERM, handle_terminate, NULL);
+    wl_event_loop_add_signal(loop, SIGCHLD, handle_sigchld, NULL);
+    if (duration > 0)
+    {
+        auto timer = wl_event_loop_add_timer(loop, handle_timeout, NULL);
+        wl_event_source_timer_update(timer, int(duration * 1000));
+    }
+
+    if (compositor.resize_interval > 0)
+    {
+        compositor.resize_timer = wl_event_loop_add_timer(loop, handle_resize, NULL);
+        wl_event_source_timer_update(compositor.resize_timer,
+            int(compositor.resize_interval * 1000));
+    }
+
+    std::cerr << "Running on WAYLAND_DISPLAY=" << socket << std::endl;
+    if (optind < argc)
+    {
+        compositor.child = spawn(argv + optind, socket.c_str());
+        if (compositor.child < 0)
+            return EXIT_FAILURE;
+    }
+
+    compositor.start_usec = get_monotonic_usec();
+    wl_display_run(compositor.display);
+
+    if (stats_file.empty())
+    {
+        write_stats(std::cout);
+    } else
+    {
+        std::ofstream out(stats_file);
+        write_stats(out);
+    }
+
+    wl_display_destroy_clients(compositor.display);
+    wl_display_destroy(compositor.display);
+
+    if (WIFEXITED(compositor.child_status))
+        return WEXITSTATUS(compositor.child_status);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,454 @@
+/* A stand-in for a streaming server behind a slow link. It accepts TCP
+ * connections and reads from them no faster than the given bitrate, so that
+ * the sender sees the same backpressure as on a congested network. The
+ * bitrate can change during the run to test how wf-recorder adapts to it.
+ *
+ * wf-recorder sends to it with for example
+ * -f tcp://127.0.0.1:9000 -m mpegts */
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+/* Largest amount read at once, which limits the bursts */
+#define READ_CHUNK 16384
+
+/* The bitrate from the given time on, 0 for unlimited */
+struct rate_step
+{
+    double start_sec;
+    double bits_per_sec;
+};
+
+struct receiver_state
+{
+    std::vector<rate_step> schedule{{0, 0}};
+    uint64_t start_usec = 0;
+    uint64_t total_bytes = 0;
+    int connections = 0;
+
+    /* Bytes received in every second of the run */
+    std::vector<uint64_t> bytes_per_sec;
+
+    pid_t child = -1;
+    int child_status = 0;
+};
+
+static receiver_state receiver;
+
+static uint64_t get_monotonic_usec()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static double parse_bitrate(const char *value)
+{
+    char *end;
+    double bitrate = strtod(value, &end);
+    switch (*end)
+    {
+      case 'k':
+      case 'K':
+        bitrate *= 1e3;
+        break;
+      case 'm':
+      case 'M':
+        bitrate *= 1e6;
+        break;
+      case 'g':
+      case 'G':
+        bitrate *= 1e9;
+        break;
+    }
+
+    return bitrate;
+}
+
+/* SEC:RATE[,SEC:RATE]... */
+static bool parse_schedule(const std::string& value)
+{
+    size_t pos = 0;
+    while (pos < value.size())
+    {
+        size_t end = value.find(',', pos);
+        if (end == std::string::npos)
+            end = value.size();
+
+        std::string step = value.substr(pos, end - pos);
+        size_t colon = step.find(':');
+        if (colon == std::string::npos)
+            return false;
+
+        receiver.schedule.push_back({atof(step.substr(0, colon).c_str()),
+            parse_bitrate(step.substr(colon + 1).c_str())});
+        pos = end + 1;
+    }
+
+    std::stable_sort(receiver.schedule.begin(), receiver.schedule.end(),
+        [] (const rate_step& a, const rate_step& b) { return a.start_sec < b.start_sec; });
+    return true;
+}
+
+static double current_rate(double elapsed_sec)
+{
+    double rate = 0;
+    for (auto& step : receiver.schedule)
+    {
+        if (step.start_sec <= elapsed_sec)
+            rate = step.bits_per_sec;
+    }
+
+    return rate;
+}
+
+static int listen_tcp(const std::string& address, int buffer_size)
+{
+    std::string host = "127.0.0.1";
+    std::string port = address;
+    size_t colon = address.rfind(':');
+    if (colon != std::string::npos)
+    {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(port.c_str()));
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1)
+    {
+        std::cerr << "Invalid address " << host << std::endl;
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    /* Accepted sockets inherit the buffer size. A small one makes the
+     * sender notice the throttling right away. */
+    if (buffer_size > 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0)
+    {
+        fprintf(stderr, "Failed to listen on %s:%s: %m\n", host.c_str(), port.c_str());
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static pid_t spawn(char **argv)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+
+        execvp(argv[0], argv);
+        fprintf(stderr, "Failed to run %s: %m\n", argv[0]);
+        _exit(127);
+    }
+
+    if (pid < 0)
+        perror("fork");
+
+    return pid;
+}
+
+static void count_bytes(uint64_t now, size_t bytes)
+{
+    size_t second = (now - receiver.start_usec) / 1000000;
+    if (receiver.bytes_per_sec.size() <= second)
+        receiver.bytes_per_sec.resize(second + 1);
+
+    receiver.bytes_per_sec[second] += bytes;
+    receiver.total_bytes += bytes;
+}
+
+static void write_stats(std::ostream& out)
+{
+    double duration = (get_monotonic_usec() - receiver.start_usec) / 1e6;
+    out << "{\n"
+        << "  \"duration_sec\": " << duration << ",\n"
+        << "  \"connections\": " << receiver.connections << ",\n"
+        << "  \"bytes\": " << receiver.total_bytes << ",\n"
+        << "  \"kbits_per_sec\": [";
+
+    for (size_t i = 0; i < receiver.bytes_per_sec.size(); i++)
+    {
+        out << (i ? ", " : "") << receiver.bytes_per_sec[i] * 8 / 1000;
+    }
+
+    out << "]\n"
+        << "}\n";
+}
+
+static void help()
+{
+    printf(R"(Usage: wf-recorder-throttled-receiver [OPTION]... [-- COMMAND [ARG]...]
+Accept TCP connections and read from them no faster than the given bitrate,
+like a streaming server behind a slow link. If a command is given, it is run
+and the receiver exits when it exits.
+
+  -l, --listen=[HOST:]PORT  Address to listen on (default: 127.0.0.1:9000)
+
+  -r, --rate=BITRATE        Bitrate to read with, e.g. 2M (default: unlimited)
+
+  -s, --schedule=SEC:BITRATE[,SEC:BITRATE]...
+                            Change the bitrate at the given seconds since the
+                            start, e.g. 10:500k,20:4M
+
+  -b, --buffer=BYTES        Receive buffer size of the socket (default: 65536)
+
+  -w, --write=FILE          Write the received stream to FILE
+
+  -t, --time=SECONDS        Stop after this long, sending SIGINT to the command
+
+  -o, --stats=FILE          Write the statistics to FILE instead of stdout
+
+  -h, --help                Print this help screen.
+)");
+}
+
+int main(int argc, char *argv[])
+{
+    std::string address = "9000";
+    int buffer_size = 65536;
+    double duration = 0;
+    std::string stats_file;
+    std::string output_file;
+
+    struct option opts[] = {
+        { "listen",   required_argument, NULL, 'l' },
+        { "rate",     required_argument, NULL, 'r' },
+        { "schedule", required_argument, NULL, 's' },
+        { "buffer",   required_argument, NULL, 'b' },
+        { "write",    required_argument, NULL, 'w' },
+        { "time",     required_argument, NULL, 't' },
+        { "stats",    required_argument, NULL, 'o' },
+        { "help",     no_argument,       NULL, 'h' },
+        { 0,          0,                 NULL,  0  }
+    };
+
+    int c, i;
+    while ((c = getopt_long(argc, argv, "+l:r:s:b:w:t:o:h", opts, &i)) != -1)
+    {
+        switch (c)
+        {
+            case 'l':
+                address = optarg;
+                break;
+
+            case 'r':
+                receiver.schedule[0].bits_per_sec = parse_bitrate(optarg);
+                break;
+
+            case 's':
+                if (!parse_schedule(optarg))
+                {
+                    std::cerr << "Invalid schedule " << optarg << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'b':
+                buffer_size = atoi(optarg);
+                break;
+
+            case 'w':
+                output_file = optarg;
+                break;
+
+            case 't':
+                duration = atof(optarg);
+                break;
+
+            case 'o':
+                stats_file = optarg;
+                break;
+
+            case 'h':
+                help();
+                return EXIT_SUCCESS;
+
+            default:
+                help();
+                return EXIT_FAILURE;
+        }
+    }
+
+    int listen_fd = listen_tcp(address, buffer_size);
+    if (listen_fd < 0)
+        return EXIT_FAILURE;
+
+    std::ofstream output;
+    if (!output_file.empty())
+    {
+        output.open(output_file, std::ios::binary);
+        if (!output)
+        {
+            std::cerr << "Failed to open " << output_file << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+    std::cerr << "Listening on " << address << std::endl;
+    if (optind < argc)
+    {
+        receiver.child = spawn(argv + optind);
+        if (receiver.child < 0)
+            return EXIT_FAILURE;
+    }
+
+    receiver.start_usec = get_monotonic_usec();
+    int client_fd = -1;
+    bool running = true;
+    bool stopping = false;
+    /* Bytes which may be read right now, refilled with the bitrate */
+    double budget = 0;
+    uint64_t last_refill = receiver.start_usec;
+    std::vector<char> buffer(READ_CHUNK);
+
+    while (running)
+    {
+        uint64_t now = get_monotonic_usec();
+        double elapsed = (now - receiver.start_usec) / 1e6;
+        double rate = current_rate(elapsed);
+
+        /* Allow a burst of at most one chunk, like a link with a small queue */
+        budget = std::min<double>(budget + rate / 8 * (now - last_refill) / 1e6, READ_CHUNK);
+        last_refill = now;
+
+        if (duration > 0 && elapsed >= duration && !stopping)
+        {
+            stopping = true;
+            if (receiver.child > 0)
+                kill(receiver.child, SIGINT);
+            else
+                running = false;
+        }
+
+        int timeout = -1;
+        bool can_read = client_fd >= 0 && (rate <= 0 || budget >= 1);
+        if (client_fd >= 0 && !can_read)
+            timeout = std::max(1, int((1 - budget) * 8 / rate * 1000));
+        if (duration > 0 && !stopping)
+        {
+            int until_end = std::max(1, int((duration - elapsed) * 1000));
+            timeout = timeout < 0 ? until_end : std::min(timeout, until_end);
+        }
+
+        pollfd fds[2] = {
+            { signal_fd, POLLIN, 0 },
+            { client_fd >= 0 ? client_fd : listen_fd, POLLIN, 0 },
+        };
+        int nfds = (client_fd >= 0 && !can_read) ? 1 : 2;
+        if (poll(fds, nfds, timeout) < 0)
+            continue;
+
+        if (fds[0].revents & POLLIN)
+        {
+            signalfd_siginfo info;
+            if (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+            {
+                if (info.ssi_signo == SIGCHLD)
+                {
+                    if (receiver.child > 0 &&
+                        waitpid(receiver.child, &receiver.child_status, WNOHANG) > 0)
+                    {
+                        receiver.child = -1;
+                        running = false;
+                    }
+                } else if (receiver.child > 0)
+                {
+                    kill(receiver.child, SIGINT);
+                } else
+                {
+                    running = false;
+                }
+            }
+        }
+
+        if (nfds < 2 || !(fds[1].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+
+        if (client_fd < 0)
+        {
+            client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (client_fd >= 0)
+            {
+                receiver.connections++;
+                std::cerr << "Accepted connection " << receiver.connections << std::endl;
+            }
+            continue;
+        }
+
+        size_t size = rate > 0 ? std::min<size_t>(budget, buffer.size()) : buffer.size();
+        ssize_t ret = read(client_fd, buffer.data(), size);
+        if (ret <= 0)
+        {
+            close(client_fd);
+            client_fd = -1;
+            continue;
+        }
+
+        budget -= ret;
+        count_bytes(get_monotonic_usec(), ret);
+        if (output.is_open())
+            output.write(buffer.data(), ret);
+    }
+
+    if (client_fd >= 0)
+        close(client_fd);
+    close(listen_fd);
+
+    if (stats_file.empty())
+    {
+        write_stats(std::cout);
+    } else
+    {
+        std::ofstream out(stats_file);
+        write_stats(out);
+    }
+
+    if (optind >= argc)
+        return EXIT_SUCCESS;
+    if (WIFEXITED(receiver.child_status))
+        return WEXITSTATUS(receiver.child_status);
+    return EXIT_FAILURE;
+}
@@ -9,13 +9,29 @@ complete -c wf-recorder -s D -l no-damage          -d 'Disables damage-based rec
 complete -c wf-recorder -s f                       -d 'Sets the output file name and format based on the given extension.' --require-parameter --force-files
 complete -c wf-recorder -s m -l muxer              -d 'Set the output format to a specific muxer' --arguments '(ffmpeg -hide_banner -muxers | grep "^  E" | cut -c 6- | cut -d " " -f 1 | tr "," "\n")' --exclusive
 complete -c wf-recorder -s x -l pixel-format       -d 'Set the output pixel format' --arguments '(ffmpeg -hide_banner -pix_fmts | tail -n +9 | cut -d " " -f 2)' --exclusive
-complete -c wf-recorder -s g -l geometry           -d 'Selects a specific part of the screen. The format is "x,y WxH".' --exclusive
+complete -c wf-recorder -s g -l geometry           -d 'Selects a specific part of the screen. The format is "x,y WxH". Can be used multiple times.' --exclusive
 complete -c wf-recorder -s h -l help               -d 'Prints help'
 complete -c wf-recorder -s v -l version            -d 'Prints the version of wf-recorder'
+complete -c wf-recorder -s V -l verbose            -d 'Prints a summary of the CPU usage of the threads every five seconds'
 complete -c wf-recorder -s l -l log                -d 'Generates a log on the current terminal'
-complete -c wf-recorder -s o -l output             -d 'Specify the output where the video is to be recorded' --exclusive
+complete -c wf-recorder -s T -l tee                -d 'Write the encoded video to an additional output (ex. -T "[f=mpegts]udp://host:port")' --exclusive
+complete -c wf-recorder -s o -l output             -d 'Specify the outputs where the video is to be recorded (ex. -o DP-1,HDMI-A-1)' --exclusive
+complete -c wf-recorder      -l frames-in-flight   -d 'Number of frames requested from the compositor at the same time' --exclusive
+complete -c wf-recorder      -l capture-backend    -d 'Selects how frames are captured' --arguments 'ext screencopy synthetic' --exclusive
+complete -c wf-recorder      -l metrics            -d 'Write stage latencies and counters in the Prometheus format to a file or unix:PATH' --require-parameter --force-files
+complete -c wf-recorder      -l trace              -d 'Write the timeline of each frame in the Chrome trace format to a file at exit' --require-parameter --force-files
+complete -c wf-recorder      -l adaptive-framerate -d 'Capture fewer frames while the encoder cannot keep up'
+complete -c wf-recorder      -l threading          -d 'Thread the encoders for latency or throughput (ex. --threading latency:4)' --arguments 'auto latency throughput' --exclusive
+complete -c wf-recorder      -l thread-pool        -d 'Run the slice threads of the encoders and filters in a shared pool (ex. --thread-pool 8:pin)' --exclusive
+complete -c wf-recorder      -l thread-sched       -d 'Set CPUs, nice level or realtime policy of a kind of threads (ex. --thread-sched capture:cpus=2:fifo=10)' --exclusive
+complete -c wf-recorder      -l autotune           -d 'Pick the slowest preset of the codecs which encodes in real time (ex. --autotune=libx265,libx264)'
+complete -c wf-recorder      -l autotune-headroom  -d 'How much faster than real time the autotuned encoder has to be, in percent' --exclusive
+complete -c wf-recorder      -l no-capability-cache -d 'Probe codec formats and the DRM device again instead of using the cache'
+complete -c wf-recorder      -l roi                -d 'Encode changed regions and an optional focus region at a higher quality (ex. --roi="0,0 800x600")'
+complete -c wf-recorder      -l merge-outputs      -d 'Store multiple outputs or regions as streams of one file instead of separate files'
 complete -c wf-recorder -s p -l codec-param        -d 'Change the codec parameters. (ex. -p <option_name>=<option_value>)' --exclusive
 complete -c wf-recorder -s F -l filter             -d 'Specify the ffmpeg filter string to use. (ex. -F scale_vaapi=format=nv12)' --exclusive
+complete -c wf-recorder      -l rendition          -d 'Also encode the video at another size (ex. --rendition 1280x720:bitrate=2M:file=proxy.mkv)' --exclusive
 complete -c wf-recorder -s b -l bframes            -d 'This option is used to set the maximum number of b-frames to be used' --exclusive
 complete -c wf-recorder -s B -l buffrate           -d 'This option is used to specify the buffers expected framerate' --exclusive
 complete -c wf-recorder      -l audio-backend      -d 'Specifies the audio backend' --exclusive
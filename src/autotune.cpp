@@ -0,0 +1,363 @@
+#include "autotune.hpp"
+#include "capture-source.hpp"
+#include "frame-writer.hpp"
+#include "capability-cache.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Frames encoded before measuring, while the encoder starts up */
+#define WARMUP_SECONDS 0.5
+/* How long the encoding is measured */
+#define MEASURE_SECONDS 1.0
+/* A trial which doesn't get through the warm-up in this time is too slow */
+#define WARMUP_TIMEOUT_SECONDS 5.0
+
+struct TunedCodec
+{
+    const char *codec;
+    const char *option;
+    /* From the best quality to the fastest */
+    std::vector<const char*> values;
+};
+
+static const std::vector<TunedCodec> TUNED_CODECS = {
+    {"libx264",    "preset",   {"medium", "fast", "faster", "veryfast", "superfast", "ultrafast"}},
+    {"libx265",    "preset",   {"medium", "fast", "faster", "veryfast", "superfast", "ultrafast"}},
+    {"libvpx",     "cpu-used", {"4", "8", "12", "16"}},
+    {"libvpx-vp9", "cpu-used", {"4", "5", "6", "7", "8"}},
+    {"libaom-av1", "cpu-used", {"6", "7", "8", "9", "10"}},
+    {"libsvtav1",  "preset",   {"8", "9", "10", "11", "12", "13"}},
+};
+
+bool autotune_supports_codec(const std::string& codec)
+{
+    /* Hardware encoders need the device set up for them */
+    return codec.find("vaapi") == std::string::npos;
+}
+
+static double elapsed_sec(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/* Frames per second of the codec with the option, 0 if it can't keep up */
+static double run_trial(const AutotuneParams& params, const std::string& codec,
+    const std::string& option, const std::string& value)
+{
+    CaptureSourceParams source_params;
+    source_params.backend = "synthetic";
+    source_params.width = params.width;
+    source_params.height = params.height;
+    source_params.format = WL_SHM_FORMAT_XRGB8888;
+    /* Text which scrolls is the hardest of the usual screen content */
+    source_params.content = "scrolling";
+    std::unique_ptr<CaptureSource> source(CaptureSource::create(source_params));
+    if (source->is_stopped())
+        return 0;
+
+    std::atomic<bool> write_aborted{false};
+    FrameWriterParams writer_params(write_aborted);
+    writer_params.file = "/dev/null";
+    writer_params.muxer = "null";
+    writer_params.codec = codec;
+    writer_params.pix_fmt = params.pix_fmt;
+    writer_params.codec_options = params.codec_options;
+    if (!option.empty())
+        writer_params.codec_options[option] = value;
+    writer_params.audio_codec = DEFAULT_AUDIO_CODEC;
+    writer_params.sample_rate = DEFAULT_AUDIO_SAMPLE_RATE;
+    writer_params.framerate = params.framerate;
+    writer_params.enable_ffmpeg_debug_output = false;
+    writer_params.enable_audio = false;
+    writer_params.bframes = params.bframes;
+    writer_params.threading = params.threading;
+    if (writer_params.threading.policy == THREADING_AUTO)
+        writer_params.threading.policy = params.live ? THREADING_LATENCY : THREADING_THROUGHPUT;
+    writer_params.width = params.width & ~1;
+    writer_params.height = params.height & ~1;
+    writer_params.format = get_shm_input_format(source_params.format).value();
+    writer_params.drm_format = wl_shm_to_drm_format(source_params.format);
+
+    int warmup_frames = std::max(1.0, params.framerate * WARMUP_SECONDS);
+    int measured_frames = std::max(1.0, params.framerate * MEASURE_SECONDS);
+    /* The measured frames have to be encoded within this time */
+    double deadline = measured_frames * 100.0 / (params.framerate * (100.0 + params.headroom));
+
+    wf_buffer buffers[2];
+    std::unique_ptr<FrameWriter> writer;
+    auto start = std::chrono::steady_clock::now();
+    double fps = 0;
+    for (int i = 0; i < warmup_frames + measured_frames && !write_aborted; i++)
+    {
+        if (i == warmup_frames)
+            start = std::chrono::steady_clock::now();
+        else if (elapsed_sec(start) > (i < warmup_frames ? WARMUP_TIMEOUT_SECONDS : deadline))
+            break;
+
+        auto& buffer = buffers[i % 2];
+        source->request_frame(&buffer);
+        if (!source->oldest_done_frame())
+            break;
+
+        if (!writer)
+        {
+            writer_params.stride = buffer.stride;
+            writer = std::unique_ptr<FrameWriter>(new FrameWriter(writer_params));
+        }
+
+        bool ok = writer->add_frame((const uint8_t*)buffer.data,
+            1000000ll * i / params.framerate, buffer.y_invert);
+        source->release_frame();
+        if (!ok)
+            break;
+
+        if (i + 1 == warmup_frames + measured_frames)
+            fps = measured_frames / elapsed_sec(start);
+    }
+
+    writer.reset();
+    for (auto& buffer : buffers)
+        source->free_buffer(buffer);
+
+    return fps;
+}
+
+/* Run the trial in a child process, FrameWriter exits on errors */
+static double run_trial_isolated(const AutotuneParams& params, const std::string& codec,
+    const std::string& option, const std::string& value)
+{
+    int fds[2];
+    if (pipe(fds) < 0)
+    {
+        perror("pipe");
+        return 0;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+
+    if (pid == 0)
+    {
+        close(fds[0]);
+        /* The encoder prints its settings for every trial */
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0)
+            dup2(null_fd, STDERR_FILENO);
+
+        double fps = run_trial(params, codec, option, value);
+        if (write(fds[1], &fps, sizeof(fps)) != sizeof(fps))
+            _exit(EXIT_FAILURE);
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(fds[1]);
+    double fps = 0;
+    if (read(fds[0], &fps, sizeof(fps)) != sizeof(fps))
+        fps = 0;
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    return fps;
+}
+
+static std::string cpu_model()
+{
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line))
+    {
+        if (line.compare(0, 10, "model name") != 0)
+            continue;
+
+        size_t colon = line.find(':');
+        if (colon != std::string::npos)
+            return line.substr(line.find_first_not_of(' ', colon + 1));
+    }
+
+    return "unknown";
+}
+
+/* Everything the result depends on, the machine first */
+static std::string cache_key(const AutotuneParams& params)
+{
+    std::ostringstream key;
+    key << cpu_model() << "/" << std::thread::hardware_concurrency() << " " <<
+        LIBAVCODEC_IDENT << " " << params.width << "x" << params.height << "@" <<
+        params.framerate << " +" << params.headroom << "%";
+    for (auto& codec : params.codecs)
+        key << " " << codec;
+
+    key << " " << params.pix_fmt << " " << threading_policy_name(params.threading.policy) <<
+        ":" << params.threading.threads << "/" << params.threading.shared_by << (params.live ? " live" : "") << " b" << params.bframes;
+    for (auto& option : params.codec_options)
+        key << " " << option.first << "=" << option.second;
+
+    std::string result = key.str();
+    std::replace(result.begin(), result.end(), '\t', ' ');
+    std::replace(result.begin(), result.end(), '\n', ' ');
+    return result;
+}
+
+/* Each line of the cache is KEY<TAB>CODEC<TAB>OPTION<TAB>VALUE<TAB>FPS */
+static std::vector<std::string> split_line(const std::string& line)
+{
+    std::vector<std::string> fields;
+    std::istringstream stream(line);
+    std::string field;
+    while (std::getline(stream, field, '\t'))
+        fields.push_back(field);
+
+    return fields;
+}
+
+static bool cache_lookup(const std::string& key, AutotuneResult& result)
+{
+    std::string dir = cache_directory();
+    if (dir.empty())
+        return false;
+
+    std::ifstream cache(dir + "/autotune");
+    std::string line;
+    while (std::getline(cache, line))
+    {
+        auto fields = split_line(line);
+        if (fields.size() < 5 || fields[0] != key)
+            continue;
+
+        result.ok = true;
+        result.codec = fields[1];
+        result.option = fields[2];
+        result.value = fields[3];
+        result.fps = atof(fields[4].c_str());
+        result.cached = true;
+        return true;
+    }
+
+    return false;
+}
+
+static void cache_store(const std::string& key, const AutotuneResult& result)
+{
+    std::string dir = cache_directory();
+    if (dir.empty())
+        return;
+
+    /* $XDG_CACHE_HOME may not exist yet either */
+    mkdir(dir.substr(0, dir.rfind('/')).c_str(), 0700);
+    mkdir(dir.c_str(), 0700);
+
+    std::string file = dir + "/autotune";
+    std::vector<std::string> lines;
+    {
+        std::ifstream cache(file);
+        std::string line;
+        while (std::getline(cache, line))
+        {
+            auto fields = split_line(line);
+            if (!fields.empty() && fields[0] != key)
+                lines.push_back(line);
+        }
+    }
+
+    std::ostringstream line;
+    line << key << "\t" << result.codec << "\t" << result.option << "\t" <<
+        result.value << "\t" << result.fps;
+    lines.push_back(line.str());
+
+    /* Replaced at once, so that a recording starting at the same time
+     * doesn't read half of it */
+    std::string tmp = file + "." + std::to_string(getpid());
+    {
+        std::ofstream out(tmp);
+        for (auto& l : lines)
+            out << l << "\n";
+        if (!out)
+        {
+            std::cerr << "Failed to write the autotune cache " << tmp << std::endl;
+            unlink(tmp.c_str());
+            return;
+        }
+    }
+
+    if (rename(tmp.c_str(), file.c_str()) < 0)
+    {
+        perror("rename");
+        unlink(tmp.c_str());
+    }
+}
+
+AutotuneResult autotune(const AutotuneParams& params)
+{
+    AutotuneResult result;
+    std::string key = cache_key(params);
+    if (cache_lookup(key, result))
+        return result;
+
+    double required_fps = params.framerate * (100.0 + params.headroom) / 100.0;
+    std::cerr << "Autotuning the encoder for " << params.width << "x" << params.height <<
+        " at " << params.framerate << " fps, with " << params.headroom << "% headroom" <<
+        std::endl;
+
+    for (auto& codec : params.codecs)
+    {
+        auto it = std::find_if(TUNED_CODECS.begin(), TUNED_CODECS.end(),
+            [&] (const TunedCodec& tuned) { return codec == tuned.codec; });
+        std::string option = it != TUNED_CODECS.end() ? it->option : "";
+        std::vector<std::string> values;
+        if (it != TUNED_CODECS.end())
+            values.assign(it->values.rbegin(), it->values.rend());
+        else
+            values.push_back("");
+
+        /* Presets the user chose are not tuned */
+        if (!option.empty() && params.codec_options.count(option))
+            values = {params.codec_options.at(option)};
+
+        /* From the fastest preset on, until one can't keep up. The slower
+         * presets won't either. */
+        for (auto& value : values)
+        {
+            double fps = run_trial_isolated(params, codec, option, value);
+            std::cerr << "  " << codec;
+            if (!option.empty())
+                std::cerr << " " << option << "=" << value;
+            if (fps > 0)
+                std::cerr << ": " << fps << " fps" << std::endl;
+            else
+                std::cerr << ": too slow" << std::endl;
+
+            if (fps < required_fps)
+                break;
+
+            result.ok = true;
+            result.codec = codec;
+            result.option = option;
+            result.value = value;
+            result.fps = fps;
+        }
+
+        if (result.ok)
+            break;
+    }
+
+    if (result.ok)
+        cache_store(key, result);
+
+    return result;
+}
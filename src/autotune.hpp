@@ -0,0 +1,51 @@
+#ifndef AUTOTUNE_HPP
+#define AUTOTUNE_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include "threading-policy.hpp"
+
+struct AutotuneParams
+{
+    /* The candidate codecs, the first one which keeps up is preferred */
+    std::vector<std::string> codecs;
+    int width, height;
+    int framerate;
+    /* How much faster than real time the encoding has to be, in percent,
+     * so that it still keeps up while other programs use the CPU */
+    int headroom = 25;
+
+    /* The settings of the recording which affect the speed of the encoder */
+    std::string pix_fmt;
+    std::map<std::string, std::string> codec_options;
+    ThreadingParams threading;
+    int bframes = -1;
+    /* Whether the video is sent to the network */
+    bool live = false;
+};
+
+struct AutotuneResult
+{
+    bool ok = false;
+    std::string codec;
+    /* The option which selects the speed of the codec and its value, empty
+     * for codecs without presets */
+    std::string option, value;
+    double fps = 0;
+    bool cached = false;
+};
+
+/**
+ * Encode a few seconds of synthetic screen content with each candidate codec,
+ * from its fastest preset to its slowest one, and pick the slowest preset
+ * which still encodes framerate * (100 + headroom) / 100 frames per second.
+ * The results are cached in $XDG_CACHE_HOME/wf-recorder/autotune for this
+ * machine, libavcodec and parameters.
+ */
+AutotuneResult autotune(const AutotuneParams& params);
+
+/* Whether the speed of the codec can be tuned */
+bool autotune_supports_codec(const std::string& codec);
+
+#endif /* end of include guard: AUTOTUNE_HPP */
@@ -0,0 +1,71 @@
+#include "av-pool.hpp"
+
+FramePool::~FramePool()
+{
+    for (auto frame : free_frames)
+        av_frame_free(&frame);
+}
+
+AVFrame *FramePool::get()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!free_frames.empty())
+        {
+            AVFrame *frame = free_frames.back();
+            free_frames.pop_back();
+            return frame;
+        }
+    }
+
+    AVFrame *frame = av_frame_alloc();
+    if (frame)
+        allocated++;
+
+    return frame;
+}
+
+void FramePool::put(AVFrame *frame)
+{
+    if (!frame)
+        return;
+
+    av_frame_unref(frame);
+    std::lock_guard<std::mutex> lock(mutex);
+    free_frames.push_back(frame);
+}
+
+PacketPool::~PacketPool()
+{
+    for (auto pkt : free_packets)
+        av_packet_free(&pkt);
+}
+
+AVPacket *PacketPool::get()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!free_packets.empty())
+        {
+            AVPacket *pkt = free_packets.back();
+            free_packets.pop_back();
+            return pkt;
+        }
+    }
+
+    AVPacket *pkt = av_packet_alloc();
+    if (pkt)
+        allocated++;
+
+    return pkt;
+}
+
+void PacketPool::put(AVPacket *pkt)
+{
+    if (!pkt)
+        return;
+
+    av_packet_unref(pkt);
+    std::lock_guard<std::mutex> lock(mutex);
+    free_packets.push_back(pkt);
+}
@@ -0,0 +1,56 @@
+#ifndef AV_POOL_HPP
+#define AV_POOL_HPP
+
+#include <stddef.h>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/frame.h>
+}
+
+/**
+ * Reuses the AVFrame structs of the encode loop instead of allocating one
+ * for every frame. Frames are returned empty, and are unreferenced when they
+ * are put back. Both can happen from any thread.
+ */
+class FramePool
+{
+  public:
+    ~FramePool();
+
+    /* An empty frame, NULL if it can't be allocated */
+    AVFrame *get();
+    /* Unreference the frame and keep it for the next get() */
+    void put(AVFrame *frame);
+
+    /* How many frames the pool allocated so far */
+    size_t allocations() const { return allocated; }
+
+  private:
+    std::mutex mutex;
+    std::vector<AVFrame*> free_frames;
+    std::atomic<size_t> allocated{0};
+};
+
+/* Like FramePool, for the packets between the encoders and the outputs */
+class PacketPool
+{
+  public:
+    ~PacketPool();
+
+    AVPacket *get();
+    void put(AVPacket *pkt);
+
+    size_t allocations() const { return allocated; }
+
+  private:
+    std::mutex mutex;
+    std::vector<AVPacket*> free_packets;
+    std::atomic<size_t> allocated{0};
+};
+
+#endif /* end of include guard: AV_POOL_HPP */
@@ -0,0 +1,74 @@
+#include "bitrate-controller.hpp"
+
+#include <algorithm>
+#include <stdio.h>
+
+/* The output is congested when this share of its queue is filled, or when
+ * writing a packet takes this long on average */
+#define CONGESTED_QUEUE_FILL 0.1
+#define CONGESTED_WRITE_USEC 20000
+/* Severe congestion lowers the bitrate faster */
+#define SEVERE_QUEUE_FILL 0.4
+/* The output keeps up when its queue is almost empty */
+#define CLEAR_QUEUE_FILL 0.02
+/* Samples in a row the output has to keep up before raising the bitrate */
+#define CLEAR_SAMPLES 4
+/* The bitrate is never lowered below this share of the configured one */
+#define MIN_BITRATE_PERCENT 15
+
+/* Encoders which pick up bit_rate and rc_max_rate of their context for
+ * every frame */
+static const char *RECONFIGURABLE_ENCODERS[] = {
+    "libx264", "h264_nvenc", "hevc_nvenc", "av1_nvenc",
+};
+
+BitrateController::BitrateController(int64_t _max_bitrate) :
+    max_bitrate(_max_bitrate), bitrate(_max_bitrate)
+{ }
+
+bool BitrateController::supports_encoder(const std::string& codec)
+{
+    return std::find(std::begin(RECONFIGURABLE_ENCODERS), std::end(RECONFIGURABLE_ENCODERS),
+        codec) != std::end(RECONFIGURABLE_ENCODERS);
+}
+
+int64_t BitrateController::update(const OutputCongestion& congestion)
+{
+    char buf[128];
+    int64_t min_bitrate = max_bitrate * MIN_BITRATE_PERCENT / 100;
+
+    /* After lowering the bitrate the queue needs some time to drain, it
+     * only counts as congested as long as it doesn't shrink */
+    bool draining = congestion.queue_fill < last_queue_fill;
+    last_queue_fill = congestion.queue_fill;
+
+    bool congested = !draining && (congestion.queue_fill >= CONGESTED_QUEUE_FILL ||
+        congestion.write_usec >= CONGESTED_WRITE_USEC);
+    if (congested)
+    {
+        clear_samples = 0;
+        if (bitrate <= min_bitrate)
+            return 0;
+
+        double factor = congestion.queue_fill >= SEVERE_QUEUE_FILL ? 0.5 : 0.75;
+        bitrate = std::max<int64_t>(bitrate * factor, min_bitrate);
+        snprintf(buf, sizeof(buf), "%.0f%% of the queue filled, %.1f ms per packet",
+            congestion.queue_fill * 100, congestion.write_usec / 1000.0);
+        last_reason = buf;
+        return bitrate;
+    }
+
+    if (bitrate >= max_bitrate || congestion.queue_fill > CLEAR_QUEUE_FILL)
+    {
+        clear_samples = 0;
+        return 0;
+    }
+
+    if (++clear_samples < CLEAR_SAMPLES)
+        return 0;
+
+    clear_samples = 0;
+    bitrate = std::min<int64_t>(bitrate * 1.15, max_bitrate);
+    last_reason = "the output keeps up";
+    return bitrate;
+}
@@ -0,0 +1,38 @@
+#ifndef BITRATE_CONTROLLER_HPP
+#define BITRATE_CONTROLLER_HPP
+
+#include <stdint.h>
+#include <string>
+#include "output-sink.hpp"
+
+/**
+ * Adapts the bitrate of an encoder to the network outputs it is sent to.
+ * When the queue of an output fills up or writing its packets blocks, the
+ * link can't carry the bitrate, so it is lowered. It is raised again step by
+ * step while the outputs keep up, up to the configured bitrate.
+ */
+class BitrateController
+{
+  public:
+    /* max_bitrate is the configured bitrate of the encoder */
+    BitrateController(int64_t max_bitrate);
+
+    /* Feed the congestion of the most congested output. Returns the new
+     * bitrate, or 0 if it should not change. */
+    int64_t update(const OutputCongestion& congestion);
+
+    /* Why the bitrate was changed last */
+    const std::string& reason() const { return last_reason; }
+
+    /* Whether the bitrate of the given encoder can be changed while encoding */
+    static bool supports_encoder(const std::string& codec);
+
+  private:
+    int64_t max_bitrate;
+    int64_t bitrate;
+    int clear_samples = 0;
+    double last_queue_fill = 0;
+    std::string last_reason;
+};
+
+#endif /* end of include guard: BITRATE_CONTROLLER_HPP */
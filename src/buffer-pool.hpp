@@ -1,6 +1,8 @@
 #pragma once
 
 #include <array>
+#include <cstdint>
+#include <vector>
 #include <mutex>
 #include <atomic>
 #include <type_traits>
@@ -10,16 +12,17 @@ class buffer_pool_buf
 public:
     bool ready_capture() const
     {
-        return released;
+        return released && !holds;
     }
 
-    bool ready_encode() const
+    bool ready_encode(size_t consumer = 0) const
     {
-        return available;
+        return available & (1u << consumer);
     }
 
     std::atomic<bool> released{true}; // if the buffer can be used to store new pending frames
-    std::atomic<bool> available{false}; // if the buffer can be used to feed the encoder
+    std::atomic<uint32_t> available{0}; // mask of the consumers which still have to encode the buffer
+    std::atomic<uint32_t> holds{0}; // references to the pixels which outlive the encoding, e.g. in the encoder
 };
 
 template <class T, int N>
@@ -28,6 +31,8 @@ class buffer_pool
 public:
     static_assert(std::is_base_of<buffer_pool_buf, T>::value, "T must be subclass of buffer_pool_buf");
 
+    static constexpr size_t max_consumers = 32;
+
     buffer_pool()
     {
         for (size_t i = 0; i < bufs_size; ++i) {
@@ -52,56 +57,112 @@ public:
         return bufs[i];
     }
 
-    T& capture()
+    T* at(size_t i)
+    {
+        return bufs[i];
+    }
+
+    // Set the number of consumers which encode every captured buffer.
+    // Must be called before the first capture.
+    void set_consumers(size_t consumers)
     {
         std::lock_guard<std::mutex> lock(mutex);
-        return *bufs[capture_idx];
+        encode_idx.assign(consumers, 0);
     }
 
-    T& encode()
+    T& encode(size_t consumer = 0)
     {
         std::lock_guard<std::mutex> lock(mutex);
-        return *bufs[encode_idx];
+        return *bufs[encode_idx[consumer]];
     }
 
-    // Signal that the current capture buffer has been successfully obtained
-    // from the compositor and select the next buffer to capture in.
-    T& next_capture()
+    // Select a free buffer for a new capture request. Several captures can
+    // be in flight, they have to be finished in the order they were requested.
+    // Returns nullptr if all buffers are in use.
+    T* request_capture()
     {
         std::lock_guard<std::mutex> lock(mutex);
-        bufs[capture_idx]->released = false;
-        bufs[capture_idx]->available = true;
-        size_t next = (capture_idx + 1) % bufs_size;
-        if (!bufs[next]->ready_capture() && bufs_size < N) {
-            bufs_size++;
-            next = (capture_idx + 1) % bufs_size;
-            for (size_t i = N - 1; i > next; --i) {
-                bufs[i] = bufs[i - 1];
-                if (encode_idx == i - 1) {
-                    encode_idx = i;
-                }
+        if (!bufs[request_idx]->ready_capture()) {
+            if (bufs_size == N) {
+                return nullptr;
             }
-            bufs[next] = new T;
+
+            insert_buffer(request_idx);
         }
-        capture_idx = next;
-        return *bufs[capture_idx];
+
+        T *buf = bufs[request_idx];
+        buf->released = false;
+        request_idx = (request_idx + 1) % bufs_size;
+        in_flight++;
+        return buf;
+    }
+
+    // Signal that the oldest capture in flight has been successfully obtained
+    // from the compositor, so that the consumers can encode it.
+    void finish_capture()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bufs[capture_idx]->available = (uint32_t)((1ull << encode_idx.size()) - 1);
+        capture_idx = (capture_idx + 1) % bufs_size;
+        in_flight--;
     }
 
     // Signal that the encode buffer has been submitted for encoding
-    // and select the next buffer for encoding.
-    T& next_encode()
+    // and select the next buffer for encoding. The buffer is released
+    // once all consumers are done with it.
+    T& next_encode(size_t consumer = 0)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t& idx = encode_idx[consumer];
+        bufs[idx]->available &= ~(1u << consumer);
+        if (!bufs[idx]->available) {
+            bufs[idx]->released = true;
+        }
+        idx = (idx + 1) % bufs_size;
+        return *bufs[idx];
+    }
+
+    // Number of captured buffers which the slowest consumer still has to encode
+    size_t queued_encode()
     {
         std::lock_guard<std::mutex> lock(mutex);
-        bufs[encode_idx]->available = false;
-        bufs[encode_idx]->released = true;
-        encode_idx = (encode_idx + 1) % bufs_size;
-        return *bufs[encode_idx];
+        size_t queued = 0;
+        for (size_t i = 0; i < bufs_size; ++i) {
+            if (bufs[i]->available) {
+                queued++;
+            }
+        }
+        return queued;
     }
 
 private:
+    // Grow the pool by inserting a new buffer before the one at pos
+    void insert_buffer(size_t pos)
+    {
+        for (size_t i = bufs_size; i > pos; --i) {
+            bufs[i] = bufs[i - 1];
+        }
+        bufs[pos] = new T;
+        bufs_size++;
+
+        for (auto& idx : encode_idx) {
+            if (idx >= pos) {
+                idx++;
+            }
+        }
+
+        if (in_flight && capture_idx >= pos) {
+            capture_idx++;
+        } else if (!in_flight) {
+            capture_idx = pos;
+        }
+    }
+
     std::mutex mutex;
-    std::array<T*, N> bufs;
+    std::array<T*, N> bufs{};
     size_t bufs_size = 2;
-    size_t capture_idx = 0;
-    size_t encode_idx = 0;
+    size_t capture_idx = 0; // the oldest capture in flight
+    size_t request_idx = 0; // the buffer for the next capture request
+    size_t in_flight = 0;
+    std::vector<size_t> encode_idx = std::vector<size_t>(1, 0);
 };
@@ -0,0 +1,149 @@
+#include "capability-cache.hpp"
+
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavfilter/avfilter.h>
+    #include <libavformat/avformat.h>
+    #include <libavutil/avutil.h>
+}
+
+static std::mutex cache_mutex;
+static bool cache_enabled = false;
+static bool cache_dirty = false;
+static std::map<std::string, std::string> entries;
+static std::atomic<uint64_t> hits{0}, misses{0};
+
+std::string cache_directory()
+{
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg)
+        return std::string(xdg) + "/wf-recorder";
+
+    const char *home = getenv("HOME");
+    if (home && *home)
+        return std::string(home) + "/.cache/wf-recorder";
+
+    return "";
+}
+
+/* The probed capabilities change with the libraries, a new build of one of
+ * them invalidates the cache */
+static std::string version_stamp()
+{
+    std::ostringstream stamp;
+    stamp << "# " << LIBAVCODEC_IDENT << " " << avcodec_version() << " " <<
+        LIBAVFILTER_IDENT << " " << avfilter_version() << " " <<
+        LIBAVFORMAT_IDENT << " " << avformat_version() << " " <<
+        LIBAVUTIL_IDENT << " " << avutil_version();
+    return stamp.str();
+}
+
+void capability_cache_load(bool enabled)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    cache_enabled = enabled;
+    std::string dir = cache_directory();
+    if (!enabled || dir.empty())
+        return;
+
+    std::ifstream cache(dir + "/capabilities");
+    std::string line;
+    if (!std::getline(cache, line) || line != version_stamp())
+        return;
+
+    while (std::getline(cache, line))
+    {
+        size_t tab = line.find('\t');
+        if (tab != std::string::npos)
+            entries[line.substr(0, tab)] = line.substr(tab + 1);
+    }
+}
+
+bool capability_cache_get(const std::string& key, std::string& value)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto it = entries.find(key);
+    if (!cache_enabled || it == entries.end())
+    {
+        misses++;
+        return false;
+    }
+
+    hits++;
+    value = it->second;
+    return true;
+}
+
+void capability_cache_set(const std::string& key, const std::string& value)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (!cache_enabled)
+        return;
+
+    auto& entry = entries[key];
+    if (entry != value)
+    {
+        entry = value;
+        cache_dirty = true;
+    }
+}
+
+void capability_cache_save()
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    std::string dir = cache_directory();
+    if (!cache_dirty || dir.empty())
+        return;
+
+    /* $XDG_CACHE_HOME may not exist yet either */
+    mkdir(dir.substr(0, dir.rfind('/')).c_str(), 0700);
+    mkdir(dir.c_str(), 0700);
+
+    /* Replaced at once, so that a recording starting at the same time
+     * doesn't read half of it */
+    std::string file = dir + "/capabilities";
+    std::string tmp = file + "." + std::to_string(getpid());
+    {
+        std::ofstream out(tmp);
+        out << version_stamp() << "\n";
+        for (auto& entry : entries)
+            out << entry.first << "\t" << entry.second << "\n";
+        if (!out)
+        {
+            std::cerr << "Failed to write the capability cache " << tmp << std::endl;
+            unlink(tmp.c_str());
+            return;
+        }
+    }
+
+    if (rename(tmp.c_str(), file.c_str()) < 0)
+    {
+        perror("rename");
+        unlink(tmp.c_str());
+        return;
+    }
+
+    cache_dirty = false;
+}
+
+uint64_t capability_cache_hits()
+{
+    return hits;
+}
+
+uint64_t capability_cache_misses()
+{
+    return misses;
+}
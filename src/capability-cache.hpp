@@ -0,0 +1,34 @@
+#ifndef CAPABILITY_CACHE_HPP
+#define CAPABILITY_CACHE_HPP
+
+#include <stdint.h>
+#include <string>
+
+/* The directory of the caches of wf-recorder, $XDG_CACHE_HOME/wf-recorder,
+ * empty if there is no home directory */
+std::string cache_directory();
+
+/**
+ * What was probed from libav and the drivers in earlier runs, like the pixel
+ * format chosen for a codec and input format or the render node of a DRM
+ * device, in $XDG_CACHE_HOME/wf-recorder/capabilities. The cache is dropped
+ * when the versions of the libav libraries differ from the ones it was
+ * written with. Entries which depend on a device contain its ID in the key,
+ * and the caller checks that they still match.
+ */
+void capability_cache_load(bool enabled);
+
+/* Look up a probed value, false if it has to be probed */
+bool capability_cache_get(const std::string& key, std::string& value);
+
+/* Remember a probed value, written by capability_cache_save() */
+void capability_cache_set(const std::string& key, const std::string& value);
+
+/* Write the cache if anything was added */
+void capability_cache_save();
+
+/* Lookups which were answered from the cache and which had to probe */
+uint64_t capability_cache_hits();
+uint64_t capability_cache_misses();
+
+#endif /* end of include guard: CAPABILITY_CACHE_HPP */
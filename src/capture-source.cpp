@@ -0,0 +1,281 @@
+#include "capture-source.hpp"
+#include "config.h"
+#include "screencopy-source.hpp"
+#include "synthetic-source.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+
+#ifdef HAVE_EXT_IMAGE_COPY_CAPTURE
+#include "ext-capture-source.hpp"
+#endif
+
+#include <iostream>
+#include <limits>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <gbm.h>
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
+
+#define MAX_FRAME_FAILURES 16
+
+CaptureSource *CaptureSource::create(const CaptureSourceParams& params)
+{
+    CaptureSource *source = nullptr;
+    if (params.backend == "screencopy")
+        source = new ScreencopySource(params);
+#ifdef HAVE_EXT_IMAGE_COPY_CAPTURE
+    else if (params.backend == "ext")
+        source = new ExtCaptureSource(params);
+#endif
+    else if (params.backend == "synthetic")
+        source = new SyntheticSource(params);
+
+    return source;
+}
+
+size_t CaptureSource::max_frames_in_flight() const
+{
+    return std::numeric_limits<size_t>::max();
+}
+
+std::unique_ptr<capture_frame> CaptureSource::create_frame()
+{
+    return std::unique_ptr<capture_frame>(new capture_frame);
+}
+
+void CaptureSource::request_frame(wf_buffer *buffer)
+{
+    frames.push_back(create_frame());
+    frames.back()->buffer = buffer;
+    metrics_gauge_add(METRICS_FRAMES_IN_FLIGHT, 1);
+    restart_frame(*frames.back());
+}
+
+void CaptureSource::restart_frame(capture_frame& frame)
+{
+    frame.done = false;
+    frame.requested_usec = get_monotonic_usec();
+
+    TraceScope trace("capture request");
+    start_frame(frame);
+}
+
+capture_frame *CaptureSource::oldest_done_frame() const
+{
+    if (frames.empty() || !frames.front()->done)
+        return nullptr;
+
+    return frames.front().get();
+}
+
+void CaptureSource::release_frame()
+{
+    destroy_frame(*frames.front());
+    frames.pop_front();
+    metrics_gauge_add(METRICS_FRAMES_IN_FLIGHT, -1);
+}
+
+void CaptureSource::destroy_frames()
+{
+    for (auto& frame : frames)
+        destroy_frame(*frame);
+    metrics_gauge_add(METRICS_FRAMES_IN_FLIGHT, -(int64_t)frames.size());
+    frames.clear();
+}
+
+void CaptureSource::frame_ready(capture_frame& frame)
+{
+    frame.done = true;
+    frame_failed_cnt = 0;
+}
+
+void CaptureSource::frame_failed(capture_frame& frame)
+{
+    metrics_count(METRICS_COPIES_FAILED);
+    if (++frame_failed_cnt > MAX_FRAME_FAILURES)
+    {
+        stop("Failed to copy frame too many times, exiting!");
+        return;
+    }
+
+    std::cerr << "Failed to copy frame, retrying..." << std::endl;
+    restart_frame(frame);
+}
+
+void CaptureSource::stop(const std::string& reason)
+{
+    if (!stopped)
+        std::cerr << reason << std::endl;
+    stopped = true;
+}
+
+void CaptureSource::free_buffer(wf_buffer& buffer)
+{
+    if (buffer.params)
+    {
+        zwp_linux_buffer_params_v1_destroy(buffer.params);
+        buffer.params = NULL;
+    }
+
+    if (buffer.bo)
+    {
+        if (buffer.wl_buffer)
+            wl_buffer_destroy(buffer.wl_buffer);
+        buffer.wl_buffer = NULL;
+        gbm_bo_destroy(buffer.bo);
+        buffer.bo = NULL;
+        return;
+    }
+
+    free_shm_buffer(buffer);
+}
+
+uint64_t timespec_to_usec (const timespec& ts)
+{
+    return ts.tv_sec * 1000000ll + 1ll * ts.tv_nsec / 1000ll;
+}
+
+uint64_t get_monotonic_usec()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return timespec_to_usec(ts);
+}
+
+std::optional<InputFormat> get_shm_input_format(uint32_t format)
+{
+    switch (format) {
+    case WL_SHM_FORMAT_ARGB8888:
+    case WL_SHM_FORMAT_XRGB8888:
+        return INPUT_FORMAT_BGR0;
+    case WL_SHM_FORMAT_XBGR8888:
+    case WL_SHM_FORMAT_ABGR8888:
+        return INPUT_FORMAT_RGB0;
+    case WL_SHM_FORMAT_BGR888:
+        return INPUT_FORMAT_BGR8;
+    case WL_SHM_FORMAT_RGB565:
+        return INPUT_FORMAT_RGB565;
+    case WL_SHM_FORMAT_BGR565:
+        return INPUT_FORMAT_BGR565;
+    case WL_SHM_FORMAT_ARGB2101010:
+    case WL_SHM_FORMAT_XRGB2101010:
+        return INPUT_FORMAT_X2RGB10;
+    case WL_SHM_FORMAT_ABGR2101010:
+    case WL_SHM_FORMAT_XBGR2101010:
+        return INPUT_FORMAT_X2BGR10;
+    case WL_SHM_FORMAT_ABGR16161616:
+    case WL_SHM_FORMAT_XBGR16161616:
+        return INPUT_FORMAT_RGBX64;
+    case WL_SHM_FORMAT_ARGB16161616:
+    case WL_SHM_FORMAT_XRGB16161616:
+        return INPUT_FORMAT_BGRX64;
+    case WL_SHM_FORMAT_ABGR16161616F:
+    case WL_SHM_FORMAT_XBGR16161616F:
+        return INPUT_FORMAT_RGBX64F;
+    default:
+        return {};
+    }
+}
+
+int get_bytes_per_pixel(InputFormat format)
+{
+    switch (format)
+    {
+      case INPUT_FORMAT_BGR8:
+        return 3;
+      case INPUT_FORMAT_RGB565:
+      case INPUT_FORMAT_BGR565:
+        return 2;
+      case INPUT_FORMAT_RGBX64:
+      case INPUT_FORMAT_BGRX64:
+      case INPUT_FORMAT_RGBX64F:
+        return 8;
+      default:
+        return 4;
+    }
+}
+
+uint32_t wl_shm_to_drm_format(uint32_t format)
+{
+    if (format == WL_SHM_FORMAT_ARGB8888) {
+        return GBM_FORMAT_ARGB8888;
+    } else if (format == WL_SHM_FORMAT_XRGB8888) {
+        return GBM_FORMAT_XRGB8888;
+    } else {
+        return format;
+    }
+}
+
+wl_shm_format drm_to_wl_shm_format(uint32_t format)
+{
+    if (format == GBM_FORMAT_ARGB8888) {
+        return WL_SHM_FORMAT_ARGB8888;
+    } else if (format == GBM_FORMAT_XRGB8888) {
+        return WL_SHM_FORMAT_XRGB8888;
+    } else {
+        return (wl_shm_format)format;
+    }
+}
+
+static int backingfile(off_t size)
+{
+    char name[] = "/tmp/wf-recorder-shared-XXXXXX";
+    int fd = mkstemp(name);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int ret;
+    while ((ret = ftruncate(fd, size)) == EINTR) {
+        // No-op
+    }
+    if (ret < 0) {
+        close(fd);
+        return -1;
+    }
+
+    unlink(name);
+    return fd;
+}
+
+struct wl_buffer *create_shm_buffer(wl_shm *shm, uint32_t fmt,
+    int width, int height, int stride, void **data_out)
+{
+    int size = stride * height;
+
+    int fd = backingfile(size);
+    if (fd < 0) {
+        fprintf(stderr, "creating a buffer file for %d B failed: %m\n", size);
+        return NULL;
+    }
+
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "mmap failed: %m\n");
+        close(fd);
+        return NULL;
+    }
+
+    struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
+    close(fd);
+    struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0, width, height,
+        stride, fmt);
+    wl_shm_pool_destroy(pool);
+
+    *data_out = data;
+    return buffer;
+}
+
+void free_shm_buffer(wf_buffer& buffer)
+{
+    if (buffer.wl_buffer == NULL)
+    {
+        return;
+    }
+
+    munmap(buffer.data, buffer.size);
+    wl_buffer_destroy(buffer.wl_buffer);
+    buffer.wl_buffer = NULL;
+}
@@ -0,0 +1,211 @@
+#ifndef CAPTURE_SOURCE_HPP
+#define CAPTURE_SOURCE_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <list>
+#include <memory>
+#include <optional>
+#include <string>
+#include <algorithm>
+#include <wayland-client-protocol.h>
+
+#include "buffer-pool.hpp"
+#include "frame-writer.hpp"
+
+struct gbm_bo;
+struct gbm_device;
+struct zwp_linux_dmabuf_v1;
+struct zwp_linux_buffer_params_v1;
+struct zwlr_screencopy_manager_v1;
+struct ext_image_copy_capture_manager_v1;
+struct ext_output_image_capture_source_manager_v1;
+
+struct capture_region
+{
+    int32_t x, y;
+    int32_t width, height;
+
+    capture_region()
+        : capture_region(0, 0, 0, 0) {}
+
+    capture_region(int32_t _x, int32_t _y, int32_t _width, int32_t _height)
+        : x(_x), y(_y), width(_width), height(_height) { }
+
+    void set_from_string(std::string geometry_string)
+    {
+        if (sscanf(geometry_string.c_str(), "%d,%d %dx%d", &x, &y, &width, &height) != 4)
+        {
+            fprintf(stderr, "Bad geometry: %s, capturing whole output instead.\n",
+                geometry_string.c_str());
+            x = y = width = height = 0;
+            return;
+        }
+    }
+
+    bool is_selected() const
+    {
+        return width > 0 && height > 0;
+    }
+
+    /* Grow the region to the bounding box of both regions */
+    void add(const capture_region& other)
+    {
+        if (!other.is_selected())
+            return;
+
+        if (!is_selected())
+        {
+            *this = other;
+            return;
+        }
+
+        int32_t x2 = std::max(x + width, other.x + other.width);
+        int32_t y2 = std::max(y + height, other.y + other.height);
+        x = std::min(x, other.x);
+        y = std::min(y, other.y);
+        width = x2 - x;
+        height = y2 - y;
+    }
+
+    bool contained_in(const capture_region& output) const
+    {
+        return
+            output.x <= x &&
+            output.x + output.width >= x + width &&
+            output.y <= y &&
+            output.y + output.height >= y + height;
+    }
+};
+
+struct wf_buffer : public buffer_pool_buf
+{
+    struct gbm_bo *bo = nullptr;
+    zwp_linux_buffer_params_v1 *params = nullptr;
+    struct wl_buffer *wl_buffer = nullptr;
+    void *data = nullptr;
+    size_t size = 0;
+    enum wl_shm_format format;
+    int drm_format;
+    int width, height, stride;
+    bool y_invert;
+
+    timespec presented;
+    uint64_t base_usec;
+    uint64_t delivered_usec; // when the frame was handed to the writers
+
+    /* Part of the buffer which changed since the previous frame */
+    capture_region damage;
+};
+
+struct CaptureSourceParams
+{
+    /* screencopy, ext or synthetic */
+    std::string backend;
+
+    wl_output *output = NULL;
+    /* Part of the output to capture relative to the output, the whole
+     * output if not selected. Only supported by screencopy. */
+    capture_region region;
+
+    bool use_dmabuf = false;
+    bool use_damage = true;
+
+    wl_shm *shm = NULL;
+    zwp_linux_dmabuf_v1 *dmabuf = NULL;
+    struct gbm_device *gbm_device = NULL;
+    zwlr_screencopy_manager_v1 *screencopy_manager = NULL;
+    ext_image_copy_capture_manager_v1 *ext_copy_manager = NULL;
+    ext_output_image_capture_source_manager_v1 *ext_source_manager = NULL;
+
+    /* Frames of the synthetic source */
+    int32_t width = 0, height = 0;
+    uint32_t format = WL_SHM_FORMAT_XRGB8888;
+    std::string content = "bar"; // static, bar, scrolling or video
+};
+
+/* A frame which is being captured into a buffer. Backends extend it with
+ * their protocol objects. */
+struct capture_frame
+{
+    wf_buffer *buffer = nullptr;
+    uint64_t requested_usec = 0;
+    bool done = false;
+
+    virtual ~capture_frame() {}
+};
+
+/**
+ * Delivers the frames of one capture target, for example an output of the
+ * compositor, into the buffers of its pool.
+ *
+ * Frames finish in the order they were requested. Once the oldest frame is
+ * done, its buffer holds the image, the presentation time and the damage
+ * since the previous frame. Backends which wait for the compositor make
+ * progress while the main loop dispatches the Wayland events.
+ */
+class CaptureSource
+{
+  public:
+    virtual ~CaptureSource() {}
+    static CaptureSource *create(const CaptureSourceParams& params);
+
+    /* Start capturing a frame into the buffer */
+    void request_frame(wf_buffer *buffer);
+
+    /* Number of frames which were requested and not released yet */
+    size_t frames_in_flight() const { return frames.size(); }
+
+    /* Maximum number of frames the backend can capture at the same time */
+    virtual size_t max_frames_in_flight() const;
+
+    /* The oldest frame in flight if it is done, NULL otherwise */
+    capture_frame *oldest_done_frame() const;
+
+    /* Release the oldest frame, once its buffer was handed to the encoders */
+    void release_frame();
+
+    /* Free the memory which the backend allocated for the buffer */
+    virtual void free_buffer(wf_buffer& buffer);
+
+    /* The source stopped delivering frames, for example because the output
+     * was removed or the frames failed too many times */
+    bool is_stopped() const { return stopped; }
+
+    /* Used by the event handlers of the backends */
+    void frame_ready(capture_frame& frame);
+    void frame_failed(capture_frame& frame);
+    void stop(const std::string& reason);
+
+    CaptureSourceParams params;
+
+  protected:
+    std::list<std::unique_ptr<capture_frame>> frames; // oldest first
+    int32_t frame_failed_cnt = 0;
+    bool stopped = false;
+
+    virtual std::unique_ptr<capture_frame> create_frame();
+    /* Ask for the frame. Called again when a frame has to be retried. */
+    virtual void start_frame(capture_frame& frame) = 0;
+    /* Destroy the protocol objects of the frame */
+    virtual void destroy_frame(capture_frame&) {}
+    /* Destroy all frames in flight, for the destructors of the backends */
+    void destroy_frames();
+
+    void restart_frame(capture_frame& frame);
+};
+
+uint64_t timespec_to_usec(const timespec& ts);
+uint64_t get_monotonic_usec();
+
+std::optional<InputFormat> get_shm_input_format(uint32_t format);
+int get_bytes_per_pixel(InputFormat format);
+uint32_t wl_shm_to_drm_format(uint32_t format);
+wl_shm_format drm_to_wl_shm_format(uint32_t format);
+
+struct wl_buffer *create_shm_buffer(wl_shm *shm, uint32_t fmt,
+    int width, int height, int stride, void **data_out);
+void free_shm_buffer(wf_buffer& buffer);
+
+#endif /* end of include guard: CAPTURE_SOURCE_HPP */
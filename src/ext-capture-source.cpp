@@ -0,0 +1,321 @@
+#include "ext-capture-source.hpp"
+
+#include <gbm.h>
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
+#include "ext-image-capture-source-v1-client-protocol.h"
+#include "ext-image-copy-capture-v1-client-protocol.h"
+
+struct ext_capture_frame : public capture_frame
+{
+    ExtCaptureSource *source;
+    ext_image_copy_capture_frame_v1 *frame = NULL;
+    uint32_t generation = 0; // of the buffer constraints the frame was requested with
+    bool waiting_constraints = false;
+    bool has_presentation_time = false;
+    capture_region damage;
+};
+
+static void session_handle_buffer_size(void *data,
+    ext_image_copy_capture_session_v1 *, uint32_t width, uint32_t height)
+{
+    auto source = (ExtCaptureSource*) data;
+    source->pending_constraints.width = width;
+    source->pending_constraints.height = height;
+}
+
+static void session_handle_shm_format(void *data,
+    ext_image_copy_capture_session_v1 *, uint32_t format)
+{
+    auto source = (ExtCaptureSource*) data;
+    source->pending_constraints.shm_formats.push_back(format);
+}
+
+static void session_handle_dmabuf_device(void *,
+    ext_image_copy_capture_session_v1 *, struct wl_array *)
+{
+}
+
+static void session_handle_dmabuf_format(void *data,
+    ext_image_copy_capture_session_v1 *, uint32_t format, struct wl_array *)
+{
+    auto source = (ExtCaptureSource*) data;
+    source->pending_constraints.dmabuf_formats.push_back(format);
+}
+
+static void session_handle_done(void *data, ext_image_copy_capture_session_v1 *)
+{
+    auto source = (ExtCaptureSource*) data;
+    source->constraints_done();
+}
+
+static void session_handle_stopped(void *data, ext_image_copy_capture_session_v1 *)
+{
+    auto source = (ExtCaptureSource*) data;
+    source->stop("Capture session stopped");
+}
+
+static const struct ext_image_copy_capture_session_v1_listener session_listener = {
+    .buffer_size = session_handle_buffer_size,
+    .shm_format = session_handle_shm_format,
+    .dmabuf_device = session_handle_dmabuf_device,
+    .dmabuf_format = session_handle_dmabuf_format,
+    .done = session_handle_done,
+    .stopped = session_handle_stopped,
+};
+
+static void frame_handle_transform(void *data,
+    ext_image_copy_capture_frame_v1 *, uint32_t transform)
+{
+    auto frame = (ext_capture_frame*) data;
+    frame->buffer->y_invert = transform == WL_OUTPUT_TRANSFORM_FLIPPED_180;
+}
+
+static void frame_handle_damage(void *data, ext_image_copy_capture_frame_v1 *,
+    int32_t x, int32_t y, int32_t width, int32_t height)
+{
+    auto frame = (ext_capture_frame*) data;
+    frame->damage.add(capture_region{x, y, width, height});
+}
+
+static void frame_handle_presentation_time(void *data, ext_image_copy_capture_frame_v1 *,
+    uint32_t tv_sec_hi, uint32_t tv_sec_low, uint32_t tv_nsec)
+{
+    auto frame = (ext_capture_frame*) data;
+    frame->buffer->presented.tv_sec = ((1ll * tv_sec_hi) << 32ll) | tv_sec_low;
+    frame->buffer->presented.tv_nsec = tv_nsec;
+    frame->has_presentation_time = true;
+}
+
+static void frame_handle_ready(void *data, ext_image_copy_capture_frame_v1 *)
+{
+    auto frame = (ext_capture_frame*) data;
+    if (!frame->has_presentation_time)
+        clock_gettime(CLOCK_MONOTONIC, &frame->buffer->presented);
+
+    frame->source->frame_done(*frame, frame->damage);
+}
+
+static void frame_handle_failed(void *data, ext_image_copy_capture_frame_v1 *,
+    uint32_t reason)
+{
+    auto frame = (ext_capture_frame*) data;
+    switch (reason)
+    {
+      case EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_BUFFER_CONSTRAINTS:
+        frame->source->frame_constraints_failed(*frame);
+        return;
+      case EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_STOPPED:
+        frame->source->stop("Capture session stopped");
+        return;
+    }
+
+    frame->source->frame_failed(*frame);
+}
+
+static const struct ext_image_copy_capture_frame_v1_listener frame_listener = {
+    .transform = frame_handle_transform,
+    .damage = frame_handle_damage,
+    .presentation_time = frame_handle_presentation_time,
+    .ready = frame_handle_ready,
+    .failed = frame_handle_failed,
+};
+
+ExtCaptureSource::ExtCaptureSource(const CaptureSourceParams& _params)
+{
+    params = _params;
+    source = ext_output_image_capture_source_manager_v1_create_source(
+        params.ext_source_manager, params.output);
+    session = ext_image_copy_capture_manager_v1_create_session(
+        params.ext_copy_manager, source,
+        EXT_IMAGE_COPY_CAPTURE_MANAGER_V1_OPTIONS_PAINT_CURSORS);
+    ext_image_copy_capture_session_v1_add_listener(session, &session_listener, this);
+}
+
+ExtCaptureSource::~ExtCaptureSource()
+{
+    destroy_frames();
+    ext_image_copy_capture_session_v1_destroy(session);
+    ext_image_capture_source_v1_destroy(source);
+}
+
+std::unique_ptr<capture_frame> ExtCaptureSource::create_frame()
+{
+    auto frame = new ext_capture_frame;
+    frame->source = this;
+    return std::unique_ptr<capture_frame>(frame);
+}
+
+void ExtCaptureSource::constraints_done()
+{
+    auto& pending = pending_constraints;
+    bool changed = pending.width != constraints.width || pending.height != constraints.height ||
+        pending.shm_formats != constraints.shm_formats ||
+        pending.dmabuf_formats != constraints.dmabuf_formats;
+
+    /* The buffers are reallocated when they are next used */
+    if (changed || generation == 0)
+    {
+        constraints = pending;
+        generation++;
+    }
+    pending = ext_buffer_constraints{};
+
+    for (auto& frame : frames)
+    {
+        if (static_cast<ext_capture_frame&>(*frame).waiting_constraints)
+            restart_frame(*frame);
+    }
+}
+
+void ExtCaptureSource::frame_done(capture_frame& frame, const capture_region& damage)
+{
+    /* The other buffers are now out of date where this frame changed */
+    for (auto& region : stale)
+        region.second.add(damage);
+    stale[frame.buffer] = capture_region{};
+
+    frame.buffer->damage = damage;
+    frame_ready(frame);
+}
+
+void ExtCaptureSource::frame_constraints_failed(capture_frame& base)
+{
+    auto& frame = static_cast<ext_capture_frame&>(base);
+
+    /* Retry once the new constraints are known */
+    if (frame.generation == generation)
+    {
+        destroy_frame(frame);
+        frame.waiting_constraints = true;
+        return;
+    }
+
+    restart_frame(frame);
+}
+
+/* Pick the first advertised format which we can use, the compositor lists
+ * its preferred formats first */
+std::optional<uint32_t> ExtCaptureSource::choose_format(const std::vector<uint32_t>& formats) const
+{
+    for (auto format : formats)
+    {
+        if (params.use_dmabuf || get_shm_input_format(format).has_value())
+            return format;
+    }
+
+    return {};
+}
+
+/* (Re)allocate the buffer if it doesn't match the current constraints */
+bool ExtCaptureSource::prepare_buffer(wf_buffer& buffer)
+{
+    auto& buffer_gen = buffer_generation[&buffer];
+    if (buffer.wl_buffer && buffer_gen == generation)
+        return true;
+
+    auto format = choose_format(params.use_dmabuf ?
+        constraints.dmabuf_formats : constraints.shm_formats);
+    if (!format.has_value())
+    {
+        stop("Compositor offers no usable buffer format");
+        return false;
+    }
+
+    int width = constraints.width;
+    int height = constraints.height;
+    free_buffer(buffer);
+    if (params.use_dmabuf)
+    {
+        const uint64_t modifier = 0; // DRM_FORMAT_MOD_LINEAR
+        buffer.bo = gbm_bo_create_with_modifiers(params.gbm_device, width, height,
+            format.value(), &modifier, 1);
+        if (buffer.bo == NULL)
+        {
+            buffer.bo = gbm_bo_create(params.gbm_device, width, height, format.value(),
+                GBM_BO_USE_LINEAR | GBM_BO_USE_RENDERING);
+        }
+        if (buffer.bo == NULL)
+        {
+            stop("Failed to create gbm bo");
+            return false;
+        }
+
+        buffer.format = drm_to_wl_shm_format(format.value());
+        buffer.drm_format = format.value();
+        buffer.stride = gbm_bo_get_stride(buffer.bo);
+
+        auto dmabuf_params = zwp_linux_dmabuf_v1_create_params(params.dmabuf);
+        uint64_t mod = gbm_bo_get_modifier(buffer.bo);
+        zwp_linux_buffer_params_v1_add(dmabuf_params, gbm_bo_get_fd(buffer.bo), 0,
+            gbm_bo_get_offset(buffer.bo, 0), gbm_bo_get_stride(buffer.bo),
+            mod >> 32, mod & 0xffffffff);
+        buffer.wl_buffer = zwp_linux_buffer_params_v1_create_immed(dmabuf_params,
+            width, height, format.value(), 0);
+        zwp_linux_buffer_params_v1_destroy(dmabuf_params);
+    } else
+    {
+        buffer.format = (wl_shm_format)format.value();
+        buffer.drm_format = wl_shm_to_drm_format(format.value());
+        buffer.stride = width * get_bytes_per_pixel(get_shm_input_format(format.value()).value());
+        buffer.size = buffer.stride * height;
+        buffer.wl_buffer = create_shm_buffer(params.shm, format.value(), width, height,
+            buffer.stride, &buffer.data);
+        if (buffer.wl_buffer == NULL)
+        {
+            stop("Failed to create buffer");
+            return false;
+        }
+    }
+
+    /* ffmpeg requires even width and height */
+    buffer.width = width & ~1;
+    buffer.height = height & ~1;
+
+    buffer_gen = generation;
+    stale[&buffer] = capture_region{0, 0, width, height};
+    return true;
+}
+
+void ExtCaptureSource::start_frame(capture_frame& base)
+{
+    auto& frame = static_cast<ext_capture_frame&>(base);
+    destroy_frame(frame);
+
+    /* Buffers can only be allocated once the constraints are known */
+    frame.waiting_constraints = generation == 0;
+    if (frame.waiting_constraints)
+        return;
+
+    auto& buffer = *frame.buffer;
+    if (!prepare_buffer(buffer))
+        return;
+
+    frame.generation = generation;
+    frame.has_presentation_time = false;
+    frame.damage = capture_region{};
+    buffer.y_invert = false;
+
+    frame.frame = ext_image_copy_capture_session_v1_create_frame(session);
+    ext_image_copy_capture_frame_v1_add_listener(frame.frame, &frame_listener, &frame);
+    ext_image_copy_capture_frame_v1_attach_buffer(frame.frame, buffer.wl_buffer);
+
+    /* Only the parts which changed since the buffer was last used need copying */
+    auto& region = stale[&buffer];
+    if (region.is_selected())
+    {
+        ext_image_copy_capture_frame_v1_damage_buffer(frame.frame,
+            region.x, region.y, region.width, region.height);
+    }
+
+    ext_image_copy_capture_frame_v1_capture(frame.frame);
+}
+
+void ExtCaptureSource::destroy_frame(capture_frame& base)
+{
+    auto& frame = static_cast<ext_capture_frame&>(base);
+    if (frame.frame != NULL)
+    {
+        ext_image_copy_capture_frame_v1_destroy(frame.frame);
+        frame.frame = NULL;
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef EXT_CAPTURE_SOURCE_HPP
+#define EXT_CAPTURE_SOURCE_HPP
+
+#include "capture-source.hpp"
+#include <map>
+#include <vector>
+
+struct ext_image_capture_source_v1;
+struct ext_image_copy_capture_session_v1;
+
+/* Buffer constraints of an ext-image-copy-capture session */
+struct ext_buffer_constraints
+{
+    uint32_t width = 0, height = 0;
+    std::vector<uint32_t> shm_formats;
+    std::vector<uint32_t> dmabuf_formats;
+};
+
+/* Captures with a persistent ext-image-copy-capture session. Buffers are
+ * allocated once for each set of constraints the session announces, and
+ * only the parts which changed since a buffer was last used are copied. */
+class ExtCaptureSource : public CaptureSource
+{
+  public:
+    ExtCaptureSource(const CaptureSourceParams& params);
+    ~ExtCaptureSource();
+
+    /* A session only has one frame at a time */
+    size_t max_frames_in_flight() const override { return 1; }
+
+    /* Called from the session and frame events */
+    void constraints_done();
+    void frame_done(capture_frame& frame, const capture_region& damage);
+    void frame_constraints_failed(capture_frame& frame);
+
+    ext_buffer_constraints pending_constraints;
+
+  protected:
+    std::unique_ptr<capture_frame> create_frame() override;
+    void start_frame(capture_frame& frame) override;
+    void destroy_frame(capture_frame& frame) override;
+
+  private:
+    ext_image_capture_source_v1 *source = NULL;
+    ext_image_copy_capture_session_v1 *session = NULL;
+
+    ext_buffer_constraints constraints;
+    uint32_t generation = 0; // incremented when the constraints change
+    std::map<wf_buffer*, uint32_t> buffer_generation;
+    /* Parts of each buffer which changed since it was last captured into */
+    std::map<wf_buffer*, capture_region> stale;
+
+    std::optional<uint32_t> choose_format(const std::vector<uint32_t>& formats) const;
+    bool prepare_buffer(wf_buffer& buffer);
+};
+
+#endif /* end of include guard: EXT_CAPTURE_SOURCE_HPP */
@@ -8,13 +8,36 @@
 #include <libavfilter/version.h>
 #include <cstring>
 #include <sstream>
+#include <algorithm>
+#include <chrono>
 #include "averr.h"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "thread-stats.hpp"
+#include "thread-pool.hpp"
+#include "capability-cache.hpp"
 #include <gbm.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+extern "C"
+{
+    #include <libavutil/intreadwrite.h>
+}
 
 #define HAVE_CH_LAYOUT (LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100))
 
 static const AVRational US_RATIONAL{1,1000000} ;
 
+/* Maximum number of frames waiting to be scaled for a rendition */
+#define MAX_QUEUED_FRAMES 4
+
+/* How often the bitrate is adapted to the network outputs */
+#define BITRATE_UPDATE_INTERVAL_USEC 500000
+
+/* Dmabufs whose VAAPI frames are kept, as many as the capture buffers */
+#define MAX_MAPPED_FRAMES 16
+
 // av_register_all was deprecated in 58.9.100, removed in 59.0.100
 #if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(59, 0, 100)
 class FFmpegInitialize
@@ -43,7 +66,7 @@ void FrameWriter::init_hw_accel()
     }
 }
 
-void FrameWriter::load_codec_options(AVDictionary **dict)
+void FrameWriter::load_codec_options(VideoStream& stream, AVDictionary **dict)
 {
     using CodecOptions = std::map<std::string, std::string>;
 
@@ -66,18 +89,22 @@ void FrameWriter::load_codec_options(AVDictionary **dict)
 
     for (const auto& opts : default_codec_options)
     {
-        if (params.codec.find(opts.first) != std::string::npos)
+        if (stream.codec.find(opts.first) != std::string::npos)
         {
             for (const auto& param : opts.second)
             {
-                if (!params.codec_options.count(param.first))
-                    params.codec_options[param.first] = param.second;
+                /* A constant quality would override the requested bitrate */
+                if (stream.bitrate && param.first == "crf")
+                    continue;
+
+                if (!stream.codec_options.count(param.first))
+                    stream.codec_options[param.first] = param.second;
             }
             break;
         }
     }
 
-    for (auto& opt : params.codec_options)
+    for (auto& opt : stream.codec_options)
     {
         std::cerr << "Setting codec option: " << opt.first << "=" << opt.second << std::endl;
         av_dict_set(dict, opt.first.c_str(), opt.second.c_str(), 0);
@@ -178,19 +205,9 @@ AVPixelFormat FrameWriter::lookup_pixel_format(std::string pix_fmt)
     std::exit(-1);
 }
 
-AVPixelFormat FrameWriter::handle_buffersink_pix_fmt(const AVCodec *codec)
+/* The pixel format of the codec which best approximates the input format */
+static AVPixelFormat probe_pix_fmt(const AVCodec *codec, AVPixelFormat in_fmt)
 {
-    /* If using the default codec and no pixel format is specified,
-     * set the format to yuv420p for web friendly output by default */
-    if (params.codec == DEFAULT_CODEC && params.pix_fmt.empty())
-        params.pix_fmt = "yuv420p";
-
-    // Return with user chosen format
-    if (!params.pix_fmt.empty())
-        return lookup_pixel_format(params.pix_fmt);
-
-    auto in_fmt = get_input_format();
-
     /* For codecs such as rawvideo no supported formats are listed */
     if (!codec->pix_fmts)
         return in_fmt;
@@ -200,8 +217,6 @@ AVPixelFormat FrameWriter::handle_buffersink_pix_fmt(const AVCodec *codec)
     if (is_fmt_supported(in_fmt, codec->pix_fmts))
         return in_fmt;
 
-    /* Choose the format supported by the codec which best approximates the
-     * input fmt. */
     AVPixelFormat best_format = AV_PIX_FMT_NONE;
     for (int i = 0; codec->pix_fmts[i] != AV_PIX_FMT_NONE; i++) {
         int loss = 0;
@@ -211,6 +226,43 @@ AVPixelFormat FrameWriter::handle_buffersink_pix_fmt(const AVCodec *codec)
     return best_format;
 }
 
+/* Whether probe_pix_fmt() could have chosen the format for the codec */
+static bool codec_has_pix_fmt(const AVCodec *codec, AVPixelFormat fmt, AVPixelFormat in_fmt)
+{
+    if (!codec->pix_fmts)
+        return fmt == in_fmt;
+    return is_fmt_supported(fmt, codec->pix_fmts);
+}
+
+AVPixelFormat FrameWriter::handle_buffersink_pix_fmt(VideoStream& stream, const AVCodec *codec)
+{
+    /* If using the default codec and no pixel format is specified,
+     * set the format to yuv420p for web friendly output by default */
+    if (stream.codec == DEFAULT_CODEC && stream.pix_fmt.empty())
+        stream.pix_fmt = "yuv420p";
+
+    // Return with user chosen format
+    if (!stream.pix_fmt.empty())
+        return lookup_pixel_format(stream.pix_fmt);
+
+    auto in_fmt = stream.input_format;
+    std::string key = std::string("pix_fmt ") + codec->name + " " + av_get_pix_fmt_name(in_fmt);
+    std::string cached;
+    if (capability_cache_get(key, cached))
+    {
+        /* A cache which was edited or written by another build may hold a
+         * format the codec doesn't have, probe it again then */
+        AVPixelFormat format = av_get_pix_fmt(cached.c_str());
+        if (format != AV_PIX_FMT_NONE && codec_has_pix_fmt(codec, format, in_fmt))
+            return format;
+    }
+
+    AVPixelFormat format = probe_pix_fmt(codec, in_fmt);
+    if (format != AV_PIX_FMT_NONE)
+        capability_cache_set(key, av_get_pix_fmt_name(format));
+    return format;
+}
+
 static std::string transpose_from_transform(int32_t transform)
 {
     switch (transform)
@@ -250,94 +302,64 @@ static std::string transpose_from_transform(int32_t transform)
     return "";
 }
 
-void FrameWriter::init_video_filters(const AVCodec *codec)
+bool FrameWriter::init_filter_graph(VideoStream& stream, int width, int height,
+    AVPixelFormat format, const std::string& filter, AVPixelFormat out_format)
 {
-    if (params.transform != 0) {
-        if (params.video_filter != "null" &&
-             params.video_filter.find("transpose") == std::string::npos &&
-             params.video_filter.find("hflip") == std::string::npos &&
-             params.video_filter.find("vflip") == std::string::npos) {
-            params.video_filter += "," + transpose_from_transform(params.transform);
-        }
-        else if (params.video_filter == "null"){
-            params.video_filter = transpose_from_transform(params.transform);
-        }
-    }
-    if (params.framerate != 0){
-        if (params.video_filter != "null" && params.video_filter.find("fps") == std::string::npos) {
-            params.video_filter += ",fps=" + std::to_string(params.framerate);
-        }
-        else if (params.video_filter == "null"){
-            params.video_filter = "fps=" + std::to_string(params.framerate);
-        }
-    }
-
-    this->videoFilterGraph = avfilter_graph_alloc();
-    av_opt_set(videoFilterGraph, "scale_sws_opts", "flags=fast_bilinear:src_range=1:dst_range=1", 0);
+    stream.videoFilterGraph = avfilter_graph_alloc();
+    av_opt_set(stream.videoFilterGraph, "scale_sws_opts", "flags=fast_bilinear:src_range=1:dst_range=1", 0);
+    stream.videoFilterGraph->thread_type = AVFILTER_THREAD_SLICE;
+    stream.videoFilterGraph->nb_threads = stream.filter_threads;
+    thread_pool_attach(stream.videoFilterGraph);
 
     const AVFilter* source = avfilter_get_by_name("buffer");
     const AVFilter* sink   = avfilter_get_by_name("buffersink");
 
     if (!source || !sink) {
         std::cerr << "filtering source or sink element not found\n";
-        exit(-1);
-    }
-
-    if (this->hw_device_context) {
-        this->hw_frame_context_in = av_hwframe_ctx_alloc(this->hw_device_context);
-        AVHWFramesContext *hwfc = reinterpret_cast<AVHWFramesContext*>(this->hw_frame_context_in->data);
-        hwfc->format = AV_PIX_FMT_VAAPI;
-        hwfc->sw_format = get_drm_av_format(params.drm_format);
-        hwfc->width = params.width;
-        hwfc->height = params.height;
-        int err = av_hwframe_ctx_init(this->hw_frame_context_in);
-        if (err < 0) {
-            std::cerr << "Cannot create hw frames context: " << averr(err) << std::endl;
-            exit(-1);
-        }
+        return false;
     }
 
     // Build the configuration of the 'buffer' filter.
     // See: ffmpeg -h filter=buffer
     // See: https://ffmpeg.org/ffmpeg-filters.html#buffer
     std::stringstream buffer_filter_config;
-    buffer_filter_config << "video_size=" << params.width << "x" << params.height;
-    buffer_filter_config << ":pix_fmt=" << (int)this->get_input_format();
-    buffer_filter_config << ":time_base=" << US_RATIONAL.num << "/" << US_RATIONAL.den;
+    buffer_filter_config << "video_size=" << width << "x" << height;
+    buffer_filter_config << ":pix_fmt=" << (int)format;
+    buffer_filter_config << ":time_base=" << stream.input_time_base.num << "/" << stream.input_time_base.den;
     if (params.buffrate != 0) {
         buffer_filter_config << ":frame_rate=" << params.buffrate;
     }
     buffer_filter_config << ":pixel_aspect=1/1";
 
-    this->videoFilterSourceCtx = avfilter_graph_alloc_filter(this->videoFilterGraph,
+    stream.videoFilterSourceCtx = avfilter_graph_alloc_filter(stream.videoFilterGraph,
         source, "Source");
-    if (!this->videoFilterSourceCtx) {
+    if (!stream.videoFilterSourceCtx) {
         std::cerr << "Cannot alloc video filter in." << std::endl;;
-        exit(-1);
+        return false;
     }
 
     AVBufferSrcParameters *p = av_buffersrc_parameters_alloc();
     memset(p, 0, sizeof(*p));
     p->format = AV_PIX_FMT_NONE;
-    p->hw_frames_ctx = this->hw_frame_context_in;
-    int err = av_buffersrc_parameters_set(this->videoFilterSourceCtx, p);
+    p->hw_frames_ctx = stream.input_hw_frames_ctx;
+    int err = av_buffersrc_parameters_set(stream.videoFilterSourceCtx, p);
     av_free(p);
     if (err < 0) {
          std::cerr << "Cannot set hwcontext filter in: " << averr(err) << std::endl;;
-         exit(-1);
+         return false;
     }
 
-    err = avfilter_init_str(this->videoFilterSourceCtx, buffer_filter_config.str().c_str());
+    err = avfilter_init_str(stream.videoFilterSourceCtx, buffer_filter_config.str().c_str());
     if (err < 0) {
          std::cerr << "Cannot init filter in: " << averr(err) << std::endl;;
-         exit(-1);
+         return false;
     }
 
-    this->videoFilterSinkCtx = avfilter_graph_alloc_filter(this->videoFilterGraph,
+    stream.videoFilterSinkCtx = avfilter_graph_alloc_filter(stream.videoFilterGraph,
         sink, "Sink");
-    if (!this->videoFilterSinkCtx) {
+    if (!stream.videoFilterSinkCtx) {
         std::cerr << "Cannot alloc video filter out." << std::endl;;
-        exit(-1);
+        return false;
     }
 
     // We also need to tell the sink which pixel formats are supported.
@@ -347,26 +369,26 @@ void FrameWriter::init_video_filters(const AVCodec *codec)
 #if LIBAVFILTER_VERSION_INT < AV_VERSION_INT(10, 6, 100)
     const AVPixelFormat picked_pix_fmt[] =
     {
-        handle_buffersink_pix_fmt(codec),
+        out_format,
         AV_PIX_FMT_NONE
     };
 
-    err = av_opt_set_int_list(this->videoFilterSinkCtx, "pix_fmts",
+    err = av_opt_set_int_list(stream.videoFilterSinkCtx, "pix_fmts",
         picked_pix_fmt, AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
 #else
-    err = av_opt_set(this->videoFilterSinkCtx, "pixel_formats",
-        av_get_pix_fmt_name(handle_buffersink_pix_fmt(codec)), AV_OPT_SEARCH_CHILDREN);
+    err = av_opt_set(stream.videoFilterSinkCtx, "pixel_formats",
+        av_get_pix_fmt_name(out_format), AV_OPT_SEARCH_CHILDREN);
 #endif
 
     if (err < 0) {
         std::cerr << "Failed to set pix_fmts: " << averr(err) << std::endl;;
-        exit(-1);
+        return false;
     }
 
-    err = avfilter_init_dict(this->videoFilterSinkCtx, NULL);
+    err = avfilter_init_dict(stream.videoFilterSinkCtx, NULL);
     if (err < 0) {
          std::cerr << "Cannot init filter out: " << averr(err) << std::endl;;
-         exit(-1);
+         return false;
     }
 
     // Create the connections to the filter graph
@@ -383,28 +405,28 @@ void FrameWriter::init_video_filters(const AVCodec *codec)
 
     AVFilterInOut *outputs = avfilter_inout_alloc();
     outputs->name       = av_strdup("in");
-    outputs->filter_ctx = this->videoFilterSourceCtx;
+    outputs->filter_ctx = stream.videoFilterSourceCtx;
     outputs->pad_idx    = 0;
     outputs->next       = NULL;
 
     AVFilterInOut *inputs  = avfilter_inout_alloc();
     inputs->name       = av_strdup("out");
-    inputs->filter_ctx = this->videoFilterSinkCtx;
+    inputs->filter_ctx = stream.videoFilterSinkCtx;
     inputs->pad_idx    = 0;
     inputs->next       = NULL;
 
     if (!outputs->name || !inputs->name) {
         std::cerr << "Failed to parse allocate inout filter links" << std::endl;
-        exit(-1);
+        return false;
     }
 
-    std::cerr << "Using video filter: " << params.video_filter << std::endl;
+    std::cerr << "Using video filter: " << filter << std::endl;
 
-    err = avfilter_graph_parse_ptr(this->videoFilterGraph,
-        params.video_filter.c_str(), &inputs, &outputs, NULL);
+    err = avfilter_graph_parse_ptr(stream.videoFilterGraph,
+        filter.c_str(), &inputs, &outputs, NULL);
     if (err < 0) {
         std::cerr << "Failed to parse graph filter: " << averr(err) << std::endl;;
-        exit(-1) ;
+        return false;
     }
 
     // Filters that create HW frames ('hwupload', 'hwmap', ...) need
@@ -412,72 +434,125 @@ void FrameWriter::init_video_filters(const AVCodec *codec)
     // simple API to do that for filters created by avfilter_graph_parse_ptr().
     // The code below is inspired from ffmpeg_filter.c
     if (this->hw_device_context) {
-        for (unsigned i=0; i< this->videoFilterGraph->nb_filters; i++) {
-            this->videoFilterGraph->filters[i]->hw_device_ctx =
+        for (unsigned i=0; i< stream.videoFilterGraph->nb_filters; i++) {
+            stream.videoFilterGraph->filters[i]->hw_device_ctx =
                 av_buffer_ref(this->hw_device_context);
         }
     }
 
-    err = avfilter_graph_config(this->videoFilterGraph, NULL);
+    err = avfilter_graph_config(stream.videoFilterGraph, NULL);
     if (err<0) {
         std::cerr << "Failed to configure graph filter: " << averr(err) << std::endl;;
-        exit(-1) ;
+        return false;
     }
 
     if (params.enable_ffmpeg_debug_output) {
         std::cerr << std::string(80,'#') << std::endl ;
-        std::cerr << avfilter_graph_dump(this->videoFilterGraph,0) << "\n";
+        std::cerr << avfilter_graph_dump(stream.videoFilterGraph,0) << "\n";
         std::cerr << std::string(80,'#') << std::endl ;
     }
 
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    return true;
+}
+
+void FrameWriter::init_video_filters(VideoStream& stream, const AVCodec *codec)
+{
+    if (this->hw_device_context && stream.parent < 0) {
+        this->hw_frame_context_in = av_hwframe_ctx_alloc(this->hw_device_context);
+        AVHWFramesContext *hwfc = reinterpret_cast<AVHWFramesContext*>(this->hw_frame_context_in->data);
+        hwfc->format = AV_PIX_FMT_VAAPI;
+        hwfc->sw_format = get_drm_av_format(params.drm_format);
+        hwfc->width = params.width;
+        hwfc->height = params.height;
+        int err = av_hwframe_ctx_init(this->hw_frame_context_in);
+        if (err < 0) {
+            std::cerr << "Cannot create hw frames context: " << averr(err) << std::endl;
+            exit(-1);
+        }
+        stream.input_hw_frames_ctx = this->hw_frame_context_in;
+    }
+
+    if (!init_filter_graph(stream, stream.input_width, stream.input_height,
+            stream.input_format, stream.video_filter, handle_buffersink_pix_fmt(stream, codec)))
+        exit(-1);
 
     // The (input of the) sink is the output of the whole filter.
-    AVFilterLink * filter_output = this->videoFilterSinkCtx->inputs[0] ;
+    AVFilterLink * filter_output = stream.videoFilterSinkCtx->inputs[0] ;
 
-    this->videoCodecCtx->width  = filter_output->w;
-    this->videoCodecCtx->height = filter_output->h;
-    this->videoCodecCtx->pix_fmt = (AVPixelFormat)filter_output->format;
-    this->videoCodecCtx->time_base = filter_output->time_base;
-    this->videoCodecCtx->framerate = AVRational{1,0};
-    this->videoCodecCtx->sample_aspect_ratio = filter_output->sample_aspect_ratio;
+    stream.videoCodecCtx->width  = filter_output->w;
+    stream.videoCodecCtx->height = filter_output->h;
+    stream.videoCodecCtx->pix_fmt = (AVPixelFormat)filter_output->format;
+    stream.videoCodecCtx->time_base = filter_output->time_base;
+    stream.videoCodecCtx->framerate = AVRational{1,0};
+    stream.videoCodecCtx->sample_aspect_ratio = filter_output->sample_aspect_ratio;
 
-    this->hw_frame_context = av_buffersink_get_hw_frames_ctx(
-        this->videoFilterSinkCtx);
-    avfilter_inout_free(&inputs);
-    avfilter_inout_free(&outputs);
+    stream.hw_frame_context = av_buffersink_get_hw_frames_ctx(
+        stream.videoFilterSinkCtx);
 }
 
-void FrameWriter::init_video_stream()
+void FrameWriter::init_video_stream(VideoStream& stream)
 {
     AVDictionary *options = NULL;
-    load_codec_options(&options);
+    load_codec_options(stream, &options);
 
-    const AVCodec* codec = avcodec_find_encoder_by_name(params.codec.c_str());
+    const AVCodec* codec = avcodec_find_encoder_by_name(stream.codec.c_str());
     if (!codec)
     {
-        std::cerr << "Failed to find the given codec: " << params.codec << std::endl;
+        std::cerr << "Failed to find the given codec: " << stream.codec << std::endl;
         std::exit(-1);
     }
 
-    videoStream = avformat_new_stream(fmtCtx, codec);
-    if (!videoStream)
-    {
-        std::cerr << "Failed to open stream" << std::endl;
-        std::exit(-1);
-    }
-
-    videoCodecCtx = avcodec_alloc_context3(codec);
-    videoCodecCtx->width      = params.width;
-    videoCodecCtx->height     = params.height;
-    videoCodecCtx->time_base  = US_RATIONAL;
-    if (params.framerate) {
+    stream.videoCodecCtx = avcodec_alloc_context3(codec);
+    AVCodecContext *videoCodecCtx = stream.videoCodecCtx;
+    videoCodecCtx->width      = stream.input_width;
+    videoCodecCtx->height     = stream.input_height;
+    videoCodecCtx->time_base  = stream.input_time_base;
+    if (params.framerate && stream.parent < 0) {
         std::cerr << "Framerate: " << params.framerate << std::endl;
     }
 
+    if (stream.bitrate)
+        videoCodecCtx->bit_rate = stream.bitrate;
+
     if (params.bframes != -1)
         videoCodecCtx->max_b_frames = params.bframes;
 
-    if (!params.hw_device.empty()) {
+    bool live = std::any_of(stream.outputs.begin(), stream.outputs.end(),
+        [] (OutputSink *sink) { return sink->is_network(); });
+    auto threading = choose_threading(params.threading, codec, stream.input_height, live);
+
+    /* With the shared pool, no context uses more threads than the budget */
+    if (int budget = thread_pool_size())
+    {
+        threading.codec_threads = threading.codec_threads ?
+            std::min(threading.codec_threads, budget) : budget;
+        threading.filter_threads = std::min(threading.filter_threads, budget);
+
+        /* A thread count given with -p is applied after thread_count */
+        AVDictionaryEntry *threads = av_dict_get(options, "threads", NULL, 0);
+        if (threads && (atoi(threads->value) <= 0 || atoi(threads->value) > budget))
+            av_dict_set(&options, "threads", std::to_string(budget).c_str(), 0);
+    }
+    videoCodecCtx->thread_type = threading.codec_thread_type;
+    videoCodecCtx->thread_count = threading.codec_threads;
+    if (AVDictionaryEntry *threads = av_dict_get(options, "threads", NULL, 0))
+        videoCodecCtx->thread_count = atoi(threads->value);
+    stream.filter_threads = threading.filter_threads;
+    if (stream.parent < 0)
+    {
+        std::cerr << "Threading: " << threading_policy_name(threading.policy) << ", ";
+        if (!threading.codec_thread_type)
+            std::cerr << "encoder without threads";
+        else
+            std::cerr << (threading.codec_thread_type == FF_THREAD_SLICE ? "slice" : "frame") <<
+                " threads: " << (videoCodecCtx->thread_count ?
+                    std::to_string(videoCodecCtx->thread_count) : "auto");
+        std::cerr << ", filter threads: " << threading.filter_threads << std::endl;
+    }
+
+    if (!params.hw_device.empty() && !hw_device_context) {
         init_hw_accel();
     }
 
@@ -485,13 +560,13 @@ void FrameWriter::init_video_stream()
     // videoCodecCtx.
     //
     // After loading the filters, we should update the hw frames ctx.
-    init_video_filters(codec);
+    init_video_filters(stream, codec);
 
-    if (this->hw_frame_context) {
-      videoCodecCtx->hw_frames_ctx = av_buffer_ref(this->hw_frame_context);
+    if (stream.hw_frame_context) {
+      videoCodecCtx->hw_frames_ctx = av_buffer_ref(stream.hw_frame_context);
     }
 
-    if (fmtCtx->oformat->flags & AVFMT_GLOBALHEADER) {
+    if (need_global_header(stream.outputs)) {
         videoCodecCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
     }
 
@@ -504,17 +579,158 @@ void FrameWriter::init_video_stream()
         std::exit(-1);
     }
     av_dict_free(&options);
+    thread_pool_attach(videoCodecCtx);
 
-    if ((ret = avcodec_parameters_from_context(videoStream->codecpar, videoCodecCtx)) < 0) {
-        av_strerror(ret, err, 256);
-        std::cerr << "avcodec_parameters_from_context failed: " << err << std::endl;
-        std::exit(-1);
+    if (params.roi)
+    {
+        stream.roi = roi_supports_encoder(stream.codec);
+        if (!stream.roi)
+            std::cerr << "Regions of interest are not supported by " << stream.codec << std::endl;
+    }
+
+    add_sink_streams(videoCodecCtx, stream.outputs, stream.sinkStreams);
+    init_bitrate_controller(stream);
+}
+
+void FrameWriter::init_bitrate_controller(VideoStream& stream)
+{
+    bool network = std::any_of(stream.outputs.begin(), stream.outputs.end(),
+        [] (OutputSink *sink) { return sink->is_network(); });
+    if (!network || !BitrateController::supports_encoder(stream.codec))
+        return;
+
+    /* Without a target bitrate the encoder uses a constant quality, which
+     * can't be lowered while encoding */
+    AVCodecContext *ctx = stream.videoCodecCtx;
+    if (ctx->bit_rate <= 0)
+    {
+        std::cerr << "Set a bitrate with -p b=<bitrate> to adapt the video to the network"
+            << std::endl;
+        return;
+    }
+
+    stream.max_bitrate = ctx->bit_rate;
+    stream.max_rc_rate = ctx->rc_max_rate;
+    stream.bitrate_controller.reset(new BitrateController(ctx->bit_rate));
+}
+
+void FrameWriter::update_bitrate(VideoStream& stream)
+{
+    uint64_t now = metrics_now_usec();
+    if (now - stream.last_bitrate_update < BITRATE_UPDATE_INTERVAL_USEC)
+        return;
+    stream.last_bitrate_update = now;
+
+    /* The encoder has to fit the most congested output */
+    OutputCongestion congestion{0, 0};
+    for (auto& sink : stream.outputs)
+    {
+        if (!sink->is_network())
+            continue;
+
+        auto current = sink->get_congestion();
+        congestion.queue_fill = std::max(congestion.queue_fill, current.queue_fill);
+        congestion.write_usec = std::max(congestion.write_usec, current.write_usec);
+    }
+
+    int64_t bitrate = stream.bitrate_controller->update(congestion);
+    if (!bitrate)
+        return;
+
+    /* The encoders compare these to their current configuration before each
+     * frame and reconfigure themselves when they differ */
+    AVCodecContext *ctx = stream.videoCodecCtx;
+    ctx->bit_rate = bitrate;
+    if (stream.max_rc_rate)
+        ctx->rc_max_rate = av_rescale(stream.max_rc_rate, bitrate, stream.max_bitrate);
+
+    std::cerr << "Video " << ctx->width << "x" << ctx->height << ": bitrate "
+        << bitrate / 1000 << " kb/s, " << stream.bitrate_controller->reason() << std::endl;
+}
+
+void FrameWriter::init_renditions()
+{
+    /* Encode the largest renditions first, so that every rendition can be
+     * scaled from the smallest already encoded stream which is still at
+     * least as large as itself, instead of from the full captured frame. */
+    std::vector<FrameWriterRendition> renditions = params.renditions;
+    std::stable_sort(renditions.begin(), renditions.end(),
+        [] (const FrameWriterRendition& a, const FrameWriterRendition& b) {
+            return a.width * a.height > b.width * b.height;
+        });
+
+    for (auto& rendition : renditions)
+    {
+        int parent = 0;
+        for (size_t i = 1; i < videoStreams.size(); i++)
+        {
+            auto ctx = videoStreams[i]->videoCodecCtx;
+            if (ctx->width >= rendition.width && ctx->height >= rendition.height)
+                parent = i;
+        }
+
+        auto& source = *videoStreams[parent];
+        std::unique_ptr<VideoStream> stream(new VideoStream);
+        stream->parent = parent;
+        stream->codec = rendition.codec.empty() ? params.codec : rendition.codec;
+        stream->bitrate = rendition.bitrate;
+        if (stream->codec == params.codec)
+        {
+            stream->pix_fmt = params.pix_fmt;
+            stream->codec_options = params.codec_options;
+        }
+
+        stream->input_width = source.videoCodecCtx->width;
+        stream->input_height = source.videoCodecCtx->height;
+        stream->input_format = source.videoCodecCtx->pix_fmt;
+        stream->input_time_base = source.videoCodecCtx->time_base;
+        stream->input_hw_frames_ctx = source.hw_frame_context;
+
+        std::string size = std::to_string(rendition.width) + ":" +
+            std::to_string(rendition.height);
+        if (stream->input_format == AV_PIX_FMT_VAAPI)
+        {
+            stream->video_filter = "scale_vaapi=w=" + std::to_string(rendition.width) +
+                ":h=" + std::to_string(rendition.height);
+        } else
+        {
+            stream->video_filter = "scale=" + size;
+        }
+
+        if (rendition.file.empty())
+        {
+            stream->outputs = main_outputs;
+        } else
+        {
+            sinks.emplace_back(new OutputSink(rendition.file, "",
+                true, params.write_aborted_flag));
+            stream->outputs.push_back(sinks.back().get());
+        }
+
+        std::cerr << "Rendition " << rendition.width << "x" << rendition.height
+            << " (" << stream->codec << ") scaled from stream " << parent << std::endl;
+
+        init_video_stream(*stream);
+        source.children.push_back(videoStreams.size());
+        videoStreams.push_back(std::move(stream));
+    }
+
+    for (size_t i = 1; i < videoStreams.size(); i++)
+    {
+        auto stream = videoStreams[i].get();
+        stream->worker = std::thread([=] () {
+            std::string name = "rendition " + std::to_string(stream->videoCodecCtx->width) +
+                "x" + std::to_string(stream->videoCodecCtx->height);
+            trace_thread_name(name);
+            ThreadCpuRegistration cpu_registration(THREAD_STAGE_RENDITION, name);
+            video_worker(*stream);
+        });
     }
 }
 
 #ifdef HAVE_AUDIO
 #if HAVE_CH_LAYOUT
-static uint64_t get_codec_channel_layout(const AVCodec *codec)
+static uint64_t probe_channel_layout(const AVCodec *codec)
 {
     int i = 0;
     if (!codec->ch_layouts)
@@ -528,8 +744,20 @@ static uint64_t get_codec_channel_layout(const AVCodec *codec)
     }
     return codec->ch_layouts[0].u.mask;
 }
+
+static bool codec_has_channel_layout(const AVCodec *codec, uint64_t layout)
+{
+    if (!codec->ch_layouts)
+        return layout == AV_CH_LAYOUT_STEREO;
+    for (int i = 0; av_channel_layout_check(&codec->ch_layouts[i]); i++)
+    {
+        if (codec->ch_layouts[i].u.mask == layout)
+            return true;
+    }
+    return false;
+}
 #else
-static uint64_t get_codec_channel_layout(const AVCodec *codec)
+static uint64_t probe_channel_layout(const AVCodec *codec)
 {
       int i = 0;
       if (!codec->channel_layouts)
@@ -543,9 +771,21 @@ static uint64_t get_codec_channel_layout(const AVCodec *codec)
       }
       return codec->channel_layouts[0];
 }
+
+static bool codec_has_channel_layout(const AVCodec *codec, uint64_t layout)
+{
+    if (!codec->channel_layouts)
+        return layout == AV_CH_LAYOUT_STEREO;
+    for (int i = 0; codec->channel_layouts[i]; i++)
+    {
+        if (codec->channel_layouts[i] == layout)
+            return true;
+    }
+    return false;
+}
 #endif
 
-static enum AVSampleFormat get_codec_auto_sample_fmt(const AVCodec *codec)
+static enum AVSampleFormat probe_sample_fmt(const AVCodec *codec)
 {
     int i = 0;
     if (!codec->sample_fmts)
@@ -560,6 +800,58 @@ static enum AVSampleFormat get_codec_auto_sample_fmt(const AVCodec *codec)
     return codec->sample_fmts[0];
 }
 
+/* Whether probe_sample_fmt() could have chosen the format for the codec */
+static bool codec_has_sample_fmt(const AVCodec *codec, AVSampleFormat fmt)
+{
+    if (!codec->sample_fmts)
+        return fmt == av_get_sample_fmt(FALLBACK_AUDIO_SAMPLE_FMT);
+    for (int i = 0; codec->sample_fmts[i] != AV_SAMPLE_FMT_NONE; i++)
+    {
+        if (codec->sample_fmts[i] == fmt)
+            return true;
+    }
+    return false;
+}
+
+static uint64_t get_codec_channel_layout(const AVCodec *codec)
+{
+    std::string key = std::string("channel_layout ") + codec->name;
+    std::string cached;
+    if (capability_cache_get(key, cached))
+    {
+        /* A cache which was edited or written by another build may hold a
+         * layout the codec doesn't have, probe it again then */
+        char *end = NULL;
+        uint64_t layout = strtoull(cached.c_str(), &end, 10);
+        if (!cached.empty() && *end == '\0' && layout &&
+            codec_has_channel_layout(codec, layout))
+        {
+            return layout;
+        }
+    }
+
+    uint64_t layout = probe_channel_layout(codec);
+    capability_cache_set(key, std::to_string(layout));
+    return layout;
+}
+
+static enum AVSampleFormat get_codec_auto_sample_fmt(const AVCodec *codec)
+{
+    std::string key = std::string("sample_fmt ") + codec->name;
+    std::string cached;
+    if (capability_cache_get(key, cached))
+    {
+        /* Like the channel layout, a format the codec doesn't have is probed again */
+        AVSampleFormat format = av_get_sample_fmt(cached.c_str());
+        if (format != AV_SAMPLE_FMT_NONE && codec_has_sample_fmt(codec, format))
+            return format;
+    }
+
+    AVSampleFormat format = probe_sample_fmt(codec);
+    capability_cache_set(key, av_get_sample_fmt_name(format));
+    return format;
+}
+
 bool check_fmt_available(const AVCodec *codec, AVSampleFormat fmt){
     for (const enum AVSampleFormat *sample_ptr = codec -> sample_fmts; *sample_ptr != -1; sample_ptr++)
     {
@@ -601,13 +893,6 @@ void FrameWriter::init_audio_stream()
         std::exit(-1);
     }
 
-    audioStream = avformat_new_stream(fmtCtx, codec);
-    if (!audioStream)
-    {
-        std::cerr << "Failed to open audio stream" << std::endl;
-        std::exit(-1);
-    }
-
     audioCodecCtx = avcodec_alloc_context3(codec);
     if (params.sample_fmt.size() == 0) 
     {
@@ -626,7 +911,7 @@ void FrameWriter::init_audio_stream()
     audioCodecCtx->sample_rate = params.sample_rate;
     audioCodecCtx->time_base = (AVRational) { 1, audioCodecCtx->sample_rate };
 
-    if (fmtCtx->oformat->flags & AVFMT_GLOBALHEADER)
+    if (need_global_header(main_outputs))
         audioCodecCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
     int err;
@@ -662,61 +947,111 @@ void FrameWriter::init_audio_stream()
         std::exit(-1);
     }
 
-    int ret;
-    if ((ret = avcodec_parameters_from_context(audioStream->codecpar, audioCodecCtx)) < 0) {
-        char errmsg[256];
-        av_strerror(ret, errmsg, sizeof(errmsg));
-        std::cerr << "avcodec_parameters_from_context failed: " << err << std::endl;
-        std::exit(-1);
-    }
+    std::vector<OutputSink*> outputs;
+    for (auto& sink : sinks)
+        outputs.push_back(sink.get());
+
+    add_sink_streams(audioCodecCtx, outputs, audioSinkStreams);
 }
 #endif
-void FrameWriter::init_codecs()
+
+void FrameWriter::add_sink_streams(AVCodecContext *enc_ctx,
+    const std::vector<OutputSink*>& outputs, std::vector<SinkStream>& streams)
 {
-    init_video_stream();
-#ifdef HAVE_AUDIO
-    if (params.enable_audio)
-        init_audio_stream();
-#endif
+    for (auto& sink : outputs)
+    {
+        streams.push_back({sink, sink->add_stream(enc_ctx)});
+    }
+}
+
+bool FrameWriter::need_global_header(const std::vector<OutputSink*>& outputs)
+{
+    for (auto& sink : outputs)
+    {
+        if (sink->needs_global_header())
+            return true;
+    }
+
+    return false;
+}
 
-    av_dump_format(fmtCtx, 0, params.file.c_str(), 1);
-    if (avio_open(&fmtCtx->pb, params.file.c_str(), AVIO_FLAG_WRITE))
+void FrameWriter::init_sinks()
+{
+    if (!params.shared_outputs.empty())
     {
-        std::cerr << "avio_open failed" << std::endl;
-        std::exit(-1);
+        sinks = params.shared_outputs;
+        for (auto& sink : sinks)
+            main_outputs.push_back(sink.get());
+        return;
     }
-    AVDictionary *dummy = NULL;
-    char err[256];
-    int ret;
-    if ((ret = avformat_write_header(fmtCtx, &dummy)) != 0)
+
+    sinks.emplace_back(new OutputSink(params.file, params.muxer,
+        true, params.write_aborted_flag));
+
+    for (auto& tee : params.tee_outputs)
     {
-        std::cerr << "Failed to write file header" << std::endl;
-        av_strerror(ret, err, 256);
-        std::cerr << err << std::endl;
-        std::exit(-1);
+        std::cerr << "Also writing to " << tee.file << std::endl;
+        sinks.emplace_back(new OutputSink(tee.file, tee.muxer,
+            tee.required, params.write_aborted_flag));
     }
-    av_dict_free(&dummy);
+
+    for (auto& sink : sinks)
+        main_outputs.push_back(sink.get());
 }
 
-static const char* determine_output_format(const FrameWriterParams& params)
+void FrameWriter::init_codecs()
 {
-    if (!params.muxer.empty())
-        return params.muxer.c_str();
+    /* The damage is not rotated with the frames */
+    if (params.roi && params.transform != 0) {
+        std::cerr << "Regions of interest are not supported on transformed outputs" << std::endl;
+        params.roi = false;
+    }
 
-    if (params.file.find("rtmp") == 0)
-        return "flv";
+    if (params.transform != 0) {
+        if (params.video_filter != "null" &&
+             params.video_filter.find("transpose") == std::string::npos &&
+             params.video_filter.find("hflip") == std::string::npos &&
+             params.video_filter.find("vflip") == std::string::npos) {
+            params.video_filter += "," + transpose_from_transform(params.transform);
+        }
+        else if (params.video_filter == "null"){
+            params.video_filter = transpose_from_transform(params.transform);
+        }
+    }
+    if (params.framerate != 0){
+        if (params.video_filter != "null" && params.video_filter.find("fps") == std::string::npos) {
+            params.video_filter += ",fps=" + std::to_string(params.framerate);
+        }
+        else if (params.video_filter == "null"){
+            params.video_filter = "fps=" + std::to_string(params.framerate);
+        }
+    }
 
-    if (params.file.find("udp") == 0)
-        return "mpegts";
-    
-    if (params.file.find("rtp") == 0)
-        return "rtp_mpegts";
+    std::unique_ptr<VideoStream> stream(new VideoStream);
+    stream->codec = params.codec;
+    stream->pix_fmt = params.pix_fmt;
+    stream->codec_options = params.codec_options;
+    stream->video_filter = params.video_filter;
+    stream->outputs = main_outputs;
+    stream->input_width = params.width;
+    stream->input_height = params.height;
+    stream->input_format = get_input_format();
+    stream->input_time_base = US_RATIONAL;
+    videoStreams.push_back(std::move(stream));
+
+    init_video_stream(*videoStreams[0]);
+    init_renditions();
+#ifdef HAVE_AUDIO
+    if (params.enable_audio)
+        init_audio_stream();
+#endif
 
-    return NULL;
+    for (auto& sink : sinks)
+        sink->open();
 }
 
 FrameWriter::FrameWriter(const FrameWriterParams& _params) :
-    params(_params)
+    params(_params), mapped_frames(MAX_MAPPED_FRAMES)
 {
     if (params.enable_ffmpeg_debug_output)
         av_log_set_level(AV_LOG_DEBUG);
@@ -727,23 +1062,32 @@ FrameWriter::FrameWriter(const FrameWriterParams& _params) :
 
     // Preparing the data concerning the format and codec,
     // in order to write properly the header, frame data and end of file.
-    this->outputFmt = av_guess_format(NULL, params.file.c_str(), NULL);
-    auto streamFormat = determine_output_format(params);
-    auto context_ret = avformat_alloc_output_context2(&this->fmtCtx, NULL,
-        streamFormat, params.file.c_str());
-    if (context_ret < 0)
-    {
-        std::cerr << "Failed to allocate output context" << std::endl;
-        std::exit(-1);
-    }
-
+    init_sinks();
     init_codecs();
 }
 
 void FrameWriter::encode(AVCodecContext *enc_ctx, AVFrame *frame, AVPacket *pkt)
 {
+    /* Audio is measured as a whole in add_audio(), and handing the packets
+     * to the outputs is measured separately */
+    bool measure = metrics_enabled() && enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO;
+    bool trace = trace_enabled();
+    uint64_t encode_usec = 0;
+    uint64_t start = (measure || trace) ? metrics_now_usec() : 0;
+
     /* send the frame to the encoder */
     int ret = avcodec_send_frame(enc_ctx, frame);
+    if (start)
+    {
+        uint64_t end = metrics_now_usec();
+        encode_usec += end - start;
+        if (trace && frame)
+        {
+            trace_event("encoder send", start, end,
+                "pts", av_rescale_q(frame->pts, enc_ctx->time_base, US_RATIONAL));
+        }
+    }
+
     if (ret < 0)
     {
         fprintf(stderr, "error sending a frame for encoding\n");
@@ -752,27 +1096,95 @@ void FrameWriter::encode(AVCodecContext *enc_ctx, AVFrame *frame, AVPacket *pkt)
 
     while (ret >= 0)
     {
+        if (start)
+            start = metrics_now_usec();
+
         ret = avcodec_receive_packet(enc_ctx, pkt);
+        if (start)
+        {
+            uint64_t end = metrics_now_usec();
+            encode_usec += end - start;
+            if (trace && ret >= 0)
+            {
+                trace_event("encoder receive", start, end,
+                    "pts", av_rescale_q(pkt->pts, enc_ctx->time_base, US_RATIONAL));
+            }
+        }
+
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
         {
-            return;
+            break;
         }
         if (ret < 0)
         {
             fprintf(stderr, "error during encoding\n");
-            return;
+            break;
         }
 
         finish_frame(enc_ctx, *pkt);
     }
+
+    if (measure && frame)
+        metrics_record(METRICS_STAGE_ENCODE, encode_usec);
 }
 
-bool FrameWriter::push_frame(AVFrame *frame, int64_t usec)
+void FrameWriter::queue_frame(VideoStream& stream, AVFrame *frame)
 {
-    frame->pts = usec; // We use time_base = 1/US_RATE
+    std::unique_lock<std::mutex> lock(stream.mutex);
+    /* Don't let a slow rendition buffer an unbounded amount of frames */
+    stream.cond.wait(lock, [&] () {
+        return stream.queue.size() < MAX_QUEUED_FRAMES || !frame;
+    });
+    stream.queue.push_back(frame);
+    stream.cond.notify_all();
+
+    if (frame)
+        metrics_gauge_add(METRICS_RENDITION_QUEUE, 1);
+}
+
+void FrameWriter::video_worker(VideoStream& stream)
+{
+    bool failed = false;
+    while (true)
+    {
+        AVFrame *frame;
+        {
+            std::unique_lock<std::mutex> lock(stream.mutex);
+            stream.cond.wait(lock, [&] () {
+                return !stream.queue.empty();
+            });
+            frame = stream.queue.front();
+            stream.queue.pop_front();
+        }
+        stream.cond.notify_all();
+
+        if (!frame)
+            break;
+
+        metrics_gauge_add(METRICS_RENDITION_QUEUE, -1);
+        if (failed)
+        {
+            frame_pool.put(frame);
+        } else if (!push_frame(stream, frame))
+        {
+            std::cerr << "Stopped encoding rendition " << stream.videoCodecCtx->width
+                << "x" << stream.videoCodecCtx->height << std::endl;
+            failed = true;
+        }
+    }
+
+    for (int child : stream.children)
+        queue_frame(*videoStreams[child], NULL);
+}
+
+bool FrameWriter::push_frame(VideoStream& stream, AVFrame *frame)
+{
+    uint64_t start = (metrics_enabled() || trace_enabled()) ? metrics_now_usec() : 0;
+    int64_t pts = frame->pts;
 
     // Push the RGB frame into the filtergraph */
-    int err = av_buffersrc_add_frame_flags(videoFilterSourceCtx, frame, 0);
+    int err = av_buffersrc_add_frame_flags(stream.videoFilterSourceCtx, frame, 0);
+    frame_pool.put(frame);
     if (err < 0) {
         std::cerr << "Error while feeding the filtergraph!" << std::endl;
         return false;
@@ -780,46 +1192,123 @@ bool FrameWriter::push_frame(AVFrame *frame, int64_t usec)
 
     // Pull filtered frames from the filtergraph
     while (true) {
-        AVFrame *filtered_frame = av_frame_alloc();
+        AVFrame *filtered_frame = frame_pool.get();
 
         if (!filtered_frame) {
             std::cerr << "Error av_frame_alloc" << std::endl;
             return false;
         }
 
-        err = av_buffersink_get_frame(videoFilterSinkCtx, filtered_frame);
+        err = av_buffersink_get_frame(stream.videoFilterSinkCtx, filtered_frame);
+        if (start)
+        {
+            uint64_t end = metrics_now_usec();
+            metrics_record(METRICS_STAGE_CONVERT, end - start);
+            trace_event("filter", start, end,
+                "pts", av_rescale_q(pts, stream.input_time_base, US_RATIONAL));
+            start = 0;
+        }
+
         if (err == AVERROR(EAGAIN)) {
             // Not an error. No frame available.
             // Try again later.
-            av_frame_free(&filtered_frame);
+            frame_pool.put(filtered_frame);
             break;
         } else if (err == AVERROR_EOF) {
             // There will be no more output frames on this sink.
             // That could happen if a filter like 'trim' is used to
             // stop after a given time.
+            frame_pool.put(filtered_frame);
             return false;
         } else if (err < 0) {
-            av_frame_free(&filtered_frame);
+            frame_pool.put(filtered_frame);
             return false;
         }
 
         filtered_frame->pict_type = AV_PICTURE_TYPE_NONE;
 
+        RoiRect damage;
+        if (params.roi)
+            damage = take_damage(stream, filtered_frame);
+
+        // Renditions are scaled from the already converted frame
+        for (int child : stream.children)
+        {
+            if (params.roi)
+                add_damage(*videoStreams[child], damage);
+
+            AVFrame *child_frame = frame_pool.get();
+            if (!child_frame)
+                continue;
+
+            if (av_frame_ref(child_frame, filtered_frame) < 0)
+                frame_pool.put(child_frame);
+            else
+                queue_frame(*videoStreams[child], child_frame);
+        }
+
+        /* The regions are in pixels of the frame, so they are attached
+         * after the renditions took their reference */
+        if (stream.roi)
+        {
+            auto& input = *videoStreams[0];
+            RoiRect focus = params.roi_focus.scaled(input.input_width, input.input_height,
+                filtered_frame->width, filtered_frame->height);
+            if (roi_attach(filtered_frame, focus, damage) && (!focus.empty() || !damage.empty()))
+                metrics_count(METRICS_ROI_FRAMES);
+        }
+
         // So we have a frame. Encode it!
-        AVPacket *pkt = av_packet_alloc();
-        pkt->data = NULL;
-        pkt->size = 0;
+        AVPacket *pkt = packet_pool.get();
+        if (pkt)
+            encode(stream.videoCodecCtx, filtered_frame, pkt);
 
-        encode(videoCodecCtx, filtered_frame, pkt);
-        av_frame_free(&filtered_frame);
-        av_packet_free(&pkt);
+        frame_pool.put(filtered_frame);
+        packet_pool.put(pkt);
     }
 
-    av_frame_free(&frame);
+    if (stream.bitrate_controller)
+        update_bitrate(stream);
+
     return true;
 }
 
-bool FrameWriter::add_frame(const uint8_t* pixels, int64_t usec, bool y_invert)
+void FrameWriter::add_damage(VideoStream& stream, const RoiRect& damage)
+{
+    std::lock_guard<std::mutex> lock(stream.mutex);
+    stream.pending_damage.add(damage);
+}
+
+RoiRect FrameWriter::take_damage(VideoStream& stream, const AVFrame *frame)
+{
+    std::lock_guard<std::mutex> lock(stream.mutex);
+    RoiRect damage = stream.pending_damage.scaled(stream.input_width, stream.input_height,
+        frame->width, frame->height);
+    stream.pending_damage = RoiRect{};
+    return damage;
+}
+
+void FrameWriter::add_damage(const RoiRect& damage)
+{
+    if (!params.roi)
+        return;
+
+    /* After reconfigure_input() the input is scaled to fit the size the
+     * graph was built for, keeping its aspect ratio, and centered. The size
+     * is rounded like the scale filter does. */
+    auto& stream = *videoStreams[0];
+    int64_t width = std::min<int64_t>(stream.input_width,
+        av_rescale(stream.input_height, params.width, params.height));
+    int64_t height = std::min<int64_t>(stream.input_height,
+        av_rescale(stream.input_width, params.height, params.width));
+    RoiRect rect = damage.scaled(params.width, params.height, width, height);
+    rect.x += (stream.input_width - width) / 2;
+    rect.y += (stream.input_height - height) / 2;
+    add_damage(stream, rect);
+}
+
+bool FrameWriter::add_frame(const uint8_t* pixels, int64_t usec, bool y_invert,
+    AVBufferRef *pixels_ref)
 {
     /* Calculate data after y-inversion */
     int stride[] = {int(params.stride)};
@@ -830,19 +1319,72 @@ bool FrameWriter::add_frame(const uint8_t* pixels, int64_t usec, bool y_invert)
         stride[0] *= -1;
     }
 
-    auto frame = av_frame_alloc();
+    auto frame = frame_pool.get();
     if (!frame) {
         std::cerr << "Failed to allocate frame!" << std::endl;
+        av_buffer_unref(&pixels_ref);
         return false;
     }
 
+    /* The filtergraph copies frames which are not reference counted */
+    frame->buf[0] = pixels_ref;
     frame->data[0] = (uint8_t*)formatted_pixels;
     frame->linesize[0] = stride[0];
     frame->format = get_input_format();
     frame->width = params.width;
     frame->height = params.height;
+    frame->pts = usec; // We use time_base = 1/US_RATE
+
+    return push_frame(*videoStreams[0], frame);
+}
+
+bool FrameWriter::reconfigure_input(int width, int height, int stride, InputFormat format)
+{
+    if (width == params.width && height == params.height && format == params.format)
+    {
+        params.stride = stride;
+        return true;
+    }
+
+    if (format == INPUT_FORMAT_DMABUF || params.format == INPUT_FORMAT_DMABUF)
+    {
+        std::cerr << "The size of dmabuf frames can't change while recording" << std::endl;
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    params.width = width;
+    params.height = height;
+    params.stride = stride;
+    params.format = format;
+
+    /* The old input is converted to the size and format the graph was
+     * built for, so that the filters of the user see the same frames as
+     * before. A frame which was still buffered in the graph is lost. */
+    auto& stream = *videoStreams[0];
+    std::string filter = "format=" + std::string(av_get_pix_fmt_name(stream.input_format));
+    if (width != stream.input_width || height != stream.input_height)
+    {
+        std::string size = std::to_string(stream.input_width) + ":" +
+            std::to_string(stream.input_height);
+        filter = "scale=" + size + ":force_original_aspect_ratio=decrease," +
+            "pad=" + size + ":(ow-iw)/2:(oh-ih)/2," + filter;
+    }
+    filter += "," + stream.video_filter;
+
+    avfilter_graph_free(&stream.videoFilterGraph);
+    if (!init_filter_graph(stream, width, height, get_input_format(), filter,
+            handle_buffersink_pix_fmt(stream, stream.videoCodecCtx->codec)))
+    {
+        std::cerr << "Failed to reconfigure the input to " << width << "x" << height << std::endl;
+        return false;
+    }
 
-    return push_frame(frame, usec);
+    std::cerr << "Reconfigured the input to " << width << "x" << height << " " <<
+        av_get_pix_fmt_name(get_input_format()) << " in " <<
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() <<
+        " ms" << std::endl;
+    return true;
 }
 
 bool FrameWriter::add_frame(struct gbm_bo *bo, int64_t usec, bool y_invert)
@@ -853,24 +1395,39 @@ bool FrameWriter::add_frame(struct gbm_bo *bo, int64_t usec, bool y_invert)
         return false;
     }
 
-    auto frame = av_frame_alloc();
+    auto frame = frame_pool.get();
     if (!frame)
     {
         std::cerr << "Failed to allocate frame!" << std::endl;
         return false;
     }
 
-    if (mapped_frames.find(bo) == mapped_frames.end()) {
+    int fd = gbm_bo_get_fd(bo);
+    if (fd < 0)
+    {
+        std::cerr << "Failed to export bo" << std::endl;
+        frame_pool.put(frame);
+        return false;
+    }
+
+    struct stat st;
+    uint64_t inode = fstat(fd, &st) == 0 ? st.st_ino : 0;
+
+    /* The descriptor of a new mapping takes the fd */
+    bool fd_taken = false;
+    uint64_t misses = mapped_frames.misses();
+    AVFrame *mapped_frame = mapped_frames.get({bo, inode}, [&] (const MappedFrameKey&) -> AVFrame* {
         auto vaapi_frame = av_frame_alloc();
         if (!vaapi_frame) {
             std::cerr << "Failed to allocate frame!" << std::endl;
-            return false;
+            return NULL;
         }
 
         AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor*) av_mallocz(sizeof(AVDRMFrameDescriptor));
         desc->nb_layers = 1;
         desc->nb_objects = 1;
-        desc->objects[0].fd = gbm_bo_get_fd(bo);
+        desc->objects[0].fd = fd;
+        fd_taken = true;
         desc->objects[0].format_modifier = gbm_bo_get_modifier(bo);
         desc->objects[0].size = gbm_bo_get_stride(bo) * gbm_bo_get_height(bo);
         desc->layers[0].format = gbm_bo_get_format(bo);
@@ -887,6 +1444,7 @@ bool FrameWriter::add_frame(struct gbm_bo *bo, int64_t usec, bool y_invert)
         frame->data[0] = reinterpret_cast<uint8_t*>(desc);
         frame->buf[0] = av_buffer_create(frame->data[0], sizeof(*desc),
             [](void *, uint8_t *data) {
+                close(reinterpret_cast<AVDRMFrameDescriptor*>(data)->objects[0].fd);
                 av_free(data);
         }, frame, 0);
 
@@ -898,14 +1456,27 @@ bool FrameWriter::add_frame(struct gbm_bo *bo, int64_t usec, bool y_invert)
         if (ret < 0)
         {
             std::cerr << "Failed to map vaapi frame " << averr(ret) << std::endl;
-            return false;
+            av_frame_free(&vaapi_frame);
+            return NULL;
         }
 
-        mapped_frames[bo] = vaapi_frame;
+        return vaapi_frame;
+    });
+
+    if (!fd_taken)
+        close(fd);
+
+    if (!mapped_frame)
+    {
+        frame_pool.put(frame);
+        return false;
     }
 
-    av_frame_ref(frame, mapped_frames[bo]);
-    return push_frame(frame, usec);
+    metrics_count(mapped_frames.misses() != misses ?
+        METRICS_MAPPED_FRAME_MISSES : METRICS_MAPPED_FRAME_HITS);
+    av_frame_ref(frame, mapped_frame);
+    frame->pts = usec; // We use time_base = 1/US_RATE
+    return push_frame(*videoStreams[0], frame);
 }
 
 #ifdef HAVE_AUDIO
@@ -929,12 +1500,12 @@ static int64_t conv_audio_pts(SwrContext *ctx, int64_t in, int sample_rate)
 
 void FrameWriter::send_audio_pkt(AVFrame *frame)
 {
-    AVPacket *pkt = av_packet_alloc();
-    pkt->data = NULL;
-    pkt->size = 0;
+    AVPacket *pkt = packet_pool.get();
+    if (!pkt)
+        return;
 
     encode(audioCodecCtx, frame, pkt);
-    av_packet_free(&pkt);
+    packet_pool.put(pkt);
 }
 
 size_t FrameWriter::get_audio_buffer_size()
@@ -944,20 +1515,33 @@ size_t FrameWriter::get_audio_buffer_size()
 
 void FrameWriter::add_audio(const void* buffer)
 {
-    AVFrame *inputf = av_frame_alloc();
-    inputf->sample_rate    = params.sample_rate;
-    inputf->format         = AV_SAMPLE_FMT_FLT;
+    MetricsTimer timer(METRICS_STAGE_AUDIO);
+    TraceScope trace("audio encode");
+    metrics_count(METRICS_AUDIO_CHUNKS);
+
+    AVFrame *inputf = audio_input_frame;
+    if (!inputf)
+    {
+        inputf = audio_input_frame = av_frame_alloc();
+        inputf->sample_rate    = params.sample_rate;
+        inputf->format         = AV_SAMPLE_FMT_FLT;
 #if HAVE_CH_LAYOUT
-    inputf->ch_layout = (AVChannelLayout) AV_CHANNEL_LAYOUT_STEREO;
+        inputf->ch_layout = (AVChannelLayout) AV_CHANNEL_LAYOUT_STEREO;
 #else
-    inputf->channel_layout = AV_CH_LAYOUT_STEREO;
+        inputf->channel_layout = AV_CH_LAYOUT_STEREO;
 #endif
-    inputf->nb_samples     = audioCodecCtx->frame_size;
+        inputf->nb_samples     = audioCodecCtx->frame_size;
+        av_frame_get_buffer(inputf, 0);
+    }
 
-    av_frame_get_buffer(inputf, 0);
     memcpy(inputf->data[0], buffer, get_audio_buffer_size());
 
-    AVFrame *outputf = av_frame_alloc();
+    /* The encoder may keep a reference to the converted samples, so they
+     * get a new buffer every time */
+    AVFrame *outputf = frame_pool.get();
+    if (!outputf)
+        return;
+
     outputf->format         = audioCodecCtx->sample_fmt;
     outputf->sample_rate    = audioCodecCtx->sample_rate;
 #if HAVE_CH_LAYOUT
@@ -972,54 +1556,80 @@ void FrameWriter::add_audio(const void* buffer)
     swr_convert_frame(swrCtx, outputf, inputf);
 
     send_audio_pkt(outputf);
-
-    av_frame_free(&inputf);
-    av_frame_free(&outputf);
+    frame_pool.put(outputf);
 }
 #endif
 
 void FrameWriter::finish_frame(AVCodecContext *enc_ctx, AVPacket& pkt)
 {
-    static std::mutex fmt_mutex, pending_mutex;
+    MetricsTimer timer(METRICS_STAGE_HANDOFF);
+    metrics_count(METRICS_PACKETS_ENCODED);
+    TraceScope trace("handoff", "pts", av_rescale_q(pkt.pts, enc_ctx->time_base, US_RATIONAL));
 
-    if (enc_ctx == videoCodecCtx)
-    {
-        av_packet_rescale_ts(&pkt, videoCodecCtx->time_base, videoStream->time_base);
-        pkt.stream_index = videoStream->index;
-    }
-#ifdef HAVE_AUDIO
-    else
+    const std::vector<SinkStream> *streams = NULL;
+    for (auto& stream : videoStreams)
     {
-        av_packet_rescale_ts(&pkt, audioCodecCtx->time_base, audioStream->time_base);
-        pkt.stream_index = audioStream->index;
+        if (stream->videoCodecCtx == enc_ctx)
+            streams = &stream->sinkStreams;
     }
 
-    /* We use two locks to ensure that if WLOG the audio thread is waiting for
-     * the video one, when the video becomes ready the audio thread will be the
-     * next one to obtain the lock */
-    if (params.enable_audio)
+    if (enc_ctx == videoStreams[0]->videoCodecCtx)
     {
-        pending_mutex.lock();
-        fmt_mutex.lock();
-        pending_mutex.unlock();
-    }
+        metrics_count(METRICS_VIDEO_BYTES_ENCODED, pkt.size);
+
+        /* With the psnr flag, the encoder reports the quality stats: the
+         * quality, the picture type, the number of errors and 2 reserved
+         * bytes, then the sum of the squared errors of each plane */
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(59, 0, 100)
+        int size;
+#else
+        size_t size;
 #endif
-    if (av_interleaved_write_frame(fmtCtx, &pkt) != 0) {
-        params.write_aborted_flag = true;
+        uint8_t *stats = av_packet_get_side_data(&pkt, AV_PKT_DATA_QUALITY_STATS, &size);
+        if (stats && size >= 16 && stats[5] > 0)
+            metrics_count(METRICS_VIDEO_LUMA_SQUARED_ERROR, AV_RL64(stats + 8));
     }
-    av_packet_unref(&pkt);
 #ifdef HAVE_AUDIO
-    if (params.enable_audio)
-        fmt_mutex.unlock();
+    if (!streams)
+        streams = &audioSinkStreams;
 #endif
+
+    /* The sinks are internally synchronized, so the audio and the video
+     * thread can hand over their packets concurrently */
+    for (auto& stream : *streams)
+    {
+        stream.sink->write(&pkt, stream.index, enc_ctx->time_base);
+    }
+
+    av_packet_unref(&pkt);
+}
+
+size_t FrameWriter::get_allocations()
+{
+    size_t allocations = frame_pool.allocations() + packet_pool.allocations();
+    for (auto& sink : sinks)
+        allocations += sink->get_allocations();
+
+    return allocations;
 }
 
 FrameWriter::~FrameWriter()
 {
+    // Stop the renditions, their workers stop their own children
+    for (int child : videoStreams[0]->children)
+        queue_frame(*videoStreams[child], NULL);
+
+    for (auto& stream : videoStreams)
+    {
+        if (stream->worker.joinable())
+            stream->worker.join();
+    }
+
     // Writing the delayed frames:
-    AVPacket *pkt = av_packet_alloc();
+    AVPacket *pkt = packet_pool.get();
 
-    encode(videoCodecCtx, NULL, pkt);
+    for (auto& stream : videoStreams)
+        encode(stream->videoCodecCtx, NULL, pkt);
 #ifdef HAVE_AUDIO
     if (params.enable_audio)
     {
@@ -1027,19 +1637,22 @@ FrameWriter::~FrameWriter()
     }
 #endif
     // Writing the end of the file.
-    av_write_trailer(fmtCtx);
-
-    // Closing the file.
-    if (outputFmt && (!(outputFmt->flags & AVFMT_NOFILE)))
-        avio_closep(&fmtCtx->pb);
+    for (auto& sink : sinks)
+        sink->close();
 
     // Freeing all the allocated memory:
-    avcodec_free_context(&videoCodecCtx);
+    for (auto& stream : videoStreams)
+    {
+        avcodec_free_context(&stream->videoCodecCtx);
+        avfilter_graph_free(&stream->videoFilterGraph);
+    }
 #ifdef HAVE_AUDIO
     if (params.enable_audio)
         avcodec_free_context(&audioCodecCtx);
+    av_frame_free(&audio_input_frame);
 #endif
-    av_packet_free(&pkt);
+    mapped_frames.clear();
+    packet_pool.put(pkt);
     // TODO: free all the hw accel
-    avformat_free_context(fmtCtx);
+    sinks.clear();
 }
@@ -9,8 +9,19 @@
 #include <vector>
 #include <map>
 #include <atomic>
+#include <memory>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <wayland-client-protocol.h>
 #include "config.h"
+#include "output-sink.hpp"
+#include "bitrate-controller.hpp"
+#include "av-pool.hpp"
+#include "mapped-frame-cache.hpp"
+#include "threading-policy.hpp"
+#include "roi.hpp"
 
 extern "C"
 {
@@ -45,6 +56,22 @@ enum InputFormat
     INPUT_FORMAT_DMABUF,
 };
 
+struct FrameWriterTeeOutput
+{
+    std::string file;
+    std::string muxer;
+    bool required = false; // abort the recording if writing fails
+};
+
+struct FrameWriterRendition
+{
+    int width;
+    int height;
+    std::string codec; // the main video codec if empty
+    int64_t bitrate = 0;
+    std::string file; // stored as another stream in the main outputs if empty
+};
+
 struct FrameWriterParams
 {
     std::string file;
@@ -60,6 +87,13 @@ struct FrameWriterParams
     std::string codec;
     std::string audio_codec;
     std::string muxer;
+    /* Additional outputs which receive the same encoded packets */
+    std::vector<FrameWriterTeeOutput> tee_outputs;
+    /* Outputs shared with other FrameWriters, used instead of file and
+     * tee_outputs if not empty */
+    std::vector<std::shared_ptr<OutputSink>> shared_outputs;
+    /* Additional encodings of the video at other sizes */
+    std::vector<FrameWriterRendition> renditions;
     std::string pix_fmt;
     std::string sample_fmt;
     std::string hw_device; // used only if codec contains vaapi
@@ -76,6 +110,12 @@ struct FrameWriterParams
     bool enable_ffmpeg_debug_output;
 
     int bframes;
+    ThreadingParams threading;
+
+    /* Attach the damage and the focus to the frames as regions of interest,
+     * for the encoders which support them */
+    bool roi = false;
+    RoiRect roi_focus; // in pixels of the input, empty for none
 
     std::atomic<bool>& write_aborted_flag;
     FrameWriterParams(std::atomic<bool>& flag): write_aborted_flag(flag) {}
@@ -84,50 +124,136 @@ struct FrameWriterParams
 class FrameWriter
 {
     FrameWriterParams params;
-    void load_codec_options(AVDictionary **dict);
+
+    /* A stream of one of the encoders inside an output */
+    struct SinkStream
+    {
+        OutputSink *sink;
+        int index;
+    };
+
+    /* An encoded video stream. The first one encodes the captured frames,
+     * the others are renditions which scale the output of their parent. */
+    struct VideoStream
+    {
+        std::string codec;
+        std::string pix_fmt;
+        std::map<std::string, std::string> codec_options;
+        std::string video_filter;
+        int64_t bitrate = 0;
+
+        int parent = -1;
+        std::vector<int> children;
+        std::vector<OutputSink*> outputs;
+
+        int input_width;
+        int input_height;
+        AVPixelFormat input_format;
+        AVRational input_time_base;
+        AVBufferRef *input_hw_frames_ctx = NULL;
+
+        AVCodecContext* videoCodecCtx = NULL;
+        AVFilterContext* videoFilterSourceCtx = NULL;
+        AVFilterContext* videoFilterSinkCtx = NULL;
+        AVFilterGraph* videoFilterGraph = NULL;
+        AVBufferRef *hw_frame_context = NULL;
+        std::vector<SinkStream> sinkStreams;
+        int filter_threads = 0;
+
+        /* Adapts the bitrate to the network outputs, if there are any */
+        std::unique_ptr<BitrateController> bitrate_controller;
+        int64_t max_bitrate = 0;
+        int64_t max_rc_rate = 0;
+        uint64_t last_bitrate_update = 0;
+
+        /* Renditions are filtered and encoded on their own thread */
+        std::thread worker;
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::deque<AVFrame*> queue; // NULL marks the end of the stream
+
+        /* The encoder gets the regions of interest */
+        bool roi = false;
+        /* Damage of the input since the last filtered frame, in pixels of
+         * the input. Protected by mutex. */
+        RoiRect pending_damage;
+    };
+
+    void load_codec_options(VideoStream& stream, AVDictionary **dict);
     void load_audio_codec_options(AVDictionary **dict);
 
-    const AVOutputFormat* outputFmt;
-    AVStream* videoStream;
-    AVCodecContext* videoCodecCtx;
-    AVFormatContext* fmtCtx;
+    std::vector<std::unique_ptr<VideoStream>> videoStreams;
+    std::vector<std::shared_ptr<OutputSink>> sinks;
+    std::vector<OutputSink*> main_outputs;
 
-    AVFilterContext* videoFilterSourceCtx = NULL;
-    AVFilterContext* videoFilterSinkCtx = NULL;
-    AVFilterGraph* videoFilterGraph = NULL;
+    void add_sink_streams(AVCodecContext *enc_ctx,
+        const std::vector<OutputSink*>& outputs, std::vector<SinkStream>& streams);
 
     AVBufferRef *hw_device_context = NULL;
-    AVBufferRef *hw_frame_context = NULL;
     AVBufferRef *hw_frame_context_in = NULL;
 
-    std::map<struct gbm_bo*, AVFrame*> mapped_frames;
+    /* The VAAPI frames of the dmabufs which were encoded before */
+    MappedFrameCache mapped_frames;
+
+    /* The frames and packets of the encode loop are reused */
+    FramePool frame_pool;
+    PacketPool packet_pool;
 
     AVPixelFormat lookup_pixel_format(std::string pix_fmt);
-    AVPixelFormat handle_buffersink_pix_fmt(const AVCodec *codec);
+    AVPixelFormat handle_buffersink_pix_fmt(VideoStream& stream, const AVCodec *codec);
     AVPixelFormat get_input_format();
     void init_hw_accel();
+    void init_sinks();
+    bool need_global_header(const std::vector<OutputSink*>& outputs);
     void init_codecs();
-    void init_video_filters(const AVCodec *codec);
-    void init_video_stream();
+    bool init_filter_graph(VideoStream& stream, int width, int height,
+        AVPixelFormat format, const std::string& filter, AVPixelFormat out_format);
+    void init_video_filters(VideoStream& stream, const AVCodec *codec);
+    void init_video_stream(VideoStream& stream);
+    void init_renditions();
+    void init_bitrate_controller(VideoStream& stream);
+    void update_bitrate(VideoStream& stream);
+
+    void queue_frame(VideoStream& stream, AVFrame *frame);
+    void video_worker(VideoStream& stream);
 
     void encode(AVCodecContext *enc_ctx, AVFrame *frame, AVPacket *pkt);
 
 #ifdef HAVE_AUDIO
     SwrContext *swrCtx;
-    AVStream *audioStream;
-    AVCodecContext *audioCodecCtx;
+    std::vector<SinkStream> audioSinkStreams;
+    AVCodecContext *audioCodecCtx = NULL;
+    /* Only read by the resampler, so its buffer is kept */
+    AVFrame *audio_input_frame = NULL;
     void init_swr();
     void init_audio_stream();
     void send_audio_pkt(AVFrame *frame);
 #endif
     void finish_frame(AVCodecContext *enc_ctx, AVPacket& pkt);
-    bool push_frame(AVFrame *frame, int64_t usec);
+    /* Takes the frame, which must come from frame_pool */
+    bool push_frame(VideoStream& stream, AVFrame *frame);
+    void add_damage(VideoStream& stream, const RoiRect& damage);
+    /* The damage since the last filtered frame, scaled to the frame */
+    RoiRect take_damage(VideoStream& stream, const AVFrame *frame);
 
   public:
     FrameWriter(const FrameWriterParams& params);
-    bool add_frame(const uint8_t* pixels, int64_t usec, bool y_invert);
+    /* The pixels are copied before add_frame() returns, unless pixels_ref
+     * references the buffer which contains them. Then the frame takes the
+     * reference and the buffer is used as long as the encoder needs it. */
+    bool add_frame(const uint8_t* pixels, int64_t usec, bool y_invert,
+        AVBufferRef *pixels_ref = NULL);
     bool add_frame(struct gbm_bo *bo, int64_t usec, bool y_invert);
 
+    /* The part of the next frame which changed since the previous one, in
+     * pixels of the input, for the regions of interest */
+    void add_damage(const RoiRect& damage);
+
+    /* The captured buffers changed, e.g. because the mode of the output did.
+     * Only the input of the filtergraph is rebuilt, the frames are scaled
+     * and letterboxed to the size the encoders were opened with. */
+    bool reconfigure_input(int width, int height, int stride, InputFormat format);
+
 #ifdef HAVE_AUDIO
     /* Buffer must have size get_audio_buffer_size() */
     void add_audio(const void* buffer);
@@ -135,6 +261,10 @@ class FrameWriter
 
 #endif
 
+    /* Frames and packets allocated so far. Once the encoders are running
+     * this stays the same, since they are taken from the pools. */
+    size_t get_allocations();
+
     ~FrameWriter();
 };
 
@@ -2,9 +2,14 @@
 #define _POSIX_C_SOURCE 199309L
 #include <iostream>
 #include <optional>
+#include <cmath>
 
 #include <list>
+#include <map>
+#include <vector>
+#include <algorithm>
 #include <string>
+#include <sstream>
 #include <thread>
 #include <mutex>
 #include <atomic>
@@ -12,30 +17,42 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <string.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 #include <signal.h>
 #include <unistd.h>
+#include <poll.h>
 #include <gbm.h>
 #include <fcntl.h>
 #include <xf86drm.h>
 
 #include "frame-writer.hpp"
-#include "buffer-pool.hpp"
+#include "capture-source.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "thread-stats.hpp"
+#include "overload-controller.hpp"
+#include "thread-pool.hpp"
+#include "thread-scheduling.hpp"
+#include "autotune.hpp"
+#include "capability-cache.hpp"
 #include "wlr-screencopy-unstable-v1-client-protocol.h"
 #include "xdg-output-unstable-v1-client-protocol.h"
 #include "linux-dmabuf-unstable-v1-client-protocol.h"
 
 #include "config.h"
 
+#ifdef HAVE_EXT_IMAGE_COPY_CAPTURE
+#include "ext-image-capture-source-v1-client-protocol.h"
+#include "ext-image-copy-capture-v1-client-protocol.h"
+#endif
+
 #ifdef HAVE_AUDIO
 #include "audio.hpp"
 AudioReaderParams audioParams;
 #endif
 
-#define MAX_FRAME_FAILURES 16
-
 static const int GRACEFUL_TERMINATION_SIGNALS[] = { SIGTERM, SIGINT, SIGHUP };
 
 std::mutex frame_writer_mutex, frame_writer_pending_mutex;
@@ -49,7 +66,11 @@ static struct wl_shm *shm = NULL;
 static struct zxdg_output_manager_v1 *xdg_output_manager = NULL;
 static struct zwlr_screencopy_manager_v1 *screencopy_manager = NULL;
 static struct zwp_linux_dmabuf_v1 *dmabuf = NULL;
-void request_next_frame();
+#ifdef HAVE_EXT_IMAGE_COPY_CAPTURE
+static struct ext_image_copy_capture_manager_v1 *ext_copy_manager = NULL;
+static struct ext_output_image_capture_source_manager_v1 *ext_source_manager = NULL;
+#endif
+struct capture_target;
 
 struct wf_recorder_output
 {
@@ -58,6 +79,8 @@ struct wf_recorder_output
     std::string name, description;
     int32_t x, y, width, height;
     int32_t transform;
+    int32_t refresh = 0; // mHz, 0 if unknown
+    int32_t mode_width = 0, mode_height = 0; // pixels of the current mode
 };
 
 std::list<wf_recorder_output> available_outputs;
@@ -79,13 +102,21 @@ display_handle_geometry(void *data,
 }
 
 static void
-display_handle_mode(void *,
+display_handle_mode(void *data,
                     struct wl_output *,
-                    uint32_t,
-                    int32_t,
-                    int32_t,
-                    int32_t)
+                    uint32_t flags,
+                    int32_t width,
+                    int32_t height,
+                    int32_t refresh)
 {
+    wf_recorder_output *wo = (wf_recorder_output*) data;
+
+    if (flags & WL_OUTPUT_MODE_CURRENT)
+    {
+        wo->refresh = refresh;
+        wo->mode_width = width;
+        wo->mode_height = height;
+    }
 }
 
 static void
@@ -180,287 +211,85 @@ const zxdg_output_v1_listener xdg_output_implementation = {
     .description = handle_xdg_output_description
 };
 
-struct wf_buffer : public buffer_pool_buf
-{
-    struct gbm_bo *bo = nullptr;
-    zwp_linux_buffer_params_v1 *params = nullptr;
-    struct wl_buffer *wl_buffer = nullptr;
-    void *data = nullptr;
-    size_t size = 0;
-    enum wl_shm_format format;
-    int drm_format;
-    int width, height, stride;
-    bool y_invert;
-
-    timespec presented;
-    uint64_t base_usec;
-};
-
 std::atomic<bool> exit_main_loop{false};
 
-buffer_pool<wf_buffer, 16> buffers;
-
-bool buffer_copy_done = false;
-
-static int backingfile(off_t size)
+/* A video recorded from a capture target, either the whole captured area or
+ * a region cropped from its buffers. Each view has its own writer thread. */
+struct capture_view
 {
-    char name[] = "/tmp/wf-recorder-shared-XXXXXX";
-    int fd = mkstemp(name);
-    if (fd < 0) {
-        return -1;
-    }
-
-    int ret;
-    while ((ret = ftruncate(fd, size)) == EINTR) {
-        // No-op
-    }
-    if (ret < 0) {
-        close(fd);
-        return -1;
-    }
-
-    unlink(name);
-    return fd;
-}
+    capture_target *target;
+    size_t consumer; // index of the view among the consumers of the target's buffers
+    capture_region crop; // in logical coordinates relative to the captured area
+    FrameWriterParams params;
+
+    /* The first view also records the audio, which the audio backends
+     * write to the global frame_writer */
+    bool primary;
+    std::thread writer_thread;
+    /* Moving average of the time add_frame takes, for the overload controller */
+    std::atomic<uint64_t> encode_usec{0};
+    std::unique_ptr<FrameWriter> own_writer;
+    std::mutex own_mutex, own_pending_mutex;
+    std::unique_ptr<FrameWriter>& writer;
+    std::mutex& writer_mutex;
+    std::mutex& writer_pending_mutex;
+
+    capture_view(capture_target *_target, size_t _consumer,
+        const FrameWriterParams& _params, bool _primary) :
+        target(_target), consumer(_consumer), params(_params), primary(_primary),
+        writer(primary ? frame_writer : own_writer),
+        writer_mutex(primary ? frame_writer_mutex : own_mutex),
+        writer_pending_mutex(primary ? frame_writer_pending_mutex : own_pending_mutex)
+    { }
+};
 
-static struct wl_buffer *create_shm_buffer(uint32_t fmt,
-    int width, int height, int stride, void **data_out)
+/* An output which is being captured. Each target has its own buffers and
+ * capture source, the Wayland event loop is shared. */
+struct capture_target
 {
-    int size = stride * height;
-
-    int fd = backingfile(size);
-    if (fd < 0) {
-        fprintf(stderr, "creating a buffer file for %d B failed: %m\n", size);
-        return NULL;
-    }
-
-    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (data == MAP_FAILED) {
-        fprintf(stderr, "mmap failed: %m\n");
-        close(fd);
-        return NULL;
-    }
-
-    struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-    close(fd);
-    struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0, width, height,
-        stride, fmt);
-    wl_shm_pool_destroy(pool);
-
-    *data_out = data;
-    return buffer;
-}
+    wf_recorder_output *output = nullptr;
+    capture_region region;
+
+    buffer_pool<wf_buffer, 16> buffers;
+    std::unique_ptr<CaptureSource> source;
+
+    /* Statistics, reported at the end of the recording */
+    uint64_t captured_frames = 0;
+    uint64_t duplicate_frames = 0;
+    uint64_t first_capture_usec = 0;
+    uint64_t last_capture_usec = 0;
+    uint64_t last_presented_usec = 0;
+    uint64_t total_round_trip_usec = 0;
+    uint64_t max_round_trip_usec = 0;
+    /* When the last new frame was handled, to measure how regularly the
+     * main thread gets to the frames compared to the compositor */
+    uint64_t last_ready_usec = 0;
+    uint64_t jitter_frames = 0;
+    uint64_t total_jitter_usec = 0;
+    uint64_t max_jitter_usec = 0;
+
+    /* Pacing of the requests for the target framerate, 0 if disabled */
+    uint64_t frame_interval_usec = 0;
+    uint64_t next_frame_usec = 0;
+
+    /* Lowers the capture rate while the writers can't keep up, if enabled.
+     * The pacing interval without it is kept to restore the full rate. */
+    std::unique_ptr<OverloadController> overload;
+    uint64_t paced_interval_usec = 0;
+
+    std::list<capture_view> views;
+};
 
-void free_shm_buffer(wf_buffer& buffer)
-{
-    if (buffer.wl_buffer == NULL)
-    {
-        return;
-    }
+std::list<capture_target> capture_targets;
 
-    munmap(buffer.data, buffer.size);
-    wl_buffer_destroy(buffer.wl_buffer);
-    buffer.wl_buffer = NULL;
-}
+/* Timestamp of the start of the recording, shared by all views */
+static std::mutex first_frame_mutex;
+static std::optional<uint64_t> first_frame_ts;
 
 static bool use_damage = true;
 static bool use_dmabuf = false;
 static bool use_hwupload = false;
 
-static uint32_t wl_shm_to_drm_format(uint32_t format)
-{
-    if (format == WL_SHM_FORMAT_ARGB8888) {
-        return GBM_FORMAT_ARGB8888;
-    } else if (format == WL_SHM_FORMAT_XRGB8888) {
-        return GBM_FORMAT_XRGB8888;
-    } else {
-        return format;
-    }
-}
-
-static void frame_handle_buffer(void *, struct zwlr_screencopy_frame_v1 *frame, uint32_t format,
-    uint32_t width, uint32_t height, uint32_t stride)
-{
-    if (use_dmabuf) {
-        return;
-    }
-
-    auto& buffer = buffers.capture();
-    auto old_format = buffer.format;
-    buffer.format = (wl_shm_format)format;
-    buffer.drm_format = wl_shm_to_drm_format(format);
-    buffer.width = width;
-    buffer.height = height;
-    buffer.stride = stride;
-
-    /* ffmpeg requires even width and height */
-    if (buffer.width % 2)
-        buffer.width -= 1;
-    if (buffer.height % 2)
-        buffer.height -= 1;
-
-    if (!buffer.wl_buffer || old_format != format) {
-        free_shm_buffer(buffer);
-        buffer.wl_buffer =
-            create_shm_buffer(format, width, height, stride, &buffer.data);
-    }
-
-    if (buffer.wl_buffer == NULL) {
-        fprintf(stderr, "failed to create buffer\n");
-        exit(EXIT_FAILURE);
-    }
-
-    if (use_damage) {
-        zwlr_screencopy_frame_v1_copy_with_damage(frame, buffer.wl_buffer);
-    } else {
-        zwlr_screencopy_frame_v1_copy(frame, buffer.wl_buffer);
-    }
-}
-
-static void frame_handle_flags(void*, struct zwlr_screencopy_frame_v1 *, uint32_t flags) {
-    buffers.capture().y_invert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
-}
-
-int32_t frame_failed_cnt = 0;
-
-static void frame_handle_ready(void *, struct zwlr_screencopy_frame_v1 *,
-    uint32_t tv_sec_hi, uint32_t tv_sec_low, uint32_t tv_nsec) {
-
-    auto& buffer = buffers.capture();
-    buffer_copy_done = true;
-    buffer.presented.tv_sec = ((1ll * tv_sec_hi) << 32ll) | tv_sec_low;
-    buffer.presented.tv_nsec = tv_nsec;
-    frame_failed_cnt = 0;
-}
-
-static void frame_handle_failed(void *, struct zwlr_screencopy_frame_v1 *) {
-    std::cerr << "Failed to copy frame, retrying..." << std::endl;
-    ++frame_failed_cnt;
-    request_next_frame();
-    if (frame_failed_cnt > MAX_FRAME_FAILURES)
-    {
-        std::cerr << "Failed to copy frame too many times, exiting!" << std::endl;
-        exit_main_loop = true;
-    }
-}
-
-static void frame_handle_damage(void *, struct zwlr_screencopy_frame_v1 *,
-    uint32_t, uint32_t, uint32_t, uint32_t)
-{
-}
-
-static void dmabuf_created(void *data, struct zwp_linux_buffer_params_v1 *,
-    struct wl_buffer *wl_buffer) {
-
-    auto& buffer = buffers.capture();
-    buffer.wl_buffer = wl_buffer;
-
-    zwlr_screencopy_frame_v1 *frame = (zwlr_screencopy_frame_v1*) data;
-
-    if (use_damage) {
-        zwlr_screencopy_frame_v1_copy_with_damage(frame, buffer.wl_buffer);
-    } else {
-        zwlr_screencopy_frame_v1_copy(frame, buffer.wl_buffer);
-    }
-}
-
-static void dmabuf_failed(void *, struct zwp_linux_buffer_params_v1 *) {
-    std::cerr << "Failed to create dmabuf" << std::endl;
-    exit_main_loop = true;
-}
-
-static const struct zwp_linux_buffer_params_v1_listener params_listener = {
-    .created = dmabuf_created,
-    .failed = dmabuf_failed,
-};
-
-static wl_shm_format drm_to_wl_shm_format(uint32_t format)
-{
-    if (format == GBM_FORMAT_ARGB8888) {
-        return WL_SHM_FORMAT_ARGB8888;
-    } else if (format == GBM_FORMAT_XRGB8888) {
-        return WL_SHM_FORMAT_XRGB8888;
-    } else {
-        return (wl_shm_format)format;
-    }
-}
-
-static void frame_handle_linux_dmabuf(void *, struct zwlr_screencopy_frame_v1 *frame,
-    uint32_t format, uint32_t width, uint32_t height)
-{
-    if (!use_dmabuf) {
-        return;
-    }
-
-    auto& buffer = buffers.capture();
-
-    auto old_format = buffer.format;
-    buffer.format = drm_to_wl_shm_format(format);
-    buffer.drm_format = format;
-    buffer.width = width;
-    buffer.height = height;
-
-    if (!buffer.wl_buffer || (old_format != buffer.format)) {
-        if (buffer.bo) {
-            if (buffer.wl_buffer) {
-                wl_buffer_destroy(buffer.wl_buffer);
-            }
-
-            zwp_linux_buffer_params_v1_destroy(buffer.params);
-            gbm_bo_destroy(buffer.bo);
-        }
-
-        const uint64_t modifier = 0; // DRM_FORMAT_MOD_LINEAR
-        buffer.bo = gbm_bo_create_with_modifiers(gbm_device, buffer.width,
-            buffer.height, format, &modifier, 1);
-        if (buffer.bo == NULL)
-        {
-            buffer.bo = gbm_bo_create(gbm_device, buffer.width,
-                buffer.height, format, GBM_BO_USE_LINEAR | GBM_BO_USE_RENDERING);
-        }
-        if (buffer.bo == NULL)
-        {
-            std::cerr << "Failed to create gbm bo" << std::endl;
-            exit_main_loop = true;
-            return;
-        }
-
-        buffer.stride = gbm_bo_get_stride(buffer.bo);
-
-        buffer.params = zwp_linux_dmabuf_v1_create_params(dmabuf);
-
-        uint64_t mod = gbm_bo_get_modifier(buffer.bo);
-        zwp_linux_buffer_params_v1_add(buffer.params,
-            gbm_bo_get_fd(buffer.bo), 0,
-            gbm_bo_get_offset(buffer.bo, 0),
-            gbm_bo_get_stride(buffer.bo),
-            mod >> 32, mod & 0xffffffff);
-
-        zwp_linux_buffer_params_v1_add_listener(buffer.params, &params_listener, frame);
-        zwp_linux_buffer_params_v1_create(buffer.params, buffer.width,
-            buffer.height, format, 0);
-    } else {
-        if (use_damage) {
-            zwlr_screencopy_frame_v1_copy_with_damage(frame, buffer.wl_buffer);
-        } else {
-            zwlr_screencopy_frame_v1_copy(frame, buffer.wl_buffer);
-        }
-    }
-}
-
-static void frame_handle_buffer_done(void *, struct zwlr_screencopy_frame_v1 *) {
-}
-
-static const struct zwlr_screencopy_frame_v1_listener frame_listener = {
-    .buffer = frame_handle_buffer,
-    .flags = frame_handle_flags,
-    .ready = frame_handle_ready,
-    .failed = frame_handle_failed,
-    .damage = frame_handle_damage,
-    .linux_dmabuf = frame_handle_linux_dmabuf,
-    .buffer_done = frame_handle_buffer_done,
-};
-
 static void dmabuf_feedback_done(void *, struct zwp_linux_dmabuf_feedback_v1 *feedback)
 {
     zwp_linux_dmabuf_feedback_v1_destroy(feedback);
@@ -478,6 +307,25 @@ static void dmabuf_feedback_main_device(void *, struct zwp_linux_dmabuf_feedback
     dev_t dev_id;
     memcpy(&dev_id, device->data, device->size);
 
+    /* Looking the device up reads its nodes from sysfs. The main device is
+     * usually the primary node while the render node is used, so the cached
+     * node is kept with its own device number, and used as long as that
+     * still matches. */
+    std::string key = "drm_node " + std::to_string(dev_id);
+    std::string cached;
+    struct stat st;
+    if (capability_cache_get(key, cached))
+    {
+        size_t space = cached.rfind(' ');
+        std::string node = cached.substr(0, space);
+        if (space != std::string::npos && stat(node.c_str(), &st) == 0 &&
+            S_ISCHR(st.st_mode) && std::to_string(st.st_rdev) == cached.substr(space + 1))
+        {
+            drm_device_name = node;
+            return;
+        }
+    }
+
     drmDevice *dev = NULL;
     if (drmGetDeviceFromDevId(dev_id, 0, &dev) != 0) {
         std::cerr << "Failed to get DRM device from dev id " << strerror(errno) << std::endl;
@@ -491,6 +339,11 @@ static void dmabuf_feedback_main_device(void *, struct zwp_linux_dmabuf_feedback
     }
 
     drmFreeDevice(&dev);
+    if (!drm_device_name.empty() && stat(drm_device_name.c_str(), &st) == 0 &&
+        S_ISCHR(st.st_mode))
+    {
+        capability_cache_set(key, drm_device_name + " " + std::to_string(st.st_rdev));
+    }
 }
 
 static void dmabuf_feedback_tranche_done(void *, struct zwp_linux_dmabuf_feedback_v1 *)
@@ -542,6 +395,18 @@ static void handle_global(void*, struct wl_registry *registry,
         screencopy_manager = (zwlr_screencopy_manager_v1*) wl_registry_bind(registry, name,
             &zwlr_screencopy_manager_v1_interface, 3);
     }
+#ifdef HAVE_EXT_IMAGE_COPY_CAPTURE
+    else if (strcmp(interface, ext_image_copy_capture_manager_v1_interface.name) == 0)
+    {
+        ext_copy_manager = (ext_image_copy_capture_manager_v1*) wl_registry_bind(registry, name,
+            &ext_image_copy_capture_manager_v1_interface, 1);
+    }
+    else if (strcmp(interface, ext_output_image_capture_source_manager_v1_interface.name) == 0)
+    {
+        ext_source_manager = (ext_output_image_capture_source_manager_v1*) wl_registry_bind(
+            registry, name, &ext_output_image_capture_source_manager_v1_interface, 1);
+    }
+#endif
     else if (strcmp(interface, zxdg_output_manager_v1_interface.name) == 0)
     {
         xdg_output_manager = (zxdg_output_manager_v1*) wl_registry_bind(registry, name,
@@ -568,52 +433,93 @@ static const struct wl_registry_listener registry_listener = {
     .global_remove = handle_global_remove,
 };
 
-static uint64_t timespec_to_usec (const timespec& ts)
-{
-    return ts.tv_sec * 1000000ll + 1ll * ts.tv_nsec / 1000ll;
-}
-
-static InputFormat get_input_format(wf_buffer& buffer)
+static InputFormat get_input_format(const wf_buffer& buffer)
 {
     if (use_dmabuf && !use_hwupload) {
         return INPUT_FORMAT_DMABUF;
     }
-    switch (buffer.format) {
-    case WL_SHM_FORMAT_ARGB8888:
-    case WL_SHM_FORMAT_XRGB8888:
-        return INPUT_FORMAT_BGR0;
-    case WL_SHM_FORMAT_XBGR8888:
-    case WL_SHM_FORMAT_ABGR8888:
-        return INPUT_FORMAT_RGB0;
-    case WL_SHM_FORMAT_BGR888:
-        return INPUT_FORMAT_BGR8;
-    case WL_SHM_FORMAT_RGB565:
-        return INPUT_FORMAT_RGB565;
-    case WL_SHM_FORMAT_BGR565:
-        return INPUT_FORMAT_BGR565;
-    case WL_SHM_FORMAT_ARGB2101010:
-    case WL_SHM_FORMAT_XRGB2101010:
-        return INPUT_FORMAT_X2RGB10;
-    case WL_SHM_FORMAT_ABGR2101010:
-    case WL_SHM_FORMAT_XBGR2101010:
-        return INPUT_FORMAT_X2BGR10;
-    case WL_SHM_FORMAT_ABGR16161616:
-    case WL_SHM_FORMAT_XBGR16161616:
-        return INPUT_FORMAT_RGBX64;
-    case WL_SHM_FORMAT_ARGB16161616:
-    case WL_SHM_FORMAT_XRGB16161616:
-        return INPUT_FORMAT_BGRX64;
-    case WL_SHM_FORMAT_ABGR16161616F:
-    case WL_SHM_FORMAT_XBGR16161616F:
-        return INPUT_FORMAT_RGBX64F;
-    default:
+
+    auto format = get_shm_input_format(buffer.format);
+    if (!format.has_value()) {
         fprintf(stderr, "Unsupported buffer format %d, exiting.", buffer.format);
         std::exit(0);
     }
+
+    return format.value();
+}
+
+/* Convert the crop of the view to buffer pixels, the buffer may be scaled */
+static capture_region get_buffer_crop(const capture_view& view, const wf_buffer& buffer)
+{
+    if (!view.crop.is_selected())
+        return capture_region{0, 0, buffer.width, buffer.height};
+
+    double scale_x = 1.0 * buffer.width / view.target->region.width;
+    double scale_y = 1.0 * buffer.height / view.target->region.height;
+    capture_region crop{int32_t(view.crop.x * scale_x), int32_t(view.crop.y * scale_y),
+        int32_t(view.crop.width * scale_x), int32_t(view.crop.height * scale_y)};
+
+    /* ffmpeg requires even width and height */
+    crop.width = std::min(crop.width, buffer.width - crop.x) & ~1;
+    crop.height = std::min(crop.height, buffer.height - crop.y) & ~1;
+    return crop;
+}
+
+/* The damage of the buffer in pixels of the cropped frame */
+static RoiRect get_crop_damage(const capture_region& crop, const wf_buffer& buffer)
+{
+    capture_region damage = buffer.damage;
+    if (buffer.y_invert)
+        damage.y = buffer.height - damage.y - damage.height;
+
+    int32_t x1 = std::max(damage.x, crop.x);
+    int32_t y1 = std::max(damage.y, crop.y);
+    int32_t x2 = std::min(damage.x + damage.width, crop.x + crop.width);
+    int32_t y2 = std::min(damage.y + damage.height, crop.y + crop.height);
+    if (x2 <= x1 || y2 <= y1)
+        return RoiRect{};
+
+    return RoiRect{x1 - crop.x, y1 - crop.y, x2 - x1, y2 - y1};
+}
+
+/* Offset of the crop in a buffer with the given stride. The crop is applied
+ * by pointing the encoder at it, the pixels are not copied. */
+static size_t get_crop_offset(const capture_region& crop, const wf_buffer& buffer,
+    uint32_t stride)
+{
+    int32_t row = buffer.y_invert ? buffer.height - crop.y - crop.height : crop.y;
+    return 1ull * row * stride + 1ull * crop.x * get_bytes_per_pixel(get_input_format(buffer));
+}
+
+/* Reference the pixels of a shm buffer, so that the encoder can use them
+ * without a copy. The buffer is not captured into again until the last
+ * reference is dropped. */
+static AVBufferRef *ref_capture_buffer(wf_buffer& buffer)
+{
+    buffer.holds++;
+    AVBufferRef *ref = av_buffer_create((uint8_t*)buffer.data, buffer.size,
+        [] (void *opaque, uint8_t *) {
+            static_cast<wf_buffer*>(opaque)->holds--;
+        }, &buffer, AV_BUFFER_FLAG_READONLY);
+
+    if (!ref)
+        buffer.holds--;
+
+    return ref;
 }
 
-static void write_loop(FrameWriterParams params)
+/* When wf-recorder was started, to report how long it took until the first
+ * writer was ready */
+static uint64_t startup_usec;
+static std::atomic<bool> startup_reported{false};
+
+static void write_loop(capture_view& view)
 {
+    auto& params = view.params;
+    auto& buffers = view.target->buffers;
+    capture_region crop;
+    uint64_t last_base_usec = 0;
+
     /* Ignore SIGTERM/SIGINT/SIGHUP, main loop is responsible for the exit_main_loop signal */
     sigset_t sigset;
     sigemptyset(&sigset);
@@ -622,36 +528,44 @@ static void write_loop(FrameWriterParams params)
         sigaddset(&sigset, signo);
     }
     pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+    trace_thread_name("writer " + params.file);
+    ThreadCpuRegistration cpu_registration(THREAD_STAGE_WRITER, params.file);
 
 #ifdef HAVE_AUDIO
     std::unique_ptr<AudioReader> pr;
 #endif
 
-    std::optional<uint64_t> first_frame_ts;
-
     while(!exit_main_loop)
     {
         // wait for frame to become available
-        while(buffers.encode().ready_encode() != true && !exit_main_loop) {
+        while(buffers.encode(view.consumer).ready_encode(view.consumer) != true && !exit_main_loop) {
             std::this_thread::sleep_for(std::chrono::microseconds(1000));
         }
         if (exit_main_loop) {
             break;
         }
 
-        auto& buffer = buffers.encode();
+        auto& buffer = buffers.encode(view.consumer);
+        uint64_t picked_usec = 0;
+        if (metrics_enabled() || trace_enabled())
+            picked_usec = metrics_now_usec();
+        metrics_record(METRICS_STAGE_QUEUE, picked_usec - buffer.delivered_usec);
+        trace_event("encode queue", buffer.delivered_usec, picked_usec,
+            "frame", buffer.base_usec);
 
-        frame_writer_pending_mutex.lock();
-        frame_writer_mutex.lock();
-        frame_writer_pending_mutex.unlock();
+        view.writer_pending_mutex.lock();
+        view.writer_mutex.lock();
+        view.writer_pending_mutex.unlock();
 
+        auto& frame_writer = view.writer;
         if (!frame_writer)
         {
             /* This is the first time buffer attributes are available */
+            crop = get_buffer_crop(view, buffer);
             params.format = get_input_format(buffer);
             params.drm_format = buffer.drm_format;
-            params.width = buffer.width;
-            params.height = buffer.height;
+            params.width = crop.width;
+            params.height = crop.height;
             params.stride = buffer.stride;
             frame_writer = std::unique_ptr<FrameWriter> (new FrameWriter(params));
 
@@ -667,70 +581,134 @@ static void write_loop(FrameWriterParams params)
                 }
             }
 #endif
+            if (!startup_reported.exchange(true))
+            {
+                fprintf(stderr, "Started in %.1f ms, capability cache: %" PRIu64 " hits, %"
+                    PRIu64 " misses\n", (get_monotonic_usec() - startup_usec) / 1.0e3,
+                    capability_cache_hits(), capability_cache_misses());
+            }
+        } else
+        {
+            /* The buffers are reallocated when the mode or the scale of the
+             * output changes */
+            auto buffer_crop = get_buffer_crop(view, buffer);
+            auto format = get_input_format(buffer);
+            if (buffer_crop.width != crop.width || buffer_crop.height != crop.height ||
+                buffer.stride != params.stride || format != params.format)
+            {
+                params.format = format;
+                params.width = buffer_crop.width;
+                params.height = buffer_crop.height;
+                params.stride = buffer.stride;
+                if (!frame_writer->reconfigure_input(params.width, params.height,
+                    params.stride, params.format))
+                {
+                    view.writer_mutex.unlock();
+                    break;
+                }
+            }
+
+            crop = buffer_crop;
         }
 
         bool drop = false;
         uint64_t sync_timestamp = 0;
-        if (first_frame_ts.has_value()) {
-            sync_timestamp = buffer.base_usec - first_frame_ts.value();
+        {
+            std::lock_guard<std::mutex> lock(first_frame_mutex);
+            if (!first_frame_ts.has_value() && view.primary) {
 #ifdef HAVE_AUDIO
-        } else if (pr) {
-            if (!pr->get_time_base() || pr->get_time_base() > buffer.base_usec) {
+                if (pr) {
+                    if (pr->get_time_base() && pr->get_time_base() <= buffer.base_usec)
+                        first_frame_ts = pr->get_time_base();
+                } else
+#endif
+                first_frame_ts = buffer.base_usec;
+            }
+
+            /* The other views wait for the first one to start the recording */
+            if (!first_frame_ts.has_value() || buffer.base_usec < first_frame_ts.value()) {
+                drop = true;
+            } else if (buffer.base_usec <= last_base_usec) {
+                /* A frame in flight was served from an already encoded compositor frame */
                 drop = true;
             } else {
-                first_frame_ts = pr->get_time_base();
                 sync_timestamp = buffer.base_usec - first_frame_ts.value();
+                last_base_usec = buffer.base_usec;
             }
-#endif
-        } else {
-            sync_timestamp = 0;
-            first_frame_ts = buffer.base_usec;
         }
 
         bool do_cont = false;
 
         if (!drop) {
+            uint64_t encode_start = view.target->overload ? get_monotonic_usec() : 0;
+            if (params.roi)
+                frame_writer->add_damage(get_crop_damage(crop, buffer));
             if (use_dmabuf) {
                 if (use_hwupload) {
                     uint32_t stride = 0;
                     void *map_data = NULL;
+                    /* The bo is unmapped right away, so the pixels are copied */
                     void *data = gbm_bo_map(buffer.bo, 0, 0, buffer.width, buffer.height,
                         GBM_BO_TRANSFER_READ, &stride, &map_data);
                     if (!data) {
                         std::cerr << "Failed to map bo" << std::endl;
+                        metrics_count(METRICS_FRAMES_FAILED);
                         break;
                     }
-                    do_cont = frame_writer->add_frame((unsigned char*)data,
-                        sync_timestamp, buffer.y_invert);
+                    do_cont = frame_writer->add_frame((unsigned char*)data +
+                        get_crop_offset(crop, buffer, stride), sync_timestamp, buffer.y_invert);
                     gbm_bo_unmap(buffer.bo, map_data);
                 } else {
                     do_cont = frame_writer->add_frame(buffer.bo,
                         sync_timestamp, buffer.y_invert);
                 }
             } else {
-                do_cont = frame_writer->add_frame((unsigned char*)buffer.data,
-                    sync_timestamp, buffer.y_invert);
+                do_cont = frame_writer->add_frame((unsigned char*)buffer.data +
+                    get_crop_offset(crop, buffer, buffer.stride), sync_timestamp, buffer.y_invert,
+                    ref_capture_buffer(buffer));
+            }
+            metrics_count(do_cont ? METRICS_FRAMES_ENCODED : METRICS_FRAMES_FAILED);
+            if (encode_start)
+            {
+                uint64_t elapsed = get_monotonic_usec() - encode_start;
+                uint64_t average = view.encode_usec.load(std::memory_order_relaxed);
+                view.encode_usec.store(average ? (average * 7 + elapsed) / 8 : elapsed,
+                    std::memory_order_relaxed);
+            }
+            if (trace_enabled())
+            {
+                trace_event("add frame", picked_usec, metrics_now_usec(),
+                    "frame", buffer.base_usec, "pts", sync_timestamp);
             }
         } else {
+            metrics_count(METRICS_FRAMES_DROPPED);
             do_cont = true;
         }
 
-        frame_writer_mutex.unlock();
+        view.writer_mutex.unlock();
 
         if (!do_cont) {
             break;
         }
 
-        buffers.next_encode();
+        buffers.next_encode(view.consumer);
+        metrics_gauge_add(METRICS_ENCODE_QUEUE, -1);
+    }
+
+    std::lock_guard<std::mutex> lock(view.writer_mutex);
+    /* The other views don't wait for this one to write the header */
+    if (!view.writer)
+    {
+        for (auto& sink : params.shared_outputs)
+            sink->remove_writer();
     }
 
-    std::lock_guard<std::mutex> lock(frame_writer_mutex);
     /* Free the AudioReader connection first. This way it'd flush any remaining
      * frames to the FrameWriter */
 #ifdef HAVE_AUDIO
     pr = nullptr;
 #endif
-    frame_writer = nullptr;
+    view.writer = nullptr;
 }
 
 void handle_graceful_termination(int)
@@ -756,14 +734,27 @@ static bool user_specified_overwrite(std::string filename)
     return true;
 }
 
+static bool has_ext_capture()
+{
+#ifdef HAVE_EXT_IMAGE_COPY_CAPTURE
+    return ext_copy_manager != NULL && ext_source_manager != NULL;
+#else
+    return false;
+#endif
+}
+
 static void check_has_protos()
 {
     if (shm == NULL) {
         fprintf(stderr, "compositor is missing wl_shm\n");
         exit(EXIT_FAILURE);
     }
-    if (screencopy_manager == NULL) {
-        fprintf(stderr, "compositor doesn't support wlr-screencopy-unstable-v1\n");
+    if (screencopy_manager == NULL && !has_ext_capture()) {
+        fprintf(stderr, "compositor doesn't support wlr-screencopy-unstable-v1"
+#ifdef HAVE_EXT_IMAGE_COPY_CAPTURE
+            " or ext-image-copy-capture-v1"
+#endif
+            "\n");
         exit(EXIT_FAILURE);
     }
 
@@ -792,6 +783,36 @@ static void sync_wayland()
     wl_display_roundtrip(display);
 }
 
+/* Dispatch the Wayland events which arrive within timeout ms (-1 to block).
+ * Returns -1 if the connection failed. */
+static int dispatch_wayland(int timeout)
+{
+    /* Only synthetic frames, wait for the timeout */
+    if (display == NULL)
+    {
+        if (poll(NULL, 0, timeout) < 0 && errno != EINTR)
+            return -1;
+        return 0;
+    }
+
+    while (wl_display_prepare_read(display) != 0)
+        wl_display_dispatch_pending(display);
+    wl_display_flush(display);
+
+    struct pollfd pfd = { wl_display_get_fd(display), POLLIN, 0 };
+    int ret = poll(&pfd, 1, timeout);
+    if (ret <= 0)
+    {
+        wl_display_cancel_read(display);
+        return (ret < 0 && errno != EINTR) ? -1 : 0;
+    }
+
+    if (wl_display_read_events(display) < 0)
+        return -1;
+
+    return wl_display_dispatch_pending(display);
+}
+
 static void load_output_info()
 {
     for (auto& wo : available_outputs)
@@ -835,43 +856,6 @@ static wf_recorder_output* choose_interactive()
     return &*it;
 }
 
-struct capture_region
-{
-    int32_t x, y;
-    int32_t width, height;
-
-    capture_region()
-        : capture_region(0, 0, 0, 0) {}
-
-    capture_region(int32_t _x, int32_t _y, int32_t _width, int32_t _height)
-        : x(_x), y(_y), width(_width), height(_height) { }
-
-    void set_from_string(std::string geometry_string)
-    {
-        if (sscanf(geometry_string.c_str(), "%d,%d %dx%d", &x, &y, &width, &height) != 4)
-        {
-            fprintf(stderr, "Bad geometry: %s, capturing whole output instead.\n",
-                geometry_string.c_str());
-            x = y = width = height = 0;
-            return;
-        }
-    }
-
-    bool is_selected()
-    {
-        return width > 0 && height > 0;
-    }
-
-    bool contained_in(const capture_region& output) const
-    {
-        return
-            output.x <= x &&
-            output.x + output.width >= x + width &&
-            output.y <= y &&
-            output.y + output.height >= y + height;
-    }
-};
-
 static wf_recorder_output* detect_output_from_region(const capture_region& region)
 {
     for (auto& wo : available_outputs)
@@ -913,6 +897,8 @@ Use Ctrl+C to stop.)");
                             To modify codec parameters, use -p <option_name>=<option_value>
   
   -r, --framerate           Changes framerate to constant framerate with a given value.
+                            Frames are only copied from the compositor at this rate, timed
+                            to the refresh of the output.
   
   -d, --device              Selects the device to use when encoding the video
                             Some drivers report support for rgb0 data for vaapi input but
@@ -927,6 +913,8 @@ Use Ctrl+C to stop.)");
                             file, which however has a variable refresh rate. When this option is
                             on, wf-recorder does not use this optimization and continuously
                             records new frames, even if there are no updates on the screen.
+                            Only the screencopy capture backend supports this, so it is used
+                            instead of ext.
 
   -f <filename>.ext         By using the -f option the output file will have the name :
                             filename.ext and the file format will be determined by provided
@@ -938,10 +926,19 @@ Use Ctrl+C to stop.)");
   -m, --muxer               Set the output format to a specific muxer instead of detecting it
                             from the filename.
 
+  -T, --tee                 Write the same encoded video to an additional output, for example
+                            to stream and record at the same time. Can be used multiple times.
+                            The format is "[f=muxer:onfail=abort|ignore]url", the options in
+                            brackets are optional. By default a failing or too slow additional
+                            output is dropped without affecting the others.
+
   -x, --pixel-format        Set the output pixel format. These can be found by running:
                             ffmpeg -pix_fmts
 
   -g, --geometry            Selects a specific part of the screen. The format is "x,y WxH".
+                            Can be used multiple times to record several regions of the same
+                            output to separate files (recording-1.mp4, recording-2.mp4, ...),
+                            they are all cropped from a single capture of the output.
 
   -h, --help                Prints this help screen.
 
@@ -950,8 +947,82 @@ Use Ctrl+C to stop.)");
   -l, --log                 Generates a log on the current terminal. Debug purposes.
 
   -L, --list-output          List the available outputs.
+
+  --adaptive-framerate      Capture fewer frames while the encoder can't keep up, and all frames
+                            again once it can. Without it, frames are captured irregularly
+                            when the encoder is too slow.
+
+  --threading               How the encoders and the filters use threads: latency for slice
+                            threads, which encode each frame at once, or throughput for frame
+                            threads, which delay the video by about a frame per thread. The
+                            default auto uses latency for network outputs and throughput for
+                            files. The number of threads can follow, e.g. latency:4.
+
+  --thread-pool             Run the slice threads of the encoders and the filters in one pool
+                            of the given number of workers, or of one per CPU with auto. No
+                            encoder or filter then uses more threads than the pool has. Add
+                            :pin to keep each worker on its own CPU, e.g. 8:pin.
+
+  --thread-sched            Set the scheduling of a kind of threads, as ROLE:SETTING[:SETTING].
+                            ROLE is capture, writer, rendition, muxer, audio or pool, SETTING
+                            is cpus=LIST, nice=N, or fifo=PRIORITY or rr=PRIORITY for the
+                            capture and audio threads, e.g. capture:cpus=2:fifo=10. Can be
+                            given several times.
+
+  --autotune                Before recording, encode a second of synthetic screen content with
+                            each preset of the codecs, from the fastest one on, and use the
+                            slowest preset which still encodes faster than real time. Several
+                            codecs can be given separated by commas, the first one which keeps
+                            up is used, e.g. --autotune=libx265,libx264. Without codecs, the
+                            presets of the codec of -c are tuned. The results are cached in
+                            $XDG_CACHE_HOME/wf-recorder/autotune for the next recordings.
+
+  --autotune-headroom       How much faster than real time the autotuned encoder has to be,
+                            in percent. The default is 25.
+
+  --no-capability-cache     Probe the formats of the codecs and the DRM device again instead of
+                            using $XDG_CACHE_HOME/wf-recorder/capabilities, e.g. to compare
+                            the startup time printed when the first frame is encoded.
+
+  --roi                     Encode the parts of the frames which changed at a higher quality
+                            than the rest, with encoders which support regions of interest
+                            like libx264, libx265, libvpx-vp9 and VA-API. A focus region
+                            which gets an even higher quality can be given in pixels of the
+                            video, e.g. --roi="0,0 800x600".
+
+  -V, --verbose             Print a summary of the CPU usage of each kind of thread and the CPU
+                            time the writers spend on each frame every five seconds.
   
   -o, --output              Specify the output where the video is to be recorded.
+                            Several outputs can be given separated by commas, they are
+                            recorded at the same time to separate files named after the
+                            output, for example recording-DP-1.mp4. Audio and additional
+                            outputs from --tee go with the first output.
+
+  --merge-outputs           Store multiple outputs or regions as video streams of the same file.
+
+  --frames-in-flight        Number of frames requested from the compositor at the same time.
+                            The default of 1 waits for each copy before requesting the next
+                            frame, more frames in flight hide the round trip to the compositor
+                            on high refresh rate outputs. The achieved capture rate and the
+                            round trip time are printed at the end of the recording.
+
+  --capture-backend         Selects how frames are captured: ext (ext-image-copy-capture-v1),
+                            screencopy (wlr-screencopy-unstable-v1) or synthetic. By default ext
+                            is used if the compositor supports it, except with --no-damage,
+                            which ext doesn't support. synthetic generates frames in
+                            memory without a compositor, to measure the encoding. Their size can
+                            be given as synthetic:WxH, the default is 1920x1080.
+
+  --metrics                 Measure the latency of each stage of the recording and count the
+                            captured, dropped and encoded frames. The metrics are written in
+                            the Prometheus text format to the given file every second, or sent
+                            to each connection of a Unix socket given as unix:PATH.
+
+  --trace                   Record the timeline of every frame through the capture, the
+                            filters, the encoders and the outputs, and of the audio, and
+                            write it to the given file at exit in the Chrome trace format,
+                            which can be opened in Perfetto or chrome://tracing.
 
   -p, --codec-param         Change the codec parameters.
                             -p <option_name>=<option_value>
@@ -959,6 +1030,13 @@ Use Ctrl+C to stop.)");
   -F, --filter              Specify the ffmpeg filter string to use. For example,
                             -F scale_vaapi=format=nv12 is used for VAAPI.
 
+  --rendition               Additionally encode the video at another size, for example a
+                            720p proxy of a full resolution recording. The format is
+                            "WxH[:codec=codec][:bitrate=bitrate][:file=file]". Without a file,
+                            the rendition is stored as another video stream in the output.
+                            Can be used multiple times, smaller renditions are scaled from
+                            the next larger one.
+
   -b, --bframes             This option is used to set the maximum number of b-frames to be used.
                             If b-frames are not supported by your hardware, set this to 0.
     
@@ -1017,64 +1095,396 @@ Examples:)");
 }
 
 capture_region selected_region{};
-wf_recorder_output *chosen_output = nullptr;
-zwlr_screencopy_frame_v1 *frame = NULL;
 
-void request_next_frame()
+/* Request a new frame into the next free buffer, returns false if there is none */
+static bool start_capture(capture_target& target)
 {
-    if (frame != NULL)
-    {
-        zwlr_screencopy_frame_v1_destroy(frame);
-    }
+    wf_buffer *buffer = target.buffers.request_capture();
+    if (!buffer)
+        return false;
+
+    target.source->request_frame(buffer);
+    return true;
+}
+
+/* Time to request the frame which should be presented closest to the next
+ * frame time. Screencopy delivers the first output frame after the request,
+ * so the request is placed half a refresh before the closest refresh, which
+ * is extrapolated from the last presentation time. */
+static uint64_t get_request_time(const capture_target& target)
+{
+    int64_t refresh = target.output->refresh > 0 ? 1000000000ll / target.output->refresh : 0;
+    if (!refresh || !target.last_presented_usec)
+        return target.next_frame_usec;
+
+    int64_t phase = target.last_presented_usec;
+    int64_t offset = (int64_t)target.next_frame_usec - phase;
+    int64_t closest = phase + std::llround(1.0 * offset / refresh) * refresh;
+    return std::max<int64_t>(closest - refresh / 2, 0);
+}
+
+static void advance_schedule(capture_target& target, uint64_t now)
+{
+    target.next_frame_usec += target.frame_interval_usec;
+
+    /* Don't try to catch up after a stall */
+    if (target.next_frame_usec < now)
+        target.next_frame_usec = now + target.frame_interval_usec;
+}
 
-    /* Capture the whole output if the user hasn't provided a good geometry */
-    if (!selected_region.is_selected())
+/* Hand the oldest frame in flight over to the writer threads */
+static void finish_capture(capture_target& target, const capture_frame& frame)
+{
+    auto& buffer = *frame.buffer;
+    buffer.base_usec = timespec_to_usec(buffer.presented);
+
+    uint64_t now = get_monotonic_usec();
+    uint64_t round_trip = now - frame.requested_usec;
+    if (!target.captured_frames)
+        target.first_capture_usec = now;
+    target.last_capture_usec = now;
+    target.captured_frames++;
+    target.total_round_trip_usec += round_trip;
+    target.max_round_trip_usec = std::max(target.max_round_trip_usec, round_trip);
+    metrics_record(METRICS_STAGE_CAPTURE, round_trip);
+    metrics_count(METRICS_FRAMES_CAPTURED);
+
+    /* Frames in flight at the same time may be served from the same
+     * compositor frame. The writers skip those, we only count them. */
+    if (buffer.base_usec <= target.last_presented_usec)
     {
-        frame = zwlr_screencopy_manager_v1_capture_output(
-            screencopy_manager, 1, chosen_output->output);
+        target.duplicate_frames++;
+        metrics_count(METRICS_FRAMES_DUPLICATE);
     } else
     {
-        frame = zwlr_screencopy_manager_v1_capture_output_region(
-            screencopy_manager, 1, chosen_output->output,
-            selected_region.x - chosen_output->x,
-            selected_region.y - chosen_output->y,
-            selected_region.width, selected_region.height);
+        /* Without delays in scheduling, the frames are handled at the same
+         * intervals as the compositor presented them */
+        if (target.last_ready_usec)
+        {
+            int64_t handled = now - target.last_ready_usec;
+            int64_t presented = buffer.base_usec - target.last_presented_usec;
+            uint64_t jitter = std::abs(handled - presented);
+            target.jitter_frames++;
+            target.total_jitter_usec += jitter;
+            target.max_jitter_usec = std::max(target.max_jitter_usec, jitter);
+            metrics_record(METRICS_STAGE_READY_JITTER, jitter);
+        }
+        target.last_ready_usec = now;
     }
+    target.last_presented_usec = std::max(target.last_presented_usec, buffer.base_usec);
 
-    zwlr_screencopy_frame_v1_add_listener(frame, &frame_listener, NULL);
+    buffer.delivered_usec = now;
+    trace_event("capture", frame.requested_usec, now, "frame", buffer.base_usec);
+    metrics_gauge_add(METRICS_ENCODE_QUEUE, target.views.size());
+    target.source->release_frame();
+    target.buffers.finish_capture();
 }
 
-static void parse_codec_opts(std::map<std::string, std::string>& options, const std::string param)
+/* How often the overload controllers look at the writers */
+#define OVERLOAD_CHECK_INTERVAL_USEC 1000000
+
+/* Adjust the capture rate of a target to what its writers can keep up with */
+static void update_overload(capture_target& target)
 {
-    size_t pos;
-    pos = param.find("=");
-    if (pos != std::string::npos && pos != param.length() -1)
+    OverloadSample sample{};
+    sample.queued_frames = target.buffers.queued_encode();
+    for (auto& view : target.views)
     {
-        auto optname = param.substr(0, pos);
-        auto optvalue = param.substr(pos + 1, param.length() - pos - 1);
-        options.insert(std::pair<std::string, std::string>(optname, optvalue));
+        sample.encode_usec = std::max(sample.encode_usec,
+            view.encode_usec.load(std::memory_order_relaxed));
+    }
+    sample.writer_saturated = thread_stats_overloaded(THREAD_STAGE_WRITER);
+
+    if (!target.overload->update(sample))
+        return;
+
+    target.frame_interval_usec = target.overload->frame_interval_usec(target.paced_interval_usec);
+    if (target.overload->rate_percent() < 100)
+    {
+        fprintf(stderr, "Output %s: capturing %d%% of the frames (%.1f fps), %s\n",
+            target.output->name.c_str(), target.overload->rate_percent(),
+            1.0e6 / target.frame_interval_usec, target.overload->reason().c_str());
     } else
     {
-        std::cerr << "Invalid codec option " + param << std::endl;
+        fprintf(stderr, "Output %s: capturing all frames again, %s\n",
+            target.output->name.c_str(), target.overload->reason().c_str());
     }
 }
 
-static void init_wayland_client()
+static void print_capture_stats(const capture_target& target)
 {
-    display = wl_display_connect(NULL);
-    if (display == NULL)
+    if (target.captured_frames == 0)
+        return;
+
+    double duration = (target.last_capture_usec - target.first_capture_usec) / 1.0e6;
+    fprintf(stderr, "Output %s: captured %" PRIu64 " frames (%" PRIu64 " duplicates)",
+        target.output->name.c_str(), target.captured_frames, target.duplicate_frames);
+    if (duration > 0)
     {
-        fprintf(stderr, "failed to create display: %m\n");
-        exit(EXIT_FAILURE);
+        fprintf(stderr, ", %.1f fps", (target.captured_frames - 1) / duration);
     }
-    struct wl_registry *registry = wl_display_get_registry(display);
-    wl_registry_add_listener(registry, &registry_listener, NULL);
-    sync_wayland();
+
+    fprintf(stderr, ", compositor round trip avg %.2f ms, max %.2f ms",
+        target.total_round_trip_usec / 1.0e3 / target.captured_frames,
+        target.max_round_trip_usec / 1.0e3);
+    if (target.jitter_frames)
+    {
+        fprintf(stderr, ", frame ready jitter avg %.2f ms, max %.2f ms",
+            target.total_jitter_usec / 1.0e3 / target.jitter_frames,
+            target.max_jitter_usec / 1.0e3);
+    }
+    fprintf(stderr, "\n");
 }
 
-static void list_available_outputs()
+/* Pick the codec and preset with autotune() for the largest video which is
+ * recorded. Returns false if the codec can't be tuned. */
+static bool autotune_tune(FrameWriterParams& params, const std::vector<std::string>& codecs,
+    int headroom, const std::vector<wf_recorder_output*>& outputs,
+    const std::vector<capture_region>& regions)
 {
-    init_wayland_client();
+    AutotuneParams tune;
+    tune.codecs = codecs.empty() ? std::vector<std::string>{params.codec} : codecs;
+    if (!autotune_supports_codec(tune.codecs.front()))
+    {
+        std::cerr << "Cannot autotune the codec " << tune.codecs.front() << std::endl;
+        return false;
+    }
+
+    /* The outputs are laid out in logical pixels, scaled outputs are
+     * captured at the size of their mode */
+    auto scale_of = [] (const wf_recorder_output *output)
+    {
+        int logical = std::max(output->width, output->height);
+        int mode = std::max(output->mode_width, output->mode_height);
+        return logical > 0 && mode > 0 ? 1.0 * mode / logical : 1.0;
+    };
+
+    tune.width = tune.height = 0;
+    int refresh = 0;
+    for (auto output : outputs)
+    {
+        double scale = scale_of(output);
+        int width = output->width * scale, height = output->height * scale;
+        for (auto& region : regions)
+        {
+            if (region.is_selected() && region.contained_in(
+                {output->x, output->y, output->width, output->height}))
+            {
+                width = region.width * scale;
+                height = region.height * scale;
+            }
+        }
+
+        if (width * height > tune.width * tune.height)
+        {
+            tune.width = width;
+            tune.height = height;
+        }
+        refresh = std::max(refresh, output->refresh);
+    }
+
+    tune.framerate = params.framerate > 0 ? params.framerate :
+        refresh > 0 ? (refresh + 500) / 1000 : 60;
+    tune.headroom = headroom;
+    tune.pix_fmt = params.pix_fmt;
+    tune.codec_options = params.codec_options;
+    tune.threading = params.threading;
+    tune.bframes = params.bframes;
+    tune.live = OutputSink::is_network_url(params.file);
+    for (auto& tee : params.tee_outputs)
+        tune.live |= OutputSink::is_network_url(tee.file);
+
+    auto result = autotune(tune);
+    if (!result.ok)
+    {
+        std::cerr << "Autotune: no codec encodes " << tune.width << "x" << tune.height <<
+            " at " << tune.framerate << " fps in real time, keeping " << params.codec <<
+            std::endl;
+        return true;
+    }
+
+    std::cerr << "Autotune: " << result.codec;
+    if (!result.option.empty())
+        std::cerr << " " << result.option << "=" << result.value;
+    std::cerr << ", " << (int)result.fps << " fps" << (result.cached ? " (cached)" : "") <<
+        std::endl;
+
+    params.codec = result.codec;
+    if (!result.option.empty())
+        params.codec_options[result.option] = result.value;
+    return true;
+}
+
+static void parse_codec_opts(std::map<std::string, std::string>& options, const std::string param)
+{
+    size_t pos;
+    pos = param.find("=");
+    if (pos != std::string::npos && pos != param.length() -1)
+    {
+        auto optname = param.substr(0, pos);
+        auto optvalue = param.substr(pos + 1, param.length() - pos - 1);
+        options.insert(std::pair<std::string, std::string>(optname, optvalue));
+    } else
+    {
+        std::cerr << "Invalid codec option " + param << std::endl;
+    }
+}
+
+/* Parse a tee output in the syntax of the ffmpeg tee muxer:
+ * [f=muxer:onfail=abort|ignore]url */
+static bool parse_tee_output(FrameWriterTeeOutput& output, std::string param)
+{
+    if (!param.empty() && param[0] == '[')
+    {
+        size_t end = param.find(']');
+        if (end == std::string::npos)
+        {
+            std::cerr << "Invalid tee output " << param << std::endl;
+            return false;
+        }
+
+        std::map<std::string, std::string> options;
+        std::string option_list = param.substr(1, end - 1);
+        size_t start = 0;
+        while (start < option_list.size())
+        {
+            size_t sep = option_list.find(':', start);
+            if (sep == std::string::npos)
+                sep = option_list.size();
+            parse_codec_opts(options, option_list.substr(start, sep - start));
+            start = sep + 1;
+        }
+
+        for (auto& opt : options)
+        {
+            if (opt.first == "f")
+            {
+                output.muxer = opt.second;
+            } else if (opt.first == "onfail")
+            {
+                output.required = opt.second == "abort";
+            } else
+            {
+                std::cerr << "Unknown tee option " << opt.first << std::endl;
+            }
+        }
+
+        param = param.substr(end + 1);
+    }
+
+    if (param.empty())
+    {
+        std::cerr << "Missing url for tee output" << std::endl;
+        return false;
+    }
+
+    output.file = param;
+    return true;
+}
+
+static int64_t parse_bitrate(const std::string& value)
+{
+    char *end;
+    double bitrate = strtod(value.c_str(), &end);
+    switch (*end)
+    {
+      case 'k':
+      case 'K':
+        bitrate *= 1e3;
+        break;
+      case 'm':
+      case 'M':
+        bitrate *= 1e6;
+        break;
+      case 'g':
+      case 'G':
+        bitrate *= 1e9;
+        break;
+    }
+
+    return bitrate;
+}
+
+/* Parse a rendition: WxH[:codec=codec][:bitrate=bitrate][:file=file] */
+static bool parse_rendition(FrameWriterRendition& rendition, std::string param)
+{
+    if (sscanf(param.c_str(), "%dx%d", &rendition.width, &rendition.height) != 2 ||
+        rendition.width <= 0 || rendition.height <= 0)
+    {
+        std::cerr << "Invalid rendition " << param << std::endl;
+        return false;
+    }
+
+    /* ffmpeg requires even width and height */
+    rendition.width -= rendition.width % 2;
+    rendition.height -= rendition.height % 2;
+
+    size_t start = param.find(':');
+    while (start != std::string::npos)
+    {
+        param = param.substr(start + 1);
+        size_t end = param.find(':');
+        std::string option = param.substr(0, end);
+        size_t eq = option.find('=');
+        std::string name = option.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : option.substr(eq + 1);
+
+        if (name == "file")
+        {
+            /* The file name may contain colons, so it takes the rest */
+            if (eq == std::string::npos || eq + 1 == param.size())
+            {
+                std::cerr << "Missing rendition file name" << std::endl;
+                return false;
+            }
+
+            rendition.file = param.substr(eq + 1);
+            break;
+        } else if (name == "codec")
+        {
+            rendition.codec = value;
+        } else if (name == "bitrate")
+        {
+            rendition.bitrate = parse_bitrate(value);
+        } else
+        {
+            std::cerr << "Unknown rendition option " << name << std::endl;
+            return false;
+        }
+
+        start = end;
+    }
+
+    return true;
+}
+
+/* Insert the output name before the extension: recording.mp4 -> recording-DP-1.mp4 */
+static std::string output_file_name(const std::string& file, const std::string& output_name)
+{
+    size_t slash = file.rfind('/');
+    size_t dot = file.rfind('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return file + "-" + output_name;
+
+    return file.substr(0, dot) + "-" + output_name + file.substr(dot);
+}
+
+static void init_wayland_client()
+{
+    display = wl_display_connect(NULL);
+    if (display == NULL)
+    {
+        fprintf(stderr, "failed to create display: %m\n");
+        exit(EXIT_FAILURE);
+    }
+    struct wl_registry *registry = wl_display_get_registry(display);
+    wl_registry_add_listener(registry, &registry_listener, NULL);
+    sync_wayland();
+}
+
+static void list_available_outputs()
+{
+    init_wayland_client();
     load_output_info();
     print_available_outputs();
 
@@ -1084,6 +1494,7 @@ static void list_available_outputs()
 
 int main(int argc, char *argv[])
 {
+    startup_usec = get_monotonic_usec();
     FrameWriterParams params = FrameWriterParams(exit_main_loop);
     params.file = "recording." + std::string(DEFAULT_CONTAINER_FORMAT);
     params.codec = DEFAULT_CODEC;
@@ -1095,9 +1506,24 @@ int main(int argc, char *argv[])
     params.bframes = -1;
 
     constexpr const char* default_cmdline_output = "interactive";
-    std::string cmdline_output = default_cmdline_output;
+    std::vector<std::string> cmdline_outputs;
+    std::vector<capture_region> selected_regions;
+    bool merge_outputs = false;
+    size_t frames_in_flight = 1;
     bool force_no_dmabuf = false;
     bool force_overwrite = false;
+    std::string capture_backend = "auto";
+    capture_region synthetic_size{0, 0, 1920, 1080};
+    std::string metrics_target;
+    std::string trace_file;
+    bool verbose = false;
+    bool adaptive_framerate = false;
+    int thread_pool_workers = -1; // no shared pool
+    bool thread_pool_pin = false;
+    bool autotune_enabled = false;
+    std::vector<std::string> autotune_codecs; // the codec of -c if empty
+    int autotune_headroom = 25;
+    bool use_capability_cache = true;
 
     struct option opts[] = {
         { "output",            required_argument, NULL, 'o' },
@@ -1125,11 +1551,27 @@ int main(int argc, char *argv[])
         { "no-damage",         no_argument,       NULL, 'D' },
         { "overwrite",         no_argument,       NULL, 'y' },
         { "list-output",       no_argument,       NULL, 'L' },
+        { "tee",               required_argument, NULL, 'T' },
+        { "rendition",         required_argument, NULL, '%' },
+        { "merge-outputs",     no_argument,       NULL, '+' },
+        { "frames-in-flight",  required_argument, NULL, '#' },
+        { "capture-backend",   required_argument, NULL, '@' },
+        { "metrics",           required_argument, NULL, '$' },
+        { "trace",             required_argument, NULL, '!' },
+        { "verbose",           no_argument,       NULL, 'V' },
+        { "adaptive-framerate", no_argument,      NULL, '^' },
+        { "threading",         required_argument, NULL, '~' },
+        { "thread-pool",       required_argument, NULL, '|' },
+        { "thread-sched",      required_argument, NULL, '=' },
+        { "autotune",          optional_argument, NULL, ';' },
+        { "autotune-headroom", required_argument, NULL, '/' },
+        { "no-capability-cache", no_argument,    NULL, '<' },
+        { "roi",               optional_argument, NULL, '>' },
         { 0,                   0,                 NULL,  0  }
     };
 
     int c, i;
-    while((c = getopt_long(argc, argv, "o:f:m:g:c:p:r:x:C:P:R:X:d:b:B:la::hvDF:yL", opts, &i)) != -1)
+    while((c = getopt_long(argc, argv, "o:f:m:g:c:p:r:x:C:P:R:X:d:b:B:la::hvVDF:yLT:", opts, &i)) != -1)
     {
         switch(c)
         {
@@ -1142,16 +1584,34 @@ int main(int argc, char *argv[])
                 break;
 
             case 'o':
-                cmdline_output = optarg;
+            {
+                /* Several outputs can be given separated by commas */
+                std::string list = optarg;
+                size_t start = 0;
+                while (start <= list.size())
+                {
+                    size_t end = list.find(',', start);
+                    if (end == std::string::npos)
+                        end = list.size();
+                    if (end > start)
+                        cmdline_outputs.push_back(list.substr(start, end - start));
+                    start = end + 1;
+                }
                 break;
+            }
 
             case 'm':
                 params.muxer = optarg;
                 break;
 
             case 'g':
-                selected_region.set_from_string(optarg);
+            {
+                capture_region region;
+                region.set_from_string(optarg);
+                if (region.is_selected())
+                    selected_regions.push_back(region);
                 break;
+            }
 
             case 'c':
                 params.codec = optarg;
@@ -1193,6 +1653,89 @@ int main(int argc, char *argv[])
                 params.enable_ffmpeg_debug_output = true;
                 break;
 
+            case 'V':
+                verbose = true;
+                break;
+
+            case '^':
+                adaptive_framerate = true;
+                break;
+
+            case '~':
+                if (!parse_threading(optarg, params.threading))
+                {
+                    std::cerr << "Invalid threading: " << optarg << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case '|':
+            {
+                std::string pool = optarg;
+                size_t colon = pool.find(':');
+                std::string workers = pool.substr(0, colon);
+                thread_pool_pin = colon != std::string::npos && pool.substr(colon + 1) == "pin";
+                thread_pool_workers = workers == "auto" ? 0 : atoi(workers.c_str());
+                if ((colon != std::string::npos && !thread_pool_pin) ||
+                    (workers != "auto" && thread_pool_workers <= 0))
+                {
+                    std::cerr << "Invalid thread pool: " << optarg << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+
+            case '=':
+                if (!thread_scheduling_parse(optarg))
+                {
+                    std::cerr << "Invalid thread scheduling: " << optarg << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case ';':
+            {
+                autotune_enabled = true;
+                std::istringstream codecs(optarg ? optarg : "");
+                std::string codec;
+                while (std::getline(codecs, codec, ','))
+                {
+                    if (codec.empty())
+                        continue;
+
+                    if (!autotune_supports_codec(codec))
+                    {
+                        std::cerr << "Cannot autotune the codec " << codec << std::endl;
+                        return EXIT_FAILURE;
+                    }
+                    autotune_codecs.push_back(codec);
+                }
+                break;
+            }
+
+            case '/':
+                autotune_headroom = atoi(optarg);
+                if (autotune_headroom < 0)
+                {
+                    std::cerr << "Invalid autotune headroom: " << optarg << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case '<':
+                use_capability_cache = false;
+                break;
+
+            case '>':
+                params.roi = true;
+                if (optarg && sscanf(optarg, "%d,%d %dx%d", &params.roi_focus.x,
+                    &params.roi_focus.y, &params.roi_focus.width, &params.roi_focus.height) != 4)
+                {
+                    std::cerr << "Invalid focus region: " << optarg << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+
             case 'a':
 #ifdef HAVE_AUDIO
                 params.enable_audio = true;
@@ -1234,6 +1777,67 @@ int main(int argc, char *argv[])
             case 'L':
                 list_available_outputs();
                 break;
+
+            case 'T':
+            {
+                FrameWriterTeeOutput tee;
+                if (!parse_tee_output(tee, optarg))
+                    return EXIT_FAILURE;
+                params.tee_outputs.push_back(tee);
+                break;
+            }
+
+            case '%':
+            {
+                FrameWriterRendition rendition;
+                if (!parse_rendition(rendition, optarg))
+                    return EXIT_FAILURE;
+                params.renditions.push_back(rendition);
+                break;
+            }
+
+            case '+':
+                merge_outputs = true;
+                break;
+
+            case '#':
+                frames_in_flight = std::max(1, atoi(optarg));
+                break;
+
+            case '@':
+            {
+                /* The size of the synthetic frames can be given as synthetic:WxH */
+                std::string backend = optarg;
+                size_t sep = backend.find(':');
+                capture_backend = backend.substr(0, sep);
+                if (sep != std::string::npos &&
+                    (sscanf(backend.c_str() + sep + 1, "%dx%d",
+                        &synthetic_size.width, &synthetic_size.height) != 2 ||
+                    !synthetic_size.is_selected()))
+                {
+                    std::cerr << "Invalid synthetic frame size " << backend << std::endl;
+                    return EXIT_FAILURE;
+                }
+
+                if (capture_backend != "auto" && capture_backend != "screencopy" &&
+#ifdef HAVE_EXT_IMAGE_COPY_CAPTURE
+                    capture_backend != "ext" &&
+#endif
+                    capture_backend != "synthetic")
+                {
+                    std::cerr << "Unsupported capture backend " << capture_backend << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case '$':
+                metrics_target = optarg;
+                break;
+
+            case '!':
+                trace_file = optarg;
+                break;
+
 #ifdef HAVE_AUDIO
             case '*':
                 audioParams.audio_backend = optarg;
@@ -1244,12 +1848,39 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (!force_overwrite && !user_specified_overwrite(params.file))
+    if (!selected_regions.empty())
+        selected_region = selected_regions.front();
+
+    if (selected_regions.size() > buffer_pool<wf_buffer, 16>::max_consumers)
     {
+        std::cerr << "Too many regions to capture" << std::endl;
         return EXIT_FAILURE;
     }
 
-    init_wayland_client();
+    if (cmdline_outputs.size() > 1 && selected_region.is_selected())
+    {
+        std::cerr << "Cannot use a geometry when recording multiple outputs" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    capability_cache_load(use_capability_cache);
+
+    bool synthetic = capture_backend == "synthetic";
+    if (synthetic)
+    {
+        /* The frames are generated in memory, without a compositor */
+        wf_recorder_output wo{};
+        wo.name = "synthetic";
+        wo.description = "Synthetic frames";
+        wo.width = synthetic_size.width;
+        wo.height = synthetic_size.height;
+        wo.refresh = 60000;
+        available_outputs.push_back(wo);
+        force_no_dmabuf = true;
+    } else
+    {
+        init_wayland_client();
+    }
 
     if (params.codec.find("vaapi") != std::string::npos)
     {
@@ -1261,6 +1892,13 @@ int main(int argc, char *argv[])
             params.hw_device = drm_device_name;
         }
 
+        // the regions are cropped from memory, which needs shm buffers
+        if (selected_regions.size() > 1 && !force_no_dmabuf)
+        {
+            std::cerr << "capturing multiple regions, disabling DMA-BUF" << std::endl;
+            force_no_dmabuf = true;
+        }
+
         // check we use same device as compositor
         if (!params.hw_device.empty() && params.hw_device == drm_device_name && !force_no_dmabuf)
         {
@@ -1308,125 +1946,494 @@ int main(int argc, char *argv[])
         }
     }
 
-    check_has_protos();
-    load_output_info();
+    if (!synthetic)
+    {
+        check_has_protos();
+        load_output_info();
+    }
 
-    if (available_outputs.size() == 1)
+    std::vector<wf_recorder_output*> chosen_outputs;
+    if (cmdline_outputs.size() > 1)
     {
-        chosen_output = &available_outputs.front();
-        if (chosen_output->name != cmdline_output &&
-            cmdline_output != default_cmdline_output)
+        for (auto& name : cmdline_outputs)
         {
-            std::cerr << "Couldn't find requested output "
-                << cmdline_output << std::endl;
-            return EXIT_FAILURE;
+            wf_recorder_output *found = nullptr;
+            for (auto& wo : available_outputs)
+            {
+                if (wo.name == name)
+                    found = &wo;
+            }
+
+            if (found == nullptr)
+            {
+                std::cerr << "Couldn't find requested output " << name << std::endl;
+                return EXIT_FAILURE;
+            }
+
+            chosen_outputs.push_back(found);
         }
     } else
     {
-        for (auto& wo : available_outputs)
+        std::string cmdline_output = cmdline_outputs.empty() ?
+            default_cmdline_output : cmdline_outputs.front();
+        wf_recorder_output *chosen_output = nullptr;
+        if (available_outputs.size() == 1)
+        {
+            chosen_output = &available_outputs.front();
+            if (chosen_output->name != cmdline_output &&
+                cmdline_output != default_cmdline_output)
+            {
+                std::cerr << "Couldn't find requested output "
+                    << cmdline_output << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else
+        {
+            for (auto& wo : available_outputs)
+            {
+                if (wo.name == cmdline_output)
+                    chosen_output = &wo;
+            }
+
+            if (chosen_output == NULL)
+            {
+                if (cmdline_output != default_cmdline_output)
+                {
+                    std::cerr << "Couldn't find requested output "
+                        << cmdline_output.c_str() << std::endl;
+                    return EXIT_FAILURE;
+                }
+
+                if (selected_region.is_selected())
+                {
+                    chosen_output = detect_output_from_region(selected_region);
+                }
+                else
+                {
+                    chosen_output = choose_interactive();
+                }
+            }
+        }
+
+
+        if (chosen_output == nullptr)
         {
-            if (wo.name == cmdline_output)
-                chosen_output = &wo;
+            fprintf(stderr, "Failed to select output, exiting\n");
+            return EXIT_FAILURE;
         }
 
-        if (chosen_output == NULL)
+        if (selected_regions.size() > 1)
         {
-            if (cmdline_output != default_cmdline_output)
+            /* The regions are cropped from a capture of the whole output */
+            for (auto& region : selected_regions)
             {
-                std::cerr << "Couldn't find requested output "
-                    << cmdline_output.c_str() << std::endl;
-                return EXIT_FAILURE;
+                if (!region.contained_in({chosen_output->x, chosen_output->y,
+                    chosen_output->width, chosen_output->height}))
+                {
+                    fprintf(stderr, "Invalid region to capture %d,%d %dx%d: all regions "
+                        "must be completely inside the same output\n",
+                        region.x, region.y, region.width, region.height);
+                    return EXIT_FAILURE;
+                }
             }
 
-            if (selected_region.is_selected())
+            if (chosen_output->transform != WL_OUTPUT_TRANSFORM_NORMAL)
             {
-                chosen_output = detect_output_from_region(selected_region);
+                fprintf(stderr, "Capturing multiple regions is not supported on "
+                    "transformed outputs\n");
+                return EXIT_FAILURE;
             }
-            else
+        } else if (selected_region.is_selected())
+        {
+            if (!selected_region.contained_in({chosen_output->x, chosen_output->y,
+                chosen_output->width, chosen_output->height}))
             {
-                chosen_output = choose_interactive();
+                fprintf(stderr, "Invalid region to capture: must be completely "
+                    "inside the output\n");
+                selected_region = capture_region{};
             }
+        } else
+        {
+            selected_region = capture_region{chosen_output->x, chosen_output->y,
+                chosen_output->width, chosen_output->height};
         }
+
+        fprintf(stderr, "selected region %d,%d %dx%d\n", selected_region.x, selected_region.y, selected_region.width, selected_region.height);
+        chosen_outputs.push_back(chosen_output);
     }
 
+    /* ext sessions always wait for damage, only screencopy can copy every
+     * frame */
+    bool auto_backend = capture_backend == "auto";
+    if (auto_backend)
+        capture_backend = has_ext_capture() && use_damage ? "ext" : "screencopy";
+
+    if (capture_backend == "ext" && !use_damage)
+    {
+        std::cerr << "--no-damage is not supported by the ext capture backend, "
+            "use --capture-backend screencopy" << std::endl;
+        return EXIT_FAILURE;
+    }
 
-    if (chosen_output == nullptr)
+    if (capture_backend == "screencopy" && screencopy_manager == NULL)
     {
-        fprintf(stderr, "Failed to select output, exiting\n");
+        std::cerr << "compositor doesn't support wlr-screencopy-unstable-v1" << std::endl;
         return EXIT_FAILURE;
     }
 
-    params.transform = chosen_output->transform;
+    if (capture_backend == "ext" && !has_ext_capture())
+    {
+        std::cerr << "compositor doesn't support ext-image-copy-capture-v1" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    /* Only screencopy can capture a part of the output, the other backends
+     * crop the region from memory like multiple regions are */
+    bool crop_region = false;
+    if (capture_backend != "screencopy" && selected_region.is_selected() &&
+        selected_regions.size() <= 1)
+    {
+        auto output = chosen_outputs.front();
+        crop_region = selected_region.x != output->x || selected_region.y != output->y ||
+            selected_region.width != output->width || selected_region.height != output->height;
+        if (crop_region && ((use_dmabuf && !use_hwupload) ||
+            output->transform != WL_OUTPUT_TRANSFORM_NORMAL))
+        {
+            if (!auto_backend || screencopy_manager == NULL)
+            {
+                std::cerr << "Cannot capture this region with the " << capture_backend
+                    << " backend" << std::endl;
+                return EXIT_FAILURE;
+            }
+
+            capture_backend = "screencopy";
+            crop_region = false;
+        }
+    }
+
+    std::cerr << "capturing with the " << capture_backend << " backend" << std::endl;
 
-    if (selected_region.is_selected())
+    size_t nviews = std::max(chosen_outputs.size(), selected_regions.size());
+    bool multiple_views = nviews > 1;
+    std::vector<std::shared_ptr<OutputSink>> shared_outputs;
+    if (multiple_views)
     {
-        if (!selected_region.contained_in({chosen_output->x, chosen_output->y,
-            chosen_output->width, chosen_output->height}))
+        /* The encoders of all views share the cores */
+        params.threading.shared_by = nviews;
+
+        if (merge_outputs)
         {
-            fprintf(stderr, "Invalid region to capture: must be completely "
-                "inside the output\n");
-            selected_region = capture_region{};
+            shared_outputs.emplace_back(new OutputSink(params.file, params.muxer,
+                true, exit_main_loop));
+            for (auto& tee : params.tee_outputs)
+            {
+                std::cerr << "Also writing to " << tee.file << std::endl;
+                shared_outputs.emplace_back(new OutputSink(tee.file, tee.muxer,
+                    tee.required, exit_main_loop));
+            }
+
+            for (auto& sink : shared_outputs)
+                sink->set_expected_writers(nviews);
         }
-    } else
+    }
+
+    if (autotune_enabled && !autotune_tune(params, autotune_codecs, autotune_headroom,
+        chosen_outputs, selected_regions.size() > 1 ? selected_regions :
+            std::vector<capture_region>{selected_region}))
     {
-        selected_region = capture_region{chosen_output->x, chosen_output->y,
-            chosen_output->width, chosen_output->height};
+        return EXIT_FAILURE;
     }
 
-    fprintf(stderr, "selected region %d,%d %dx%d\n", selected_region.x, selected_region.y, selected_region.width, selected_region.height);
+    std::vector<std::string> output_files;
+    if (!shared_outputs.empty())
+    {
+        output_files.push_back(params.file);
+        for (auto& tee : params.tee_outputs)
+            output_files.push_back(tee.file);
+    }
 
-    bool spawned_thread = false;
-    std::thread writer_thread;
+    for (auto output : chosen_outputs)
+    {
+        capture_targets.emplace_back();
+        auto& target = capture_targets.back();
+        target.output = output;
+
+        /* The crop of each view and the name which distinguishes its files */
+        std::vector<std::pair<capture_region, std::string>> crops;
+        if (selected_regions.size() > 1)
+        {
+            target.region = capture_region{output->x, output->y,
+                output->width, output->height};
+            for (size_t i = 0; i < selected_regions.size(); i++)
+            {
+                auto& region = selected_regions[i];
+                crops.push_back({capture_region{region.x - output->x, region.y - output->y,
+                    region.width, region.height}, std::to_string(i + 1)});
+            }
+        } else if (multiple_views)
+        {
+            target.region = capture_region{output->x, output->y,
+                output->width, output->height};
+            crops.push_back({capture_region{}, output->name});
+            std::cerr << "Recording output " << output->name << std::endl;
+        } else if (crop_region)
+        {
+            target.region = capture_region{output->x, output->y,
+                output->width, output->height};
+            crops.push_back({capture_region{selected_region.x - output->x,
+                selected_region.y - output->y, selected_region.width,
+                selected_region.height}, ""});
+        } else
+        {
+            target.region = selected_region;
+            crops.push_back({capture_region{}, ""});
+        }
+
+        for (auto& crop : crops)
+        {
+            bool primary = capture_targets.size() == 1 && target.views.empty();
+            target.views.emplace_back(&target, target.views.size(), params, primary);
+            auto& view = target.views.back();
+            view.crop = crop.first;
+            view.params.transform = output->transform;
+            if (!view.primary)
+                view.params.enable_audio = false;
+
+            if (multiple_views)
+            {
+                if (!shared_outputs.empty())
+                {
+                    view.params.shared_outputs = shared_outputs;
+                } else
+                {
+                    view.params.file = output_file_name(params.file, crop.second);
+                    /* Streaming the same url from several views doesn't work,
+                     * so the additional outputs go with the first view only */
+                    if (!view.primary)
+                        view.params.tee_outputs.clear();
+                }
+
+                for (auto& rendition : view.params.renditions)
+                {
+                    if (!rendition.file.empty())
+                        rendition.file = output_file_name(rendition.file, crop.second);
+                }
+            }
+
+            if (shared_outputs.empty())
+            {
+                output_files.push_back(view.params.file);
+                for (auto& tee : view.params.tee_outputs)
+                    output_files.push_back(tee.file);
+            }
+
+            for (auto& rendition : view.params.renditions)
+            {
+                if (!rendition.file.empty())
+                    output_files.push_back(rendition.file);
+            }
+        }
+
+        target.buffers.set_consumers(target.views.size());
+
+        CaptureSourceParams source_params;
+        source_params.backend = capture_backend;
+        source_params.output = output->output;
+        if (target.region.is_selected())
+        {
+            source_params.region = capture_region{target.region.x - output->x,
+                target.region.y - output->y, target.region.width, target.region.height};
+        }
+        source_params.use_dmabuf = use_dmabuf;
+        source_params.use_damage = use_damage;
+        source_params.shm = shm;
+        source_params.dmabuf = dmabuf;
+        source_params.gbm_device = gbm_device;
+        source_params.screencopy_manager = screencopy_manager;
+#ifdef HAVE_EXT_IMAGE_COPY_CAPTURE
+        source_params.ext_copy_manager = ext_copy_manager;
+        source_params.ext_source_manager = ext_source_manager;
+#endif
+        source_params.width = target.region.width;
+        source_params.height = target.region.height;
+        target.source = std::unique_ptr<CaptureSource>(CaptureSource::create(source_params));
+
+        /* Don't copy more frames than the framerate needs. The fps filter
+         * still makes the framerate constant. */
+        if (params.framerate > 0)
+            target.frame_interval_usec = 1000000 / params.framerate;
+
+        if (adaptive_framerate)
+        {
+            uint64_t base_interval = target.frame_interval_usec;
+            if (!base_interval)
+            {
+                base_interval = target.output->refresh > 0 ?
+                    1000000000ull / target.output->refresh : 1000000 / 60;
+            }
+
+            target.paced_interval_usec = target.frame_interval_usec;
+            target.overload = std::unique_ptr<OverloadController>(
+                new OverloadController(base_interval));
+        }
+    }
+
+    for (auto& file : output_files)
+    {
+        if (!force_overwrite && !user_specified_overwrite(file))
+        {
+            return EXIT_FAILURE;
+        }
+    }
 
     for (auto signo : GRACEFUL_TERMINATION_SIGNALS)
     {
         signal(signo, handle_graceful_termination);
     }
 
+    if (!metrics_target.empty() && !metrics_start(metrics_target))
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (!trace_file.empty())
+    {
+        if (!trace_start(trace_file))
+            return EXIT_FAILURE;
+        trace_thread_name("capture");
+    }
+
+    /* The writers have to encode each frame within the frame interval */
+    uint64_t frame_budget_usec = 0;
+    for (auto& target : capture_targets)
+    {
+        uint64_t interval = target.frame_interval_usec;
+        if (!interval && target.output->refresh > 0)
+            interval = 1000000000ull / target.output->refresh;
+        if (interval && (!frame_budget_usec || interval < frame_budget_usec))
+            frame_budget_usec = interval;
+    }
+
+    thread_scheduling_print();
+    ThreadCpuRegistration cpu_registration(THREAD_STAGE_CAPTURE, "main");
+    thread_stats_start(frame_budget_usec, verbose);
+    if (thread_pool_workers >= 0)
+        thread_pool_start(thread_pool_workers, thread_pool_pin);
+
+    uint64_t last_overload_check = get_monotonic_usec();
     while(!exit_main_loop)
     {
-        // wait for a free buffer
-        while(buffers.capture().ready_capture() != true) {
-            std::this_thread::sleep_for(std::chrono::microseconds(500));
+        int timeout = -1;
+        uint64_t now = get_monotonic_usec();
+        if (adaptive_framerate && now - last_overload_check >= OVERLOAD_CHECK_INTERVAL_USEC)
+        {
+            for (auto& target : capture_targets)
+                update_overload(target);
+            last_overload_check = now;
+        }
+
+        for (auto& target : capture_targets)
+        {
+            auto& source = *target.source;
+            size_t max_frames = std::min(frames_in_flight, source.max_frames_in_flight());
+            while (source.frames_in_flight() < max_frames)
+            {
+                if (target.frame_interval_usec)
+                {
+                    uint64_t request_time = get_request_time(target);
+                    if (request_time > now)
+                    {
+                        int wait = (request_time - now + 999) / 1000;
+                        timeout = timeout < 0 ? wait : std::min(timeout, wait);
+                        break;
+                    }
+                }
+
+                /* Nothing wakes us up when an encoder releases a buffer, so
+                 * poll for free buffers while waiting for one */
+                if (!start_capture(target))
+                {
+                    timeout = 1;
+                    break;
+                }
+
+                if (target.frame_interval_usec)
+                    advance_schedule(target, now);
+            }
+
+            /* Sources which don't wait for the compositor finish frames
+             * right away */
+            if (source.oldest_done_frame())
+                timeout = 0;
         }
 
-        buffer_copy_done = false;
-        request_next_frame();
+        if (dispatch_wayland(timeout) < 0) {
+            break;
+        }
 
-        while (!buffer_copy_done && !exit_main_loop && wl_display_dispatch(display) != -1) {
-            // This space is intentionally left blank
+        for (auto& target : capture_targets)
+        {
+            if (target.source->is_stopped())
+                exit_main_loop = true;
         }
 
         if (exit_main_loop) {
             break;
         }
 
-        auto& buffer = buffers.capture();
-        //std::cout << "first buffer at " << timespec_to_usec(get_ct()) / 1.0e6<< std::endl;
-
-        if (!spawned_thread)
+        for (auto& target : capture_targets)
         {
-            writer_thread = std::thread([=] () {
-                write_loop(params);
-            });
+            /* Frames are handed over in the order they were requested */
+            while (auto frame = target.source->oldest_done_frame())
+            {
+                for (auto& view : target.views)
+                {
+                    if (!view.writer_thread.joinable())
+                    {
+                        capture_view *v = &view;
+                        view.writer_thread = std::thread([v] () {
+                            write_loop(*v);
+                        });
+                    }
+                }
 
-            spawned_thread = true;
+                finish_capture(target, *frame);
+            }
         }
+    }
 
-        buffer.base_usec = timespec_to_usec(buffer.presented);
-        buffers.next_capture();
+    for (auto& target : capture_targets)
+    {
+        print_capture_stats(target);
     }
 
-    if (writer_thread.joinable())
+    for (auto& target : capture_targets)
     {
-        writer_thread.join();
+        for (auto& view : target.views)
+        {
+            if (view.writer_thread.joinable())
+            {
+                view.writer_thread.join();
+            }
+        }
     }
 
-    for (size_t i = 0; i < buffers.size(); ++i)
+    thread_pool_stop();
+    thread_stats_stop();
+    metrics_stop();
+    trace_stop();
+    capability_cache_save();
+
+    for (auto& target : capture_targets)
     {
-        auto buffer = buffers.at(i);
-        if (buffer && buffer->wl_buffer)
-            wl_buffer_destroy(buffer->wl_buffer);
+        for (size_t i = 0; i < target.buffers.size(); ++i)
+        {
+            auto buffer = target.buffers.at(i);
+            if (buffer)
+                target.source->free_buffer(*buffer);
+        }
+
+        target.source = nullptr;
     }
 
     if (gbm_device) {
@@ -0,0 +1,56 @@
+#include "mapped-frame-cache.hpp"
+
+MappedFrameCache::MappedFrameCache(size_t _capacity) :
+    capacity(_capacity)
+{ }
+
+MappedFrameCache::~MappedFrameCache()
+{
+    clear();
+}
+
+void MappedFrameCache::clear()
+{
+    for (auto& entry : entries)
+        av_frame_free(&entry.frame);
+
+    entries.clear();
+}
+
+void MappedFrameCache::evict(std::list<Entry>::iterator it)
+{
+    av_frame_free(&it->frame);
+    entries.erase(it);
+    eviction_count++;
+}
+
+AVFrame *MappedFrameCache::get(const MappedFrameKey& key, const Mapper& mapper)
+{
+    for (auto it = entries.begin(); it != entries.end(); ++it)
+    {
+        if (it->key.bo != key.bo)
+            continue;
+
+        if (it->key.inode == key.inode)
+        {
+            hit_count++;
+            entries.splice(entries.begin(), entries, it);
+            return it->frame;
+        }
+
+        /* The bo was destroyed and another one was allocated at its address */
+        evict(it);
+        break;
+    }
+
+    miss_count++;
+    AVFrame *frame = mapper(key);
+    if (!frame)
+        return NULL;
+
+    while (!entries.empty() && entries.size() >= capacity)
+        evict(std::prev(entries.end()));
+
+    entries.push_front({key, frame});
+    return frame;
+}
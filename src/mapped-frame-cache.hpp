@@ -0,0 +1,67 @@
+#ifndef MAPPED_FRAME_CACHE_HPP
+#define MAPPED_FRAME_CACHE_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <list>
+#include <functional>
+
+extern "C"
+{
+    #include <libavutil/frame.h>
+}
+
+/* Identifies the allocation behind a dmabuf. The inode of the dmabuf tells
+ * apart a new buffer which was allocated at the address of a destroyed bo. */
+struct MappedFrameKey
+{
+    const void *bo;
+    uint64_t inode;
+};
+
+/**
+ * The hardware frames which dmabufs were mapped to, so that a buffer is only
+ * mapped the first time it is encoded. The least recently used frame is
+ * freed once the cache is full, and the frame of a bo is freed as soon as
+ * the bo is seen with another dmabuf, since the buffer was reallocated.
+ */
+class MappedFrameCache
+{
+  public:
+    /* Maps the dmabuf of a key to a new frame, returns NULL on errors */
+    using Mapper = std::function<AVFrame*(const MappedFrameKey& key)>;
+
+    MappedFrameCache(size_t capacity);
+    ~MappedFrameCache();
+
+    /* The frame of the key, mapped with the mapper if it is not cached. The
+     * frame stays owned by the cache. */
+    AVFrame *get(const MappedFrameKey& key, const Mapper& mapper);
+
+    /* Free all frames */
+    void clear();
+
+    size_t size() const { return entries.size(); }
+    uint64_t hits() const { return hit_count; }
+    uint64_t misses() const { return miss_count; }
+    uint64_t evictions() const { return eviction_count; }
+
+  private:
+    struct Entry
+    {
+        MappedFrameKey key;
+        AVFrame *frame;
+    };
+
+    size_t capacity;
+    /* The most recently used first, there are only a few buffers so a list
+     * is searched quickly */
+    std::list<Entry> entries;
+    uint64_t hit_count = 0;
+    uint64_t miss_count = 0;
+    uint64_t eviction_count = 0;
+
+    void evict(std::list<Entry>::iterator it);
+};
+
+#endif /* end of include guard: MAPPED_FRAME_CACHE_HPP */
@@ -0,0 +1,289 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <thread>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Interval of rewriting the metrics file */
+#define METRICS_FILE_INTERVAL_MS 1000
+/* How often the exporter checks whether it should stop */
+#define METRICS_POLL_MS 100
+
+Metrics metrics;
+
+static const char *stage_names[METRICS_STAGE_COUNT] = {
+    "capture", "queue", "convert", "encode", "handoff", "mux", "audio",
+    "ready_jitter",
+};
+
+struct metric_info
+{
+    const char *name;
+    const char *help;
+};
+
+static const metric_info counter_info[METRICS_COUNTER_COUNT] = {
+    {"frames_captured_total", "Frames delivered by the compositor"},
+    {"frames_duplicate_total", "Frames in flight which were served from the same compositor frame"},
+    {"frames_dropped_total", "Captured frames which the writers did not encode"},
+    {"frames_encoded_total", "Frames the encoders accepted"},
+    {"frames_failed_total", "Frames which could not be mapped or encoded"},
+    {"packets_encoded_total", "Packets produced by the encoders"},
+    {"copies_failed_total", "Frame copies which the compositor failed"},
+    {"packets_written_total", "Packets written to the outputs"},
+    {"packets_dropped_total", "Packets dropped by outputs which could not keep up"},
+    {"bytes_written_total", "Bytes of the packets written to the outputs"},
+    {"audio_chunks_total", "Chunks of audio received from the audio reader"},
+    {"mapped_frame_hits_total", "Dmabufs whose VAAPI frame was cached"},
+    {"mapped_frame_misses_total", "Dmabufs which had to be mapped to a VAAPI frame"},
+    {"roi_frames_total", "Frames encoded with regions of interest"},
+    {"video_bytes_encoded_total", "Bytes of the packets of the main video encoder"},
+    {"video_luma_squared_error_total",
+        "Sum of the squared luma errors the main video encoder reports with -p flags=+psnr"},
+};
+
+static const metric_info gauge_info[METRICS_GAUGE_COUNT] = {
+    {"frames_in_flight", "Frames requested from the compositor and not delivered yet"},
+    {"encode_queue_frames", "Captured frames waiting for the writer threads"},
+    {"rendition_queue_frames", "Frames waiting for the rendition encoders"},
+    {"output_queue_packets", "Packets waiting to be written to the outputs"},
+};
+
+static int bucket_index(uint64_t usec)
+{
+    if (usec < LatencyHistogram::SUB_BUCKETS)
+        return usec;
+
+    /* 8 buckets between each power of two and the next */
+    int exponent = 63 - __builtin_clzll(usec);
+    int sub = (usec >> (exponent - 3)) & (LatencyHistogram::SUB_BUCKETS - 1);
+    int index = (exponent - 2) * LatencyHistogram::SUB_BUCKETS + sub;
+    return std::min(index, LatencyHistogram::BUCKETS - 1);
+}
+
+static uint64_t bucket_upper_bound(int index)
+{
+    if (index < LatencyHistogram::SUB_BUCKETS)
+        return index;
+
+    int exponent = index / LatencyHistogram::SUB_BUCKETS + 2;
+    uint64_t sub = index % LatencyHistogram::SUB_BUCKETS;
+    uint64_t width = 1ull << (exponent - 3);
+    return (LatencyHistogram::SUB_BUCKETS + sub) * width + width - 1;
+}
+
+void LatencyHistogram::record(uint64_t usec)
+{
+    buckets[bucket_index(usec)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    sum_usec.fetch_add(usec, std::memory_order_relaxed);
+
+    uint64_t current = max_usec.load(std::memory_order_relaxed);
+    while (usec > current &&
+        !max_usec.compare_exchange_weak(current, usec, std::memory_order_relaxed));
+}
+
+uint64_t LatencyHistogram::quantile(double q) const
+{
+    /* The buckets may change while they are read, so the total is counted
+     * from the same snapshot */
+    std::array<uint64_t, BUCKETS> snapshot;
+    uint64_t count = 0;
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        snapshot[i] = buckets[i].load(std::memory_order_relaxed);
+        count += snapshot[i];
+    }
+
+    if (count == 0)
+        return 0;
+
+    uint64_t rank = std::max<uint64_t>(1, q * count + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        seen += snapshot[i];
+        if (seen >= rank)
+            return std::min(bucket_upper_bound(i), max());
+    }
+
+    return max();
+}
+
+std::string metrics_to_prometheus()
+{
+    std::ostringstream out;
+
+    out << "# HELP wf_recorder_stage_latency_seconds Latency of the stages of the recording\n"
+        << "# TYPE wf_recorder_stage_latency_seconds summary\n";
+    for (int i = 0; i < METRICS_STAGE_COUNT; i++)
+    {
+        auto& stage = metrics.stages[i];
+        for (double q : {0.5, 0.9, 0.99})
+        {
+            out << "wf_recorder_stage_latency_seconds{stage=\"" << stage_names[i]
+                << "\",quantile=\"" << q << "\"} " << stage.quantile(q) / 1e6 << "\n";
+        }
+
+        out << "wf_recorder_stage_latency_seconds_sum{stage=\"" << stage_names[i] << "\"} "
+            << stage.sum() / 1e6 << "\n"
+            << "wf_recorder_stage_latency_seconds_count{stage=\"" << stage_names[i] << "\"} "
+            << stage.count() << "\n";
+    }
+
+    out << "# HELP wf_recorder_stage_latency_max_seconds Maximum latency of the stages of the recording\n"
+        << "# TYPE wf_recorder_stage_latency_max_seconds gauge\n";
+    for (int i = 0; i < METRICS_STAGE_COUNT; i++)
+    {
+        out << "wf_recorder_stage_latency_max_seconds{stage=\"" << stage_names[i] << "\"} "
+            << metrics.stages[i].max() / 1e6 << "\n";
+    }
+
+    for (int i = 0; i < METRICS_COUNTER_COUNT; i++)
+    {
+        out << "# HELP wf_recorder_" << counter_info[i].name << " " << counter_info[i].help << "\n"
+            << "# TYPE wf_recorder_" << counter_info[i].name << " counter\n"
+            << "wf_recorder_" << counter_info[i].name << " "
+            << metrics.counters[i].load(std::memory_order_relaxed) << "\n";
+    }
+
+    for (int i = 0; i < METRICS_GAUGE_COUNT; i++)
+    {
+        out << "# HELP wf_recorder_" << gauge_info[i].name << " " << gauge_info[i].help << "\n"
+            << "# TYPE wf_recorder_" << gauge_info[i].name << " gauge\n"
+            << "wf_recorder_" << gauge_info[i].name << " "
+            << metrics.gauges[i].load(std::memory_order_relaxed) << "\n";
+    }
+
+    return out.str();
+}
+
+static std::thread exporter;
+static std::atomic<bool> exporter_stop{false};
+
+/* Replace the file at once, so that readers never see a partial file */
+static void write_metrics_file(const std::string& file)
+{
+    std::string tmp = file + ".tmp";
+    {
+        std::ofstream out(tmp);
+        out << metrics_to_prometheus();
+        if (!out)
+            return;
+    }
+
+    rename(tmp.c_str(), file.c_str());
+}
+
+static void file_exporter(std::string file)
+{
+    while (!exporter_stop)
+    {
+        write_metrics_file(file);
+        for (int i = 0; i < METRICS_FILE_INTERVAL_MS / METRICS_POLL_MS && !exporter_stop; i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(METRICS_POLL_MS));
+    }
+
+    /* The final values of the recording */
+    write_metrics_file(file);
+}
+
+static void socket_exporter(int fd, std::string path)
+{
+    while (!exporter_stop)
+    {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, METRICS_POLL_MS) <= 0)
+            continue;
+
+        int client = accept(fd, NULL, NULL);
+        if (client < 0)
+            continue;
+
+        std::string text = metrics_to_prometheus();
+        size_t written = 0;
+        while (written < text.size())
+        {
+            ssize_t ret = send(client, text.data() + written, text.size() - written,
+                MSG_NOSIGNAL);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                break;
+            written += ret;
+        }
+
+        close(client);
+    }
+
+    close(fd);
+    unlink(path.c_str());
+}
+
+static int open_metrics_socket(const std::string& path)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        std::cerr << "Metrics socket path too long: " << path << std::endl;
+        return -1;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    unlink(path.c_str());
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0)
+    {
+        fprintf(stderr, "Failed to listen on %s: %m\n", path.c_str());
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool metrics_start(const std::string& target)
+{
+    const std::string unix_prefix = "unix:";
+    if (target.compare(0, unix_prefix.size(), unix_prefix) == 0)
+    {
+        std::string path = target.substr(unix_prefix.size());
+        int fd = open_metrics_socket(path);
+        if (fd < 0)
+            return false;
+
+        exporter = std::thread(socket_exporter, fd, path);
+    } else
+    {
+        exporter = std::thread(file_exporter, target);
+    }
+
+    metrics.enabled = true;
+    return true;
+}
+
+void metrics_stop()
+{
+    if (!exporter.joinable())
+        return;
+
+    exporter_stop = true;
+    exporter.join();
+}
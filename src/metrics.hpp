@@ -0,0 +1,162 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <stdint.h>
+#include <time.h>
+#include <array>
+#include <atomic>
+#include <string>
+
+/* Stages of the recording pipeline whose latency is measured */
+enum MetricsStage
+{
+    /* From requesting a frame until the compositor delivered it */
+    METRICS_STAGE_CAPTURE,
+    /* From the delivery until a writer thread picks the frame up */
+    METRICS_STAGE_QUEUE,
+    /* The filter graph, which converts and scales the frames */
+    METRICS_STAGE_CONVERT,
+    /* Sending a video frame to the encoder and receiving its packets */
+    METRICS_STAGE_ENCODE,
+    /* Handing a packet to the outputs, which waits while their queues are full */
+    METRICS_STAGE_HANDOFF,
+    /* Muxing a packet in the thread of an output, including the disk */
+    METRICS_STAGE_MUX,
+    /* Converting and encoding a chunk of audio from the audio reader */
+    METRICS_STAGE_AUDIO,
+    /* How much the interval between handling two new frames in the main
+     * thread differs from the interval the compositor presented them at */
+    METRICS_STAGE_READY_JITTER,
+    METRICS_STAGE_COUNT,
+};
+
+enum MetricsCounter
+{
+    METRICS_FRAMES_CAPTURED,
+    METRICS_FRAMES_DUPLICATE,
+    METRICS_FRAMES_DROPPED,
+    METRICS_FRAMES_ENCODED,
+    METRICS_FRAMES_FAILED,
+    METRICS_PACKETS_ENCODED,
+    METRICS_COPIES_FAILED,
+    METRICS_PACKETS_WRITTEN,
+    METRICS_PACKETS_DROPPED,
+    METRICS_BYTES_WRITTEN,
+    METRICS_AUDIO_CHUNKS,
+    METRICS_MAPPED_FRAME_HITS,
+    METRICS_MAPPED_FRAME_MISSES,
+    METRICS_ROI_FRAMES,
+    METRICS_VIDEO_BYTES_ENCODED,
+    METRICS_VIDEO_LUMA_SQUARED_ERROR,
+    METRICS_COUNTER_COUNT,
+};
+
+enum MetricsGauge
+{
+    /* Frames requested from the compositor and not delivered yet */
+    METRICS_FRAMES_IN_FLIGHT,
+    /* Captured frames waiting for the writer threads, summed over all views */
+    METRICS_ENCODE_QUEUE,
+    /* Frames waiting for the rendition encoders */
+    METRICS_RENDITION_QUEUE,
+    /* Packets waiting to be written, summed over all outputs */
+    METRICS_OUTPUT_QUEUE,
+    METRICS_GAUGE_COUNT,
+};
+
+/**
+ * A histogram of latencies in microseconds, which any thread can record into
+ * without locking. The buckets are log-linear like in HDR histograms: each
+ * power of two is split into 8 buckets, so that the percentiles are accurate
+ * to 12.5% from 1us up to more than an hour.
+ */
+class LatencyHistogram
+{
+  public:
+    static constexpr int SUB_BUCKETS = 8;
+    static constexpr int BUCKETS = 30 * SUB_BUCKETS;
+
+    void record(uint64_t usec);
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return sum_usec.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_usec.load(std::memory_order_relaxed); }
+
+    /* Upper bound of the bucket which contains the quantile q of the values */
+    uint64_t quantile(double q) const;
+
+  private:
+    std::array<std::atomic<uint64_t>, BUCKETS> buckets{};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum_usec{0};
+    std::atomic<uint64_t> max_usec{0};
+};
+
+struct Metrics
+{
+    /* The latencies are only timed while the metrics are exported, the
+     * counters and gauges are always kept */
+    std::atomic<bool> enabled{false};
+
+    LatencyHistogram stages[METRICS_STAGE_COUNT];
+    std::atomic<uint64_t> counters[METRICS_COUNTER_COUNT] = {};
+    std::atomic<int64_t> gauges[METRICS_GAUGE_COUNT] = {};
+};
+
+extern Metrics metrics;
+
+static inline bool metrics_enabled()
+{
+    return metrics.enabled.load(std::memory_order_relaxed);
+}
+
+static inline uint64_t metrics_now_usec()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ll + ts.tv_nsec / 1000ll;
+}
+
+static inline void metrics_record(MetricsStage stage, uint64_t usec)
+{
+    if (metrics_enabled())
+        metrics.stages[stage].record(usec);
+}
+
+static inline void metrics_count(MetricsCounter counter, uint64_t n = 1)
+{
+    metrics.counters[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+static inline void metrics_gauge_add(MetricsGauge gauge, int64_t n)
+{
+    metrics.gauges[gauge].fetch_add(n, std::memory_order_relaxed);
+}
+
+/* Records the time from its creation to its destruction into a stage */
+class MetricsTimer
+{
+    MetricsStage stage;
+    uint64_t start;
+
+  public:
+    MetricsTimer(MetricsStage _stage) :
+        stage(_stage), start(metrics_enabled() ? metrics_now_usec() : 0) {}
+
+    ~MetricsTimer()
+    {
+        if (start)
+            metrics.stages[stage].record(metrics_now_usec() - start);
+    }
+};
+
+/* The metrics in the Prometheus text exposition format */
+std::string metrics_to_prometheus();
+
+/* Enable the metrics and export them until metrics_stop() is called. The
+ * target is either a file, which is rewritten every second, or unix:PATH
+ * for a Unix socket which sends the current metrics to every connection. */
+bool metrics_start(const std::string& target);
+void metrics_stop();
+
+#endif /* end of include guard: METRICS_HPP */
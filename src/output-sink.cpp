@@ -0,0 +1,429 @@
+#include "output-sink.hpp"
+#include "averr.h"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "thread-stats.hpp"
+#include <chrono>
+#include <iostream>
+
+/* Maximum number of packets waiting to be written to a single output */
+#define MAX_QUEUED_PACKETS 256
+/* Network outputs drop packets which no other frame references once their
+ * queue is filled this much, before the queue blocks or drops keyframes */
+#define DROP_DISPOSABLE_PACKETS (MAX_QUEUED_PACKETS / 2)
+/* How long a shared sink with a full queue waits for the writers which are
+ * not ready yet, before it writes the header without their streams */
+#define HEADER_TIMEOUT std::chrono::seconds(10)
+
+static const char* determine_output_format(const std::string& file, const std::string& muxer)
+{
+    if (!muxer.empty())
+        return muxer.c_str();
+
+    if (file.find("rtmp") == 0)
+        return "flv";
+
+    if (file.find("udp") == 0)
+        return "mpegts";
+
+    if (file.find("rtp") == 0)
+        return "rtp_mpegts";
+
+    return NULL;
+}
+
+bool OutputSink::is_network_url(const std::string& file)
+{
+    size_t separator = file.find("://");
+    return separator != std::string::npos && file.compare(0, separator, "file") != 0;
+}
+
+OutputSink::OutputSink(const std::string& _file, const std::string& muxer,
+    bool _required, std::atomic<bool>& flag) :
+    file(_file), required(_required), network(is_network_url(_file)),
+    write_aborted_flag(flag)
+{
+    auto streamFormat = determine_output_format(file, muxer);
+    auto context_ret = avformat_alloc_output_context2(&this->fmtCtx, NULL,
+        streamFormat, file.c_str());
+    if (context_ret < 0)
+    {
+        fmtCtx = NULL;
+        if (required)
+        {
+            std::cerr << "Failed to allocate output context" << std::endl;
+            std::exit(-1);
+        }
+
+        detach("failed to allocate output context");
+    }
+}
+
+OutputSink::~OutputSink()
+{
+    finish();
+
+    for (auto& bsf : bsfs)
+        av_bsf_free(&bsf);
+
+    if (fmtCtx)
+        avformat_free_context(fmtCtx);
+}
+
+bool OutputSink::needs_global_header() const
+{
+    return fmtCtx && (fmtCtx->oformat->flags & AVFMT_GLOBALHEADER);
+}
+
+void OutputSink::set_expected_writers(int count)
+{
+    expected_writers = count;
+}
+
+int OutputSink::add_stream(const AVCodecContext *enc_ctx)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!fmtCtx || opened || stopping)
+        return -1;
+
+    AVStream *stream = avformat_new_stream(fmtCtx, NULL);
+    if (!stream)
+    {
+        std::cerr << "Failed to open stream" << std::endl;
+        std::exit(-1);
+    }
+
+    int ret = avcodec_parameters_from_context(stream->codecpar, enc_ctx);
+    if (ret < 0)
+    {
+        std::cerr << "avcodec_parameters_from_context failed: " << averr(ret) << std::endl;
+        std::exit(-1);
+    }
+
+    stream->time_base = enc_ctx->time_base;
+    waiting_keyframe.push_back(false);
+
+    /* Encoders only emit their parameter sets out of band when a global
+     * header was requested. Outputs like mpegts still need them in-band
+     * on every keyframe, which is what dump_extra does. */
+    AVBSFContext *bsf = NULL;
+    if (enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO &&
+        (enc_ctx->flags & AV_CODEC_FLAG_GLOBAL_HEADER) && !needs_global_header())
+    {
+        const AVBitStreamFilter *filter = av_bsf_get_by_name("dump_extra");
+        if (filter && av_bsf_alloc(filter, &bsf) == 0)
+        {
+            avcodec_parameters_copy(bsf->par_in, stream->codecpar);
+        } else
+        {
+            std::cerr << "Failed to create dump_extra filter for " << file << std::endl;
+        }
+    }
+    bsfs.push_back(bsf);
+
+    return stream->index;
+}
+
+void OutputSink::open()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (++ready_writers < expected_writers)
+        return;
+
+    write_header();
+}
+
+void OutputSink::remove_writer()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--expected_writers > ready_writers || !ready_writers)
+        return;
+
+    write_header();
+}
+
+void OutputSink::write_header()
+{
+    if (detached || opened)
+        return;
+
+    av_dump_format(fmtCtx, 0, file.c_str(), 1);
+    if (!(fmtCtx->oformat->flags & AVFMT_NOFILE))
+    {
+        int ret = avio_open(&fmtCtx->pb, file.c_str(), AVIO_FLAG_WRITE);
+        if (ret < 0)
+        {
+            if (required)
+            {
+                std::cerr << "avio_open failed" << std::endl;
+                std::exit(-1);
+            }
+
+            detach(std::string("avio_open failed: ") + averr(ret));
+            return;
+        }
+    }
+
+    AVDictionary *dummy = NULL;
+    int ret = avformat_write_header(fmtCtx, &dummy);
+    av_dict_free(&dummy);
+    if (ret < 0)
+    {
+        if (required)
+        {
+            std::cerr << "Failed to write file header" << std::endl;
+            std::cerr << averr(ret) << std::endl;
+            std::exit(-1);
+        }
+
+        detach(std::string("failed to write header: ") + averr(ret));
+        return;
+    }
+
+    /* Stream time bases are only final after the header has been written */
+    for (size_t i = 0; i < bsfs.size(); i++)
+    {
+        if (!bsfs[i])
+            continue;
+
+        bsfs[i]->time_base_in = fmtCtx->streams[i]->time_base;
+        if (av_bsf_init(bsfs[i]) < 0)
+        {
+            std::cerr << "Failed to initialize dump_extra filter for " << file << std::endl;
+            av_bsf_free(&bsfs[i]);
+        }
+    }
+
+    opened = true;
+    writer_thread = std::thread([=] () {
+        trace_thread_name("output " + file);
+        ThreadCpuRegistration cpu_registration(THREAD_STAGE_MUXER, file);
+        write_loop();
+    });
+    cond.notify_all();
+}
+
+void OutputSink::write(const AVPacket *pkt, int stream, AVRational time_base)
+{
+    if (detached || stream < 0)
+        return;
+
+    std::unique_lock<std::mutex> lock(mutex);
+
+    /* Under severe congestion, give up the frames which are cheapest to
+     * lose first. Nothing else depends on them, so the following packets
+     * can still be decoded. */
+    if (network && (pkt->flags & AV_PKT_FLAG_DISPOSABLE) &&
+        queue.size() >= DROP_DISPOSABLE_PACKETS)
+    {
+        if (dropped_disposable++ == 0)
+            std::cerr << "Output " << file << " is congested, dropping disposable frames" << std::endl;
+        metrics_count(METRICS_PACKETS_DROPPED);
+        return;
+    }
+
+    if (required && !opened && queue.size() >= MAX_QUEUED_PACKETS)
+    {
+        /* Before the header is written nothing drains the queue. A writer
+         * which never gets its first frame would make it grow without a
+         * bound, so after a while the header is written without it. */
+        if (!cond.wait_for(lock, HEADER_TIMEOUT, [=] () {
+                return opened || stopping || detached;
+            }))
+        {
+            std::cerr << "Output " << file << ": " << expected_writers - ready_writers <<
+                " of the views did not start, writing without them" << std::endl;
+            expected_writers = ready_writers;
+            write_header();
+        }
+    }
+
+    if (required)
+    {
+        cond.wait(lock, [=] () {
+            return queue.size() < MAX_QUEUED_PACKETS || !opened || stopping;
+        });
+    }
+
+    /* After dropping video we have to wait for the next keyframe, otherwise
+     * the receiver would only see corrupted frames until then. */
+    if (waiting_keyframe[stream] && !(pkt->flags & AV_PKT_FLAG_KEY))
+    {
+        ++dropped;
+        metrics_count(METRICS_PACKETS_DROPPED);
+        return;
+    }
+
+    if (!required && queue.size() >= MAX_QUEUED_PACKETS)
+    {
+        if (dropped++ == 0)
+            std::cerr << "Output " << file << " can't keep up, dropping packets" << std::endl;
+        metrics_count(METRICS_PACKETS_DROPPED);
+
+        if (fmtCtx->streams[stream]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+            waiting_keyframe[stream] = true;
+
+        return;
+    }
+
+    waiting_keyframe[stream] = false;
+
+    AVPacket *copy = packet_pool.get();
+    if (!copy)
+        return;
+
+    if (av_packet_ref(copy, pkt) < 0)
+    {
+        packet_pool.put(copy);
+        return;
+    }
+
+    copy->stream_index = stream;
+    queue.push_back({copy, time_base});
+    metrics_gauge_add(METRICS_OUTPUT_QUEUE, 1);
+    cond.notify_all();
+}
+
+bool OutputSink::write_packet(AVPacket *pkt)
+{
+    AVBSFContext *bsf = bsfs[pkt->stream_index];
+    if (!bsf)
+        return av_interleaved_write_frame(fmtCtx, pkt) == 0;
+
+    int stream_index = pkt->stream_index;
+    int ret = av_bsf_send_packet(bsf, pkt);
+    if (ret < 0)
+        return false;
+
+    while ((ret = av_bsf_receive_packet(bsf, pkt)) == 0)
+    {
+        pkt->stream_index = stream_index;
+        if (av_interleaved_write_frame(fmtCtx, pkt) != 0)
+            return false;
+    }
+
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF;
+}
+
+void OutputSink::write_loop()
+{
+    while (true)
+    {
+        QueuedPacket queued;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [=] () {
+                return !queue.empty() || stopping;
+            });
+
+            if (queue.empty())
+                break;
+
+            queued = queue.front();
+            queue.pop_front();
+        }
+        cond.notify_all();
+        metrics_gauge_add(METRICS_OUTPUT_QUEUE, -1);
+
+        AVPacket *pkt = queued.pkt;
+        if (!detached)
+        {
+            TraceScope trace("write packet", "pts",
+                av_rescale_q(pkt->pts, queued.time_base, AVRational{1, 1000000}));
+            av_packet_rescale_ts(pkt, queued.time_base,
+                fmtCtx->streams[pkt->stream_index]->time_base);
+
+            int size = pkt->size;
+            uint64_t start = metrics_now_usec();
+            bool written = write_packet(pkt);
+
+            uint64_t elapsed = metrics_now_usec() - start;
+            metrics_record(METRICS_STAGE_MUX, elapsed);
+            uint64_t average = write_usec.load(std::memory_order_relaxed);
+            write_usec.store(average ? (average * 7 + elapsed) / 8 : elapsed,
+                std::memory_order_relaxed);
+
+            if (written)
+            {
+                metrics_count(METRICS_PACKETS_WRITTEN);
+                metrics_count(METRICS_BYTES_WRITTEN, size);
+            } else
+            {
+                if (required)
+                {
+                    write_aborted_flag = true;
+                } else
+                {
+                    detach("write error");
+                }
+            }
+        }
+
+        packet_pool.put(pkt);
+    }
+}
+
+OutputCongestion OutputSink::get_congestion()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return {1.0 * queue.size() / MAX_QUEUED_PACKETS, write_usec.load(std::memory_order_relaxed)};
+}
+
+void OutputSink::detach(const std::string& reason)
+{
+    if (!detached.exchange(true))
+        std::cerr << "Detaching output " << file << ": " << reason << std::endl;
+}
+
+void OutputSink::close()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        /* Wait for the last writer, but don't wait for writers which never
+         * became ready. Their streams were never added. */
+        if (++closed_writers < ready_writers)
+            return;
+
+        write_header();
+    }
+
+    finish();
+}
+
+void OutputSink::finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping)
+            return;
+
+        stopping = true;
+    }
+    cond.notify_all();
+
+    if (writer_thread.joinable())
+        writer_thread.join();
+
+    metrics_gauge_add(METRICS_OUTPUT_QUEUE, -(int64_t)queue.size());
+    for (auto& queued : queue)
+        packet_pool.put(queued.pkt);
+    queue.clear();
+
+    if (dropped)
+        std::cerr << "Output " << file << " dropped " << dropped << " packets" << std::endl;
+    if (dropped_disposable)
+    {
+        std::cerr << "Output " << file << " dropped " << dropped_disposable
+            << " disposable frames" << std::endl;
+    }
+
+    if (!fmtCtx)
+        return;
+
+    if (opened && !detached)
+        av_write_trailer(fmtCtx);
+
+    if (fmtCtx->pb && !(fmtCtx->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&fmtCtx->pb);
+}
@@ -0,0 +1,122 @@
+#ifndef OUTPUT_SINK_HPP
+#define OUTPUT_SINK_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavcodec/bsf.h>
+    #include <libavformat/avformat.h>
+}
+
+#include "av-pool.hpp"
+
+/* How well a sink keeps up with the packets */
+struct OutputCongestion
+{
+    /* Share of the queue which is filled, from 0 to 1 */
+    double queue_fill;
+    /* Moving average of the time the muxer takes to write a packet */
+    uint64_t write_usec;
+};
+
+/**
+ * A single muxed output (file or network URL).
+ *
+ * Encoded packets are handed to the sink with write(), which only queues
+ * them. Each sink has its own writer thread, so a slow output does not block
+ * the encoders or the other sinks. A required sink applies backpressure when
+ * its queue is full and aborts the recording on write errors, an optional
+ * sink drops packets instead and detaches itself on errors.
+ *
+ * A sink can be shared by several FrameWriters, which then each add their
+ * streams to the same container. The header is written once all of them
+ * have called open(), and the trailer once all of them have called close().
+ * Writers which stop before they are ready leave with remove_writer(). If
+ * the queue fills up while some writers are still not ready, the header is
+ * written without them after a timeout.
+ */
+class OutputSink
+{
+  public:
+    OutputSink(const std::string& file, const std::string& muxer,
+        bool required, std::atomic<bool>& write_aborted_flag);
+    ~OutputSink();
+
+    bool needs_global_header() const;
+
+    /* Set the number of FrameWriters which write to this sink */
+    void set_expected_writers(int count);
+
+    /* Add a stream with the parameters of the given opened encoder.
+     * Returns the index of the stream in this sink. */
+    int add_stream(const AVCodecContext *enc_ctx);
+
+    /* Write the header and start the writer thread, once all writers are ready */
+    void open();
+
+    /* A writer which stops before it called open() doesn't hold up the header */
+    void remove_writer();
+
+    /* Queue a copy of the packet for the given stream */
+    void write(const AVPacket *pkt, int stream, AVRational time_base);
+
+    /* Drain the queue and write the trailer, once all writers are done */
+    void close();
+
+    const std::string& get_file() const { return file; }
+
+    /* Whether the output is sent over the network, where the available
+     * bandwidth can change during the recording */
+    bool is_network() const { return network; }
+    static bool is_network_url(const std::string& file);
+    OutputCongestion get_congestion();
+
+    /* Packets allocated for the queue so far */
+    size_t get_allocations() const { return packet_pool.allocations(); }
+
+  private:
+    std::string file;
+    bool required;
+    bool network;
+    std::atomic<bool>& write_aborted_flag;
+
+    AVFormatContext *fmtCtx = NULL;
+    std::vector<AVBSFContext*> bsfs;
+    std::vector<bool> waiting_keyframe;
+
+    std::thread writer_thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    struct QueuedPacket
+    {
+        AVPacket *pkt;
+        AVRational time_base;
+    };
+    std::deque<QueuedPacket> queue;
+    PacketPool packet_pool;
+    bool opened = false;
+    bool stopping = false;
+    int expected_writers = 1;
+    int ready_writers = 0;
+    int closed_writers = 0;
+    std::atomic<bool> detached{false};
+    size_t dropped = 0;
+    size_t dropped_disposable = 0;
+    std::atomic<uint64_t> write_usec{0};
+
+    void write_header();
+    void finish();
+    void write_loop();
+    bool write_packet(AVPacket *pkt);
+    void detach(const std::string& reason);
+};
+
+#endif /* end of include guard: OUTPUT_SINK_HPP */
@@ -0,0 +1,112 @@
+#include "overload-controller.hpp"
+
+#include <stdio.h>
+
+/* Percentages of the full rate, from the full rate down to the lowest */
+static const int RATE_LEVELS[] = { 100, 75, 50, 33, 25 };
+static const int NUM_LEVELS = sizeof(RATE_LEVELS) / sizeof(RATE_LEVELS[0]);
+
+/* Overloaded when this many frames wait for the writers */
+#define OVERLOAD_QUEUED_FRAMES 4
+/* Overloaded when a frame takes more than this share of its interval */
+#define OVERLOAD_ENCODE_PERCENT 90
+/* The rate is raised when the frames would take less than this share of the
+ * interval at the higher rate */
+#define HEADROOM_ENCODE_PERCENT 60
+/* How many samples in a row must have headroom before raising the rate, so
+ * that the rate doesn't oscillate */
+#define HEADROOM_SAMPLES 5
+/* Samples to wait after lowering the rate before lowering it again, since
+ * the frames captured before still have to be encoded */
+#define SETTLE_SAMPLES 1
+
+OverloadController::OverloadController(uint64_t _base_interval_usec) :
+    base_interval_usec(_base_interval_usec)
+{ }
+
+uint64_t OverloadController::level_interval_usec(int level) const
+{
+    return base_interval_usec * 100 / RATE_LEVELS[level];
+}
+
+uint64_t OverloadController::frame_interval_usec(uint64_t paced_interval_usec) const
+{
+    if (level == 0)
+        return paced_interval_usec;
+
+    return level_interval_usec(level);
+}
+
+int OverloadController::rate_percent() const
+{
+    return RATE_LEVELS[level];
+}
+
+bool OverloadController::update(const OverloadSample& sample)
+{
+    char buf[128];
+    uint64_t interval = level_interval_usec(level);
+
+    /* After lowering the rate the queue needs some time to drain, it only
+     * counts as long as it doesn't shrink */
+    bool queue_growing = sample.queued_frames >= last_queued_frames;
+    last_queued_frames = sample.queued_frames;
+
+    bool overloaded = false;
+    if (sample.queued_frames >= OVERLOAD_QUEUED_FRAMES && queue_growing)
+    {
+        snprintf(buf, sizeof(buf), "%zu frames are waiting for the encoder",
+            sample.queued_frames);
+        overloaded = true;
+    } else if (sample.encode_usec * 100 > interval * OVERLOAD_ENCODE_PERCENT)
+    {
+        snprintf(buf, sizeof(buf), "encoding takes %.1f ms per frame of %.1f ms",
+            sample.encode_usec / 1000.0, interval / 1000.0);
+        overloaded = true;
+    } else if (sample.writer_saturated)
+    {
+        snprintf(buf, sizeof(buf), "the writer thread uses a whole CPU");
+        overloaded = true;
+    }
+
+    if (overloaded)
+    {
+        headroom_samples = 0;
+        if (settle_samples > 0)
+        {
+            settle_samples--;
+            return false;
+        }
+
+        if (level + 1 >= NUM_LEVELS)
+            return false;
+
+        level++;
+        settle_samples = SETTLE_SAMPLES;
+        last_reason = buf;
+        return true;
+    }
+
+    settle_samples = 0;
+    if (level == 0)
+        return false;
+
+    uint64_t higher_interval = level_interval_usec(level - 1);
+    bool headroom = sample.queued_frames <= 1 &&
+        sample.encode_usec * 100 < higher_interval * HEADROOM_ENCODE_PERCENT;
+    if (!headroom)
+    {
+        headroom_samples = 0;
+        return false;
+    }
+
+    if (++headroom_samples < HEADROOM_SAMPLES)
+        return false;
+
+    snprintf(buf, sizeof(buf), "encoding takes only %.1f ms per frame of %.1f ms",
+        sample.encode_usec / 1000.0, higher_interval / 1000.0);
+    headroom_samples = 0;
+    level--;
+    last_reason = buf;
+    return true;
+}
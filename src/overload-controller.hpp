@@ -0,0 +1,54 @@
+#ifndef OVERLOAD_CONTROLLER_HPP
+#define OVERLOAD_CONTROLLER_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+/* The state of the writers of a capture target since the last update */
+struct OverloadSample
+{
+    /* Captured frames which the slowest writer has not encoded yet */
+    size_t queued_frames;
+    /* Average time the slowest writer needs for a frame */
+    uint64_t encode_usec;
+    /* Whether a writer thread used a whole CPU */
+    bool writer_saturated;
+};
+
+/**
+ * Lowers the capture rate step by step while the writers can't keep up, and
+ * raises it again once they have enough headroom. Dropping frames evenly
+ * before they are captured avoids the irregular stalls of a full buffer pool.
+ */
+class OverloadController
+{
+  public:
+    /* base_interval_usec is the interval of the frames at full rate */
+    OverloadController(uint64_t base_interval_usec);
+
+    /* Feed a new sample, returns whether the capture rate changed */
+    bool update(const OverloadSample& sample);
+
+    /* The capture interval for the current level, 0 at the full rate if the
+     * capture was not paced before */
+    uint64_t frame_interval_usec(uint64_t paced_interval_usec) const;
+
+    /* Percentage of the full rate which is captured */
+    int rate_percent() const;
+
+    /* Why the rate was changed last */
+    const std::string& reason() const { return last_reason; }
+
+  private:
+    uint64_t base_interval_usec;
+    int level = 0;
+    int headroom_samples = 0;
+    int settle_samples = 0;
+    size_t last_queued_frames = 0;
+    std::string last_reason;
+
+    uint64_t level_interval_usec(int level) const;
+};
+
+#endif /* end of include guard: OVERLOAD_CONTROLLER_HPP */
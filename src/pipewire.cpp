@@ -1,5 +1,7 @@
 #include "pipewire.hpp"
 #include "frame-writer.hpp"
+#include "trace.hpp"
+#include "thread-stats.hpp"
 #include <iostream>
 #include <spa/param/audio/format-utils.h>
 
@@ -91,6 +93,11 @@ bool PipeWireReader::init()
 static void on_stream_process(void *data)
 {
     PipeWireReader *pr = static_cast<PipeWireReader*>(data);
+    trace_thread_name("audio");
+    TraceScope trace("audio callback");
+    /* The loop thread belongs to PipeWire, it is registered when it calls
+     * us first and unregistered when it exits */
+    static thread_local ThreadCpuRegistration cpu_registration(THREAD_STAGE_AUDIO, "pipewire");
 
     struct pw_buffer *b = pw_stream_dequeue_buffer(pr->stream);
     if (!b) {
@@ -1,5 +1,7 @@
 #include "pulse.hpp"
 #include "frame-writer.hpp"
+#include "trace.hpp"
+#include "thread-stats.hpp"
 #include <iostream>
 #include <vector>
 #include <cstring>
@@ -53,7 +55,13 @@ bool PulseReader::loop()
     buffer.resize(params.audio_frame_size);
 
     int perr;
-    if (pa_simple_read(pa, buffer.data(), buffer.size(), &perr) < 0)
+    int ret;
+    {
+        TraceScope trace("audio read");
+        ret = pa_simple_read(pa, buffer.data(), buffer.size(), &perr);
+    }
+
+    if (ret < 0)
     {
         std::cerr << "Failed to read from PulseAudio stream: "
             << pa_strerror(perr) << std::endl;
@@ -71,6 +79,8 @@ void PulseReader::start()
 
     read_thread = std::thread([=] ()
     {
+        trace_thread_name("audio");
+        ThreadCpuRegistration cpu_registration(THREAD_STAGE_AUDIO, "pulse");
         while (loop());
     });
 }
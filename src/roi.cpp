@@ -0,0 +1,95 @@
+#include "roi.hpp"
+
+#include <algorithm>
+#include <stdint.h>
+#include <utility>
+
+/* Quantizer offsets from -1 for the best quality to 1 for the worst. libx264
+ * and libx265 lower the QP by 25 times the offset, so -1/10 is -2.5. */
+static const AVRational DAMAGE_QOFFSET = {-1, 10};
+static const AVRational FOCUS_QOFFSET = {-1, 5};
+
+/* Encoders which read AV_FRAME_DATA_REGIONS_OF_INTEREST, VAAPI only if the
+ * driver supports it */
+static const char *ROI_ENCODERS[] = {
+    "libx264", "libx265", "libvpx-vp9", "h264_vaapi", "hevc_vaapi", "h264_qsv", "hevc_qsv",
+};
+
+void RoiRect::add(const RoiRect& other)
+{
+    if (other.empty())
+        return;
+
+    if (empty())
+    {
+        *this = other;
+        return;
+    }
+
+    int x2 = std::max(x + width, other.x + other.width);
+    int y2 = std::max(y + height, other.y + other.height);
+    x = std::min(x, other.x);
+    y = std::min(y, other.y);
+    width = x2 - x;
+    height = y2 - y;
+}
+
+RoiRect RoiRect::scaled(int from_width, int from_height, int to_width, int to_height) const
+{
+    RoiRect rect;
+    if (empty() || from_width <= 0 || from_height <= 0)
+        return rect;
+
+    /* Round outwards, so that the region still covers the changed pixels */
+    int x1 = std::max(0, int(1ll * x * to_width / from_width));
+    int y1 = std::max(0, int(1ll * y * to_height / from_height));
+    int x2 = std::min<int64_t>(to_width,
+        (1ll * (x + width) * to_width + from_width - 1) / from_width);
+    int y2 = std::min<int64_t>(to_height,
+        (1ll * (y + height) * to_height + from_height - 1) / from_height);
+    if (x2 > x1 && y2 > y1)
+        rect = RoiRect{x1, y1, x2 - x1, y2 - y1};
+
+    return rect;
+}
+
+bool roi_supports_encoder(const std::string& codec)
+{
+    return std::find(std::begin(ROI_ENCODERS), std::end(ROI_ENCODERS), codec) !=
+        std::end(ROI_ENCODERS);
+}
+
+bool roi_attach(AVFrame *frame, const RoiRect& focus, const RoiRect& damage)
+{
+    av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+
+    /* The first of overlapping regions counts, so the focus goes first */
+    std::pair<RoiRect, AVRational> regions[2];
+    int count = 0;
+    if (!focus.empty())
+        regions[count++] = {focus, FOCUS_QOFFSET};
+    if (!damage.empty())
+        regions[count++] = {damage, DAMAGE_QOFFSET};
+
+    if (!count)
+        return true;
+
+    AVFrameSideData *side_data = av_frame_new_side_data(frame,
+        AV_FRAME_DATA_REGIONS_OF_INTEREST, count * sizeof(AVRegionOfInterest));
+    if (!side_data)
+        return false;
+
+    AVRegionOfInterest *roi = (AVRegionOfInterest*)side_data->data;
+    for (int i = 0; i < count; i++)
+    {
+        auto& rect = regions[i].first;
+        roi[i].self_size = sizeof(AVRegionOfInterest);
+        roi[i].top = rect.y;
+        roi[i].bottom = rect.y + rect.height;
+        roi[i].left = rect.x;
+        roi[i].right = rect.x + rect.width;
+        roi[i].qoffset = regions[i].second;
+    }
+
+    return true;
+}
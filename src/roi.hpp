@@ -0,0 +1,38 @@
+#ifndef ROI_HPP
+#define ROI_HPP
+
+#include <string>
+
+extern "C"
+{
+    #include <libavutil/frame.h>
+}
+
+/* A rectangle in pixels of a frame */
+struct RoiRect
+{
+    int x = 0, y = 0;
+    int width = 0, height = 0;
+
+    bool empty() const { return width <= 0 || height <= 0; }
+
+    /* Grow the rectangle to the bounding box of both */
+    void add(const RoiRect& other);
+
+    /* The rectangle in a frame scaled from from_width x from_height to
+     * to_width x to_height, clipped to the frame */
+    RoiRect scaled(int from_width, int from_height, int to_width, int to_height) const;
+};
+
+/* Whether the encoder allocates its bits by the regions of interest */
+bool roi_supports_encoder(const std::string& codec);
+
+/**
+ * Attach the focus and the damaged rectangle to the frame as
+ * AV_FRAME_DATA_REGIONS_OF_INTEREST, replacing the previous regions. Both
+ * get a lower quantizer, the focus more. Empty rectangles are left out.
+ * Returns false if the side data couldn't be allocated.
+ */
+bool roi_attach(AVFrame *frame, const RoiRect& focus, const RoiRect& damage);
+
+#endif /* end of include guard: ROI_HPP */
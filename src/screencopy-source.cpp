@@ -0,0 +1,227 @@
+#include "screencopy-source.hpp"
+
+#include <iostream>
+#include <gbm.h>
+#include "wlr-screencopy-unstable-v1-client-protocol.h"
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
+
+struct screencopy_frame : public capture_frame
+{
+    ScreencopySource *source;
+    zwlr_screencopy_frame_v1 *frame = NULL;
+    capture_region damage;
+};
+
+static void frame_handle_buffer(void *data, struct zwlr_screencopy_frame_v1 *, uint32_t format,
+    uint32_t width, uint32_t height, uint32_t stride)
+{
+    auto frame = (screencopy_frame*) data;
+    auto source = frame->source;
+    if (source->params.use_dmabuf) {
+        return;
+    }
+
+    auto& buffer = *frame->buffer;
+    auto old_format = buffer.format;
+    buffer.format = (wl_shm_format)format;
+    buffer.drm_format = wl_shm_to_drm_format(format);
+    buffer.width = width;
+    buffer.height = height;
+    buffer.stride = stride;
+
+    /* ffmpeg requires even width and height */
+    if (buffer.width % 2)
+        buffer.width -= 1;
+    if (buffer.height % 2)
+        buffer.height -= 1;
+
+    /* The size changes with the mode or the scale of the output */
+    if (!buffer.wl_buffer || old_format != format || buffer.size != stride * height) {
+        free_shm_buffer(buffer);
+        buffer.size = stride * height;
+        buffer.wl_buffer = create_shm_buffer(source->params.shm, format,
+            width, height, stride, &buffer.data);
+    }
+
+    if (buffer.wl_buffer == NULL) {
+        source->stop("failed to create buffer");
+        return;
+    }
+
+    source->copy(*frame);
+}
+
+static void frame_handle_flags(void *data, struct zwlr_screencopy_frame_v1 *, uint32_t flags) {
+    auto frame = (screencopy_frame*) data;
+    frame->buffer->y_invert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
+}
+
+static void frame_handle_ready(void *data, struct zwlr_screencopy_frame_v1 *,
+    uint32_t tv_sec_hi, uint32_t tv_sec_low, uint32_t tv_nsec) {
+
+    auto frame = (screencopy_frame*) data;
+    auto& buffer = *frame->buffer;
+    buffer.presented.tv_sec = ((1ll * tv_sec_hi) << 32ll) | tv_sec_low;
+    buffer.presented.tv_nsec = tv_nsec;
+
+    /* Without copy_with_damage, the compositor doesn't send any damage */
+    buffer.damage = frame->damage.is_selected() ? frame->damage :
+        capture_region{0, 0, buffer.width, buffer.height};
+    frame->source->frame_ready(*frame);
+}
+
+static void frame_handle_failed(void *data, struct zwlr_screencopy_frame_v1 *) {
+    auto frame = (screencopy_frame*) data;
+    frame->source->frame_failed(*frame);
+}
+
+static void frame_handle_damage(void *data, struct zwlr_screencopy_frame_v1 *,
+    uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    auto frame = (screencopy_frame*) data;
+    frame->damage.add(capture_region(x, y, width, height));
+}
+
+static void dmabuf_created(void *data, struct zwp_linux_buffer_params_v1 *,
+    struct wl_buffer *wl_buffer) {
+
+    auto frame = (screencopy_frame*) data;
+    frame->buffer->wl_buffer = wl_buffer;
+    frame->source->copy(*frame);
+}
+
+static void dmabuf_failed(void *data, struct zwp_linux_buffer_params_v1 *) {
+    auto frame = (screencopy_frame*) data;
+    frame->source->stop("Failed to create dmabuf");
+}
+
+static const struct zwp_linux_buffer_params_v1_listener params_listener = {
+    .created = dmabuf_created,
+    .failed = dmabuf_failed,
+};
+
+static void frame_handle_linux_dmabuf(void *data, struct zwlr_screencopy_frame_v1 *,
+    uint32_t format, uint32_t width, uint32_t height)
+{
+    auto frame = (screencopy_frame*) data;
+    auto source = frame->source;
+    if (!source->params.use_dmabuf) {
+        return;
+    }
+
+    auto& buffer = *frame->buffer;
+
+    auto old_format = buffer.format;
+    bool resized = buffer.width != (int)width || buffer.height != (int)height;
+    buffer.format = drm_to_wl_shm_format(format);
+    buffer.drm_format = format;
+    buffer.width = width;
+    buffer.height = height;
+
+    if (!buffer.wl_buffer || (old_format != buffer.format) || resized) {
+        source->free_buffer(buffer);
+
+        const uint64_t modifier = 0; // DRM_FORMAT_MOD_LINEAR
+        buffer.bo = gbm_bo_create_with_modifiers(source->params.gbm_device, buffer.width,
+            buffer.height, format, &modifier, 1);
+        if (buffer.bo == NULL)
+        {
+            buffer.bo = gbm_bo_create(source->params.gbm_device, buffer.width,
+                buffer.height, format, GBM_BO_USE_LINEAR | GBM_BO_USE_RENDERING);
+        }
+        if (buffer.bo == NULL)
+        {
+            source->stop("Failed to create gbm bo");
+            return;
+        }
+
+        buffer.stride = gbm_bo_get_stride(buffer.bo);
+
+        buffer.params = zwp_linux_dmabuf_v1_create_params(source->params.dmabuf);
+
+        uint64_t mod = gbm_bo_get_modifier(buffer.bo);
+        zwp_linux_buffer_params_v1_add(buffer.params,
+            gbm_bo_get_fd(buffer.bo), 0,
+            gbm_bo_get_offset(buffer.bo, 0),
+            gbm_bo_get_stride(buffer.bo),
+            mod >> 32, mod & 0xffffffff);
+
+        zwp_linux_buffer_params_v1_add_listener(buffer.params, &params_listener, frame);
+        zwp_linux_buffer_params_v1_create(buffer.params, buffer.width,
+            buffer.height, format, 0);
+    } else {
+        source->copy(*frame);
+    }
+}
+
+static void frame_handle_buffer_done(void *, struct zwlr_screencopy_frame_v1 *) {
+}
+
+static const struct zwlr_screencopy_frame_v1_listener frame_listener = {
+    .buffer = frame_handle_buffer,
+    .flags = frame_handle_flags,
+    .ready = frame_handle_ready,
+    .failed = frame_handle_failed,
+    .damage = frame_handle_damage,
+    .linux_dmabuf = frame_handle_linux_dmabuf,
+    .buffer_done = frame_handle_buffer_done,
+};
+
+ScreencopySource::ScreencopySource(const CaptureSourceParams& _params)
+{
+    params = _params;
+}
+
+ScreencopySource::~ScreencopySource()
+{
+    destroy_frames();
+}
+
+std::unique_ptr<capture_frame> ScreencopySource::create_frame()
+{
+    auto frame = new screencopy_frame;
+    frame->source = this;
+    return std::unique_ptr<capture_frame>(frame);
+}
+
+void ScreencopySource::start_frame(capture_frame& base)
+{
+    auto& frame = static_cast<screencopy_frame&>(base);
+    destroy_frame(frame);
+    frame.damage = capture_region{};
+
+    /* Capture the whole output if the user hasn't provided a good geometry */
+    if (!params.region.is_selected())
+    {
+        frame.frame = zwlr_screencopy_manager_v1_capture_output(
+            params.screencopy_manager, 1, params.output);
+    } else
+    {
+        frame.frame = zwlr_screencopy_manager_v1_capture_output_region(
+            params.screencopy_manager, 1, params.output,
+            params.region.x, params.region.y,
+            params.region.width, params.region.height);
+    }
+
+    zwlr_screencopy_frame_v1_add_listener(frame.frame, &frame_listener, &frame);
+}
+
+void ScreencopySource::destroy_frame(capture_frame& base)
+{
+    auto& frame = static_cast<screencopy_frame&>(base);
+    if (frame.frame != NULL)
+    {
+        zwlr_screencopy_frame_v1_destroy(frame.frame);
+        frame.frame = NULL;
+    }
+}
+
+void ScreencopySource::copy(capture_frame& base)
+{
+    auto& frame = static_cast<screencopy_frame&>(base);
+    if (params.use_damage) {
+        zwlr_screencopy_frame_v1_copy_with_damage(frame.frame, frame.buffer->wl_buffer);
+    } else {
+        zwlr_screencopy_frame_v1_copy(frame.frame, frame.buffer->wl_buffer);
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef SCREENCOPY_SOURCE_HPP
+#define SCREENCOPY_SOURCE_HPP
+
+#include "capture-source.hpp"
+
+struct zwlr_screencopy_frame_v1;
+
+/* Captures with wlr-screencopy, which asks the compositor for every frame
+ * separately and tells the buffer parameters with each frame */
+class ScreencopySource : public CaptureSource
+{
+  public:
+    ScreencopySource(const CaptureSourceParams& params);
+    ~ScreencopySource();
+
+    /* Copy the frame into its buffer, once the buffer matches the frame */
+    void copy(capture_frame& frame);
+
+  protected:
+    std::unique_ptr<capture_frame> create_frame() override;
+    void start_frame(capture_frame& frame) override;
+    void destroy_frame(capture_frame& frame) override;
+};
+
+#endif /* end of include guard: SCREENCOPY_SOURCE_HPP */
@@ -0,0 +1,250 @@
+#include "synthetic-source.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BAR_WIDTH 64
+#define BAR_STEP 8
+
+#define LINE_HEIGHT 24
+#define GLYPH_WIDTH 10
+#define SCROLL_STEP 4
+
+static uint32_t hash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+/* Half float of v / 255, which is always a normal number or zero */
+static uint16_t to_half(uint8_t v)
+{
+    float f = v / 255.0f;
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    if (v == 0)
+        return 0;
+
+    int32_t exponent = ((bits >> 23) & 0xff) - 127 + 15;
+    return (exponent << 10) | ((bits >> 13) & 0x3ff);
+}
+
+/* Store a row of pixels in the given shm format */
+static void pack_row(uint32_t format, const std::vector<uint8_t>& rgb, int32_t count, uint8_t *out)
+{
+    for (int32_t i = 0; i < count; i++)
+    {
+        uint32_t r = rgb[3 * i], g = rgb[3 * i + 1], b = rgb[3 * i + 2];
+        switch (format)
+        {
+          case WL_SHM_FORMAT_XBGR8888:
+          case WL_SHM_FORMAT_ABGR8888:
+            ((uint32_t*)out)[i] = 0xff000000 | b << 16 | g << 8 | r;
+            break;
+          case WL_SHM_FORMAT_BGR888:
+            out[3 * i] = r;
+            out[3 * i + 1] = g;
+            out[3 * i + 2] = b;
+            break;
+          case WL_SHM_FORMAT_RGB565:
+            ((uint16_t*)out)[i] = (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+            break;
+          case WL_SHM_FORMAT_BGR565:
+            ((uint16_t*)out)[i] = (b >> 3) << 11 | (g >> 2) << 5 | r >> 3;
+            break;
+          case WL_SHM_FORMAT_XRGB2101010:
+          case WL_SHM_FORMAT_ARGB2101010:
+            ((uint32_t*)out)[i] = 3u << 30 | (r << 2 | r >> 6) << 20 |
+                (g << 2 | g >> 6) << 10 | (b << 2 | b >> 6);
+            break;
+          case WL_SHM_FORMAT_XBGR2101010:
+          case WL_SHM_FORMAT_ABGR2101010:
+            ((uint32_t*)out)[i] = 3u << 30 | (b << 2 | b >> 6) << 20 |
+                (g << 2 | g >> 6) << 10 | (r << 2 | r >> 6);
+            break;
+          case WL_SHM_FORMAT_XBGR16161616:
+          case WL_SHM_FORMAT_ABGR16161616:
+            ((uint64_t*)out)[i] = 0xffffull << 48 | (uint64_t)(b * 257) << 32 |
+                (g * 257) << 16 | r * 257;
+            break;
+          case WL_SHM_FORMAT_XRGB16161616:
+          case WL_SHM_FORMAT_ARGB16161616:
+            ((uint64_t*)out)[i] = 0xffffull << 48 | (uint64_t)(r * 257) << 32 |
+                (g * 257) << 16 | b * 257;
+            break;
+          case WL_SHM_FORMAT_XBGR16161616F:
+          case WL_SHM_FORMAT_ABGR16161616F:
+            ((uint64_t*)out)[i] = (uint64_t)to_half(255) << 48 | (uint64_t)to_half(b) << 32 |
+                (uint64_t)to_half(g) << 16 | to_half(r);
+            break;
+          default:
+            ((uint32_t*)out)[i] = 0xff000000 | r << 16 | g << 8 | b;
+            break;
+        }
+    }
+}
+
+SyntheticSource::SyntheticSource(const CaptureSourceParams& _params)
+{
+    params = _params;
+
+    /* ffmpeg requires even width and height */
+    params.width &= ~1;
+    params.height &= ~1;
+
+    auto format = get_shm_input_format(params.format);
+    if (!format.has_value())
+    {
+        stop("Unsupported synthetic frame format");
+        return;
+    }
+    bytes_per_pixel = get_bytes_per_pixel(format.value());
+
+    if (params.content == "static")
+        content = SYNTHETIC_STATIC;
+    else if (params.content == "bar")
+        content = SYNTHETIC_BAR;
+    else if (params.content == "scrolling")
+        content = SYNTHETIC_SCROLLING;
+    else if (params.content == "video")
+        content = SYNTHETIC_VIDEO;
+    else
+        stop("Unknown synthetic content " + params.content);
+}
+
+SyntheticSource::~SyntheticSource()
+{
+    destroy_frames();
+}
+
+void SyntheticSource::free_buffer(wf_buffer& buffer)
+{
+    free(buffer.data);
+    buffer.data = NULL;
+    drawn_bar.erase(&buffer);
+}
+
+capture_region SyntheticSource::get_bar(uint64_t frame) const
+{
+    int32_t width = std::min(BAR_WIDTH, params.width);
+    int32_t range = params.width - width + 1;
+    return capture_region{int32_t(frame * BAR_STEP % range), 0, width, params.height};
+}
+
+SyntheticSource::rgb SyntheticSource::get_pixel(int32_t x, int32_t y) const
+{
+    uint32_t t = frame_count;
+    switch (content)
+    {
+      case SYNTHETIC_BAR:
+        if (last_bar.contained_in(capture_region{0, 0, params.width, params.height}) &&
+            x >= last_bar.x && x < last_bar.x + last_bar.width)
+        {
+            return {255, 255, 255};
+        }
+        break;
+      case SYNTHETIC_SCROLLING:
+      {
+        /* Words of glyphs, which are random patterns of ink */
+        int32_t ty = y + t * SCROLL_STEP;
+        uint32_t word = hash(ty / LINE_HEIGHT * 4099 + x / GLYPH_WIDTH);
+        int32_t gy = ty % LINE_HEIGHT, gx = x % GLYPH_WIDTH;
+        bool ink = gy >= 4 && gy < 18 && gx < 8 && word % 5 &&
+            (hash(word + gy / 2 * 8 + gx / 2) & 1);
+        return ink ? rgb{40, 40, 40} : rgb{250, 250, 250};
+      }
+      case SYNTHETIC_VIDEO:
+      {
+        uint32_t noise = hash(x * 7919 + y * 104729 + t) & 15;
+        return {uint8_t(x + 3 * t), uint8_t(y + 2 * t + noise),
+            uint8_t(((x * x + y * y) >> 8) + 5 * t)};
+      }
+      default:
+        break;
+    }
+
+    return {uint8_t(255 * x / params.width), uint8_t(255 * y / params.height),
+        uint8_t(x + y)};
+}
+
+void SyntheticSource::fill(wf_buffer& buffer, const capture_region& region)
+{
+    row.resize(3 * region.width);
+    for (int32_t y = region.y; y < region.y + region.height; y++)
+    {
+        for (int32_t x = 0; x < region.width; x++)
+        {
+            auto pixel = get_pixel(region.x + x, y);
+            row[3 * x] = pixel.r;
+            row[3 * x + 1] = pixel.g;
+            row[3 * x + 2] = pixel.b;
+        }
+
+        pack_row(params.format, row, region.width, (uint8_t*)buffer.data +
+            1ll * y * buffer.stride + 1ll * region.x * bytes_per_pixel);
+    }
+}
+
+void SyntheticSource::start_frame(capture_frame& frame)
+{
+    auto& buffer = *frame.buffer;
+    capture_region full{0, 0, params.width, params.height};
+    bool allocated = false;
+    if (buffer.data == NULL)
+    {
+        buffer.format = (wl_shm_format)params.format;
+        buffer.drm_format = wl_shm_to_drm_format(buffer.format);
+        buffer.width = params.width;
+        buffer.height = params.height;
+        buffer.stride = params.width * bytes_per_pixel;
+        buffer.size = 1ull * buffer.stride * buffer.height;
+        buffer.y_invert = false;
+        buffer.data = malloc(buffer.size);
+        if (buffer.data == NULL)
+        {
+            stop("Failed to allocate synthetic frame");
+            return;
+        }
+
+        allocated = true;
+    }
+
+    auto previous_bar = last_bar;
+    switch (content)
+    {
+      case SYNTHETIC_STATIC:
+        if (allocated)
+            fill(buffer, full);
+        buffer.damage = frame_count == 0 ? full : capture_region{};
+        break;
+      case SYNTHETIC_BAR:
+      {
+        /* Move the bar from where it was drawn into this buffer */
+        last_bar = get_bar(frame_count);
+        auto& drawn = drawn_bar[&buffer];
+        if (allocated)
+            fill(buffer, full);
+        else if (drawn.is_selected())
+            fill(buffer, drawn);
+        fill(buffer, last_bar);
+        drawn = last_bar;
+
+        buffer.damage = frame_count == 0 ? full : last_bar;
+        buffer.damage.add(previous_bar);
+        break;
+      }
+      case SYNTHETIC_SCROLLING:
+      case SYNTHETIC_VIDEO:
+        fill(buffer, full);
+        buffer.damage = full;
+        break;
+    }
+
+    frame_count++;
+    clock_gettime(CLOCK_MONOTONIC, &buffer.presented);
+    frame_ready(frame);
+}
@@ -0,0 +1,55 @@
+#ifndef SYNTHETIC_SOURCE_HPP
+#define SYNTHETIC_SOURCE_HPP
+
+#include "capture-source.hpp"
+#include <map>
+#include <vector>
+
+enum SyntheticContent
+{
+    /* A gradient which never changes */
+    SYNTHETIC_STATIC,
+    /* The gradient with a bar which moves a little every frame, so that
+     * only a small part of the frame is damaged, like when typing */
+    SYNTHETIC_BAR,
+    /* Lines of text which scroll up every frame */
+    SYNTHETIC_SCROLLING,
+    /* Moving patterns with noise, which change every pixel of every frame */
+    SYNTHETIC_VIDEO,
+};
+
+/* Generates frames in memory instead of capturing them, to measure the
+ * encoding without a compositor. All shm formats which can be encoded are
+ * supported. */
+class SyntheticSource : public CaptureSource
+{
+  public:
+    SyntheticSource(const CaptureSourceParams& params);
+    ~SyntheticSource();
+
+    void free_buffer(wf_buffer& buffer) override;
+
+  protected:
+    void start_frame(capture_frame& frame) override;
+
+  private:
+    struct rgb
+    {
+        uint8_t r, g, b;
+    };
+
+    SyntheticContent content = SYNTHETIC_BAR;
+    int bytes_per_pixel = 4;
+    uint64_t frame_count = 0;
+    capture_region last_bar;
+    /* Where the bar was drawn into each buffer */
+    std::map<wf_buffer*, capture_region> drawn_bar;
+    /* R, G and B of each pixel of the row which is being filled */
+    std::vector<uint8_t> row;
+
+    capture_region get_bar(uint64_t frame) const;
+    rgb get_pixel(int32_t x, int32_t y) const;
+    void fill(wf_buffer& buffer, const capture_region& region);
+};
+
+#endif /* end of include guard: SYNTHETIC_SOURCE_HPP */
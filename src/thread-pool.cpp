@@ -0,0 +1,261 @@
+#include "thread-pool.hpp"
+#include "thread-stats.hpp"
+#include "thread-scheduling.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+
+struct ThreadPool::Batch
+{
+    const std::function<void(int, int)> *job;
+    int count;
+    std::atomic<int> next{0};
+    std::atomic<int> done{0};
+    std::atomic<int> threads{1}; // the calling thread is 0
+    std::atomic<int> helpers{0}; // workers which took the batch and are not done yet
+};
+
+ThreadPool::ThreadPool(int count, bool pin)
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    if (pin && thread_scheduling_cpus(THREAD_STAGE_POOL, set))
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+        workers.emplace_back(new Worker);
+
+    for (int i = 0; i < count; i++)
+    {
+        int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+        workers[i]->thread = std::thread([=] () { worker_loop(i, cpu); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cond.notify_all();
+
+    for (auto& worker : workers)
+        worker->thread.join();
+}
+
+/* Claim and run jobs of the batch until none are left */
+void ThreadPool::help(Batch& batch, int thread)
+{
+    int index;
+    while ((index = batch.next.fetch_add(1)) < batch.count)
+    {
+        (*batch.job)(index, thread);
+        batch.done.fetch_add(1, std::memory_order_release);
+    }
+}
+
+ThreadPool::Batch *ThreadPool::take(size_t index)
+{
+    /* The own queue first, then steal from the others */
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        auto& worker = *workers[(index + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (worker.batches.empty())
+            continue;
+
+        Batch *batch;
+        if (i == 0)
+        {
+            batch = worker.batches.front();
+            worker.batches.pop_front();
+        } else
+        {
+            batch = worker.batches.back();
+            worker.batches.pop_back();
+        }
+
+        /* Counted while the queue is locked, so that dequeue() can't miss it */
+        batch->helpers++;
+        std::lock_guard<std::mutex> pool_lock(mutex);
+        queued--;
+        return batch;
+    }
+
+    return NULL;
+}
+
+void ThreadPool::dequeue(Batch& batch)
+{
+    for (auto& worker : workers)
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        auto it = std::remove(worker->batches.begin(), worker->batches.end(), &batch);
+        int removed = worker->batches.end() - it;
+        worker->batches.erase(it, worker->batches.end());
+        if (removed)
+        {
+            std::lock_guard<std::mutex> pool_lock(mutex);
+            queued -= removed;
+        }
+    }
+}
+
+void ThreadPool::worker_loop(size_t index, int cpu)
+{
+    std::string name = "pool " + std::to_string(index);
+    trace_thread_name(name);
+    ThreadCpuRegistration cpu_registration(THREAD_STAGE_POOL, name);
+
+    if (cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [=] () { return queued > 0 || stopping; });
+            if (stopping)
+                break;
+        }
+
+        Batch *batch = take(index);
+        if (!batch)
+            continue;
+
+        help(*batch, batch->threads.fetch_add(1));
+        batch->helpers.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+void ThreadPool::run(int count, int max_threads, const std::function<void(int, int)>& job)
+{
+    int helpers = std::min({count - 1, max_threads - 1, size()});
+    if (helpers <= 0)
+    {
+        for (int i = 0; i < count; i++)
+            job(i, 0);
+        return;
+    }
+
+    Batch batch;
+    batch.job = &job;
+    batch.count = count;
+
+    /* Spread the batches over the workers, an idle worker steals them from
+     * the others anyway */
+    unsigned first = next_worker.fetch_add(helpers);
+    for (int i = 0; i < helpers; i++)
+    {
+        auto& worker = *workers[(first + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.batches.push_back(&batch);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queued += helpers;
+    }
+    cond.notify_all();
+
+    help(batch, 0);
+
+    /* The jobs are all claimed, the workers which didn't get to the batch
+     * yet must not find it anymore once it is gone */
+    dequeue(batch);
+    while (batch.done.load(std::memory_order_acquire) < count ||
+        batch.helpers.load(std::memory_order_acquire) > 0)
+    {
+        std::this_thread::yield();
+    }
+}
+
+static std::unique_ptr<ThreadPool> pool;
+
+void thread_pool_start(int workers, bool pin)
+{
+    if (workers <= 0)
+        workers = std::max(1u, std::thread::hardware_concurrency());
+
+    std::cerr << "Thread pool: " << workers << " workers" <<
+        (pin ? ", pinned to CPUs" : "") << std::endl;
+    pool = std::unique_ptr<ThreadPool>(new ThreadPool(workers, pin));
+}
+
+void thread_pool_stop()
+{
+    pool = nullptr;
+}
+
+int thread_pool_size()
+{
+    return pool ? pool->size() : 0;
+}
+
+static int codec_execute(AVCodecContext *ctx, int (*func)(AVCodecContext *ctx, void *arg),
+    void *arg, int *ret, int count, int size)
+{
+    pool->run(count, ctx->thread_count, [&] (int job, int) {
+        int result = func(ctx, (char*)arg + job * size);
+        if (ret)
+            ret[job] = result;
+    });
+
+    return 0;
+}
+
+static int codec_execute2(AVCodecContext *ctx,
+    int (*func)(AVCodecContext *ctx, void *arg, int job, int thread),
+    void *arg, int *ret, int count)
+{
+    pool->run(count, ctx->thread_count, [&] (int job, int thread) {
+        int result = func(ctx, arg, job, thread);
+        if (ret)
+            ret[job] = result;
+    });
+
+    return 0;
+}
+
+static int filter_execute(AVFilterContext *ctx, avfilter_action_func *func,
+    void *arg, int *ret, int count)
+{
+    pool->run(count, pool->size() + 1, [&] (int job, int) {
+        int result = func(ctx, arg, job, count);
+        if (ret)
+            ret[job] = result;
+    });
+
+    return 0;
+}
+
+void thread_pool_attach(AVCodecContext *ctx)
+{
+    /* Frame threads run whole frames, they can't be moved into the pool */
+    if (!pool || !(ctx->active_thread_type & FF_THREAD_SLICE))
+        return;
+
+    ctx->execute = codec_execute;
+    ctx->execute2 = codec_execute2;
+}
+
+void thread_pool_attach(AVFilterGraph *graph)
+{
+    if (pool)
+        graph->execute = filter_execute;
+}
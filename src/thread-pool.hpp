@@ -0,0 +1,77 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavfilter/avfilter.h>
+}
+
+/**
+ * A pool of worker threads which runs the slice jobs of the encoders and the
+ * filtergraphs of all writers, instead of every libav context starting its
+ * own threads. Each worker has a queue of batches to help with and steals
+ * from the others when it is empty. The thread which submits a batch works
+ * on it as well, so a batch never waits for a busy pool to start.
+ */
+class ThreadPool
+{
+  public:
+    /* pin places each worker on its own CPU */
+    ThreadPool(int workers, bool pin);
+    ~ThreadPool();
+
+    /* Run job(index, thread) for every index below count on up to
+     * max_threads threads, including the calling one, and wait for all of
+     * them. thread is below max_threads and unique among the running jobs. */
+    void run(int count, int max_threads, const std::function<void(int, int)>& job);
+
+    int size() const { return workers.size(); }
+
+  private:
+    struct Batch;
+    struct Worker
+    {
+        std::thread thread;
+        std::mutex mutex;
+        std::deque<Batch*> batches;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::mutex mutex;
+    std::condition_variable cond;
+    int queued = 0; // batches in the queues of the workers, protected by mutex
+    bool stopping = false;
+    std::atomic<unsigned> next_worker{0};
+
+    static void help(Batch& batch, int thread);
+    void worker_loop(size_t index, int cpu);
+    Batch *take(size_t index);
+    void dequeue(Batch& batch);
+};
+
+/* Start the shared pool with the given number of workers, one per CPU if 0 */
+void thread_pool_start(int workers, bool pin);
+void thread_pool_stop();
+
+/* Number of workers of the pool, 0 if it is not running */
+int thread_pool_size();
+
+/* Run the slice threads of an opened encoder in the pool. Encoders which
+ * manage their own threads, like libx264, are left alone. */
+void thread_pool_attach(AVCodecContext *ctx);
+
+/* Run the slice threads of a filtergraph in the pool. Must be called before
+ * its filters are created. */
+void thread_pool_attach(AVFilterGraph *graph);
+
+#endif /* end of include guard: THREAD_POOL_HPP */
@@ -0,0 +1,260 @@
+#include "thread-scheduling.hpp"
+
+#include <atomic>
+#include <errno.h>
+#include <iostream>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct RoleScheduling
+{
+    bool has_cpus = false;
+    cpu_set_t cpus;
+    bool has_nice = false;
+    int nice = 0;
+    int policy = SCHED_OTHER;
+    int priority = 0;
+};
+
+static RoleScheduling roles[THREAD_STAGE_COUNT];
+static bool configured = false;
+
+/* The scheduling of the process at startup, for the roles without settings */
+static cpu_set_t default_cpus;
+static int default_nice;
+
+/* Failures are reported once per role, not for every thread */
+static std::atomic<bool> warned[THREAD_STAGE_COUNT];
+
+static bool parse_int(const std::string& str, int& value)
+{
+    char *end;
+    long result = strtol(str.c_str(), &end, 10);
+    if (str.empty() || *end)
+        return false;
+
+    value = result;
+    return true;
+}
+
+/* Parse a list of CPUs like 0,2-3 */
+static bool parse_cpus(const std::string& str, cpu_set_t& set)
+{
+    CPU_ZERO(&set);
+    size_t start = 0;
+    while (start <= str.size())
+    {
+        size_t comma = str.find(',', start);
+        if (comma == std::string::npos)
+            comma = str.size();
+
+        std::string range = str.substr(start, comma - start);
+        size_t dash = range.find('-');
+        int first, last;
+        if (dash == std::string::npos)
+        {
+            if (!parse_int(range, first))
+                return false;
+            last = first;
+        } else if (!parse_int(range.substr(0, dash), first) ||
+            !parse_int(range.substr(dash + 1), last))
+        {
+            return false;
+        }
+
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return false;
+
+        for (int cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, &set);
+
+        start = comma + 1;
+    }
+
+    return CPU_COUNT(&set) > 0;
+}
+
+bool thread_scheduling_parse(const std::string& spec)
+{
+    size_t colon = spec.find(':');
+    if (colon == std::string::npos)
+        return false;
+
+    std::string role_name = spec.substr(0, colon);
+    int stage = 0;
+    while (stage < THREAD_STAGE_COUNT && role_name != thread_stage_name((ThreadStage)stage))
+        stage++;
+
+    if (stage == THREAD_STAGE_COUNT)
+        return false;
+
+    RoleScheduling role = roles[stage];
+    size_t start = colon + 1;
+    while (start <= spec.size())
+    {
+        size_t end = spec.find(':', start);
+        if (end == std::string::npos)
+            end = spec.size();
+
+        std::string setting = spec.substr(start, end - start);
+        size_t eq = setting.find('=');
+        if (eq == std::string::npos)
+            return false;
+
+        std::string key = setting.substr(0, eq);
+        std::string value = setting.substr(eq + 1);
+        if (key == "cpus")
+        {
+            if (!parse_cpus(value, role.cpus))
+                return false;
+            role.has_cpus = true;
+        } else if (key == "nice")
+        {
+            if (!parse_int(value, role.nice) || role.nice < -20 || role.nice > 19)
+                return false;
+            role.has_nice = true;
+        } else if (key == "fifo" || key == "rr")
+        {
+            /* A realtime thread which spins can starve the whole CPU, only
+             * the threads which mostly wait for the compositor or the audio
+             * server may use it */
+            if (stage != THREAD_STAGE_CAPTURE && stage != THREAD_STAGE_AUDIO)
+                return false;
+
+            role.policy = key == "fifo" ? SCHED_FIFO : SCHED_RR;
+            if (!parse_int(value, role.priority) ||
+                role.priority < sched_get_priority_min(role.policy) ||
+                role.priority > sched_get_priority_max(role.policy))
+            {
+                return false;
+            }
+        } else
+        {
+            return false;
+        }
+
+        start = end + 1;
+    }
+
+    if (!configured)
+    {
+        if (sched_getaffinity(0, sizeof(default_cpus), &default_cpus) < 0)
+        {
+            CPU_ZERO(&default_cpus);
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                CPU_SET(cpu, &default_cpus);
+        }
+
+        errno = 0;
+        default_nice = getpriority(PRIO_PROCESS, 0);
+        if (errno)
+            default_nice = 0;
+        configured = true;
+    }
+
+    roles[stage] = role;
+    return true;
+}
+
+static std::string cpus_to_string(const cpu_set_t& set)
+{
+    std::string result;
+    int cpu = 0;
+    while (cpu < CPU_SETSIZE)
+    {
+        if (!CPU_ISSET(cpu, &set))
+        {
+            cpu++;
+            continue;
+        }
+
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &set))
+            last++;
+
+        if (!result.empty())
+            result += ",";
+        result += std::to_string(cpu);
+        if (last > cpu)
+            result += "-" + std::to_string(last);
+        cpu = last + 1;
+    }
+
+    return result;
+}
+
+void thread_scheduling_print()
+{
+    for (int stage = 0; stage < THREAD_STAGE_COUNT; stage++)
+    {
+        const RoleScheduling& role = roles[stage];
+        if (!role.has_cpus && !role.has_nice && role.policy == SCHED_OTHER)
+            continue;
+
+        std::cerr << "Scheduling of the " << thread_stage_name((ThreadStage)stage) << " threads:";
+        if (role.has_cpus)
+            std::cerr << " CPUs " << cpus_to_string(role.cpus);
+        if (role.has_nice)
+            std::cerr << " nice " << role.nice;
+        if (role.policy != SCHED_OTHER)
+        {
+            std::cerr << (role.policy == SCHED_FIFO ? " SCHED_FIFO " : " SCHED_RR ") <<
+                role.priority;
+        }
+        std::cerr << std::endl;
+    }
+}
+
+static void warn_failure(ThreadStage stage, const std::string& name, const char *what, int err)
+{
+    if (warned[stage].exchange(true))
+        return;
+
+    std::cerr << "Failed to set the " << what << " of thread " << name << ": " <<
+        strerror(err);
+    if (err == EPERM)
+        std::cerr << " (needs CAP_SYS_NICE or higher RLIMIT_NICE/RLIMIT_RTPRIO limits)";
+    std::cerr << std::endl;
+}
+
+void thread_scheduling_apply(ThreadStage stage, const std::string& name)
+{
+    if (!configured)
+        return;
+
+    const RoleScheduling& role = roles[stage];
+    const cpu_set_t& cpus = role.has_cpus ? role.cpus : default_cpus;
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err)
+        warn_failure(stage, name, "CPU affinity", err);
+
+    /* On Linux the nice level belongs to the thread. Lowering it again
+     * needs privileges, so it is only set when it differs. */
+    pid_t tid = syscall(SYS_gettid);
+    int nice = role.has_nice ? role.nice : default_nice;
+    errno = 0;
+    int current = getpriority(PRIO_PROCESS, tid);
+    if (!errno && current != nice && setpriority(PRIO_PROCESS, tid, nice) < 0)
+        warn_failure(stage, name, "nice level", errno);
+
+    sched_param param{};
+    param.sched_priority = role.priority;
+    err = pthread_setschedparam(pthread_self(), role.policy, &param);
+    if (err)
+        warn_failure(stage, name, "scheduling policy", err);
+}
+
+bool thread_scheduling_cpus(ThreadStage stage, cpu_set_t& set)
+{
+    if (configured)
+    {
+        set = roles[stage].has_cpus ? roles[stage].cpus : default_cpus;
+        return true;
+    }
+
+    return sched_getaffinity(0, sizeof(set), &set) == 0;
+}
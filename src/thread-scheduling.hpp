@@ -0,0 +1,33 @@
+#ifndef THREAD_SCHEDULING_HPP
+#define THREAD_SCHEDULING_HPP
+
+#include <string>
+#include <sched.h>
+#include "thread-stats.hpp"
+
+/**
+ * Parse ROLE:SETTING[:SETTING...] and set the scheduling of the threads of
+ * the role. ROLE is a thread stage, SETTING is one of
+ *   cpus=LIST      the CPUs the threads may run on, like 0,2-3
+ *   nice=N         the nice level of the threads
+ *   fifo=PRIORITY  SCHED_FIFO with the priority, capture and audio only
+ *   rr=PRIORITY    SCHED_RR with the priority, capture and audio only
+ * Must be called before any thread is started.
+ */
+bool thread_scheduling_parse(const std::string& spec);
+
+/* Print the configured scheduling of each role */
+void thread_scheduling_print();
+
+/**
+ * Apply the scheduling of the role to the calling thread. Threads inherit
+ * the scheduling of the thread which created them, so once anything is
+ * configured the roles without settings are reset to the scheduling of the
+ * process at startup.
+ */
+void thread_scheduling_apply(ThreadStage stage, const std::string& name);
+
+/* The CPUs the threads of the role run on */
+bool thread_scheduling_cpus(ThreadStage stage, cpu_set_t& set);
+
+#endif /* end of include guard: THREAD_SCHEDULING_HPP */
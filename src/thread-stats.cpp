@@ -0,0 +1,225 @@
+#include "thread-stats.hpp"
+#include "metrics.hpp"
+#include "thread-scheduling.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#define THREAD_STATS_INTERVAL_MS 1000
+/* Number of samples summarized in each verbose line */
+#define THREAD_STATS_SUMMARY_SAMPLES 5
+/* A thread above this share of a CPU is considered overloaded */
+#define THREAD_OVERLOAD_PERCENT 90
+/* How many consecutive samples a thread has to be overloaded before warning,
+ * so that a single slow keyframe doesn't cause a warning */
+#define THREAD_OVERLOAD_SAMPLES 2
+
+static const char *stage_names[THREAD_STAGE_COUNT] = {
+    "capture", "writer", "rendition", "muxer", "audio", "pool",
+};
+
+struct ThreadEntry
+{
+    ThreadStage stage;
+    std::string name;
+    clockid_t clock;
+    uint64_t last_cpu_nsec = 0;
+    int overloaded_samples = 0;
+};
+
+static std::mutex stats_mutex;
+static std::condition_variable stats_cond;
+static std::list<ThreadEntry> entries;
+/* CPU time of threads which exited since the last sample */
+static uint64_t exited_cpu_nsec[THREAD_STAGE_COUNT];
+static std::atomic<bool> overloaded[THREAD_STAGE_COUNT];
+
+static std::thread sampler;
+static bool sampler_stop = false;
+
+static uint64_t clock_nsec(clockid_t clock)
+{
+    timespec ts;
+    if (clock_gettime(clock, &ts) < 0)
+        return 0;
+
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+const char *thread_stage_name(ThreadStage stage)
+{
+    return stage_names[stage];
+}
+
+ThreadCpuRegistration::ThreadCpuRegistration(ThreadStage stage, const std::string& name)
+{
+    thread_scheduling_apply(stage, name);
+
+    clockid_t clock;
+    if (pthread_getcpuclockid(pthread_self(), &clock) != 0)
+    {
+        entry = nullptr;
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    entries.push_back({stage, name, clock});
+    entry = &entries.back();
+    entry->last_cpu_nsec = clock_nsec(clock);
+}
+
+ThreadCpuRegistration::~ThreadCpuRegistration()
+{
+    if (!entry)
+        return;
+
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    exited_cpu_nsec[entry->stage] += clock_nsec(entry->clock) - entry->last_cpu_nsec;
+    entries.remove_if([=] (const ThreadEntry& e) { return &e == entry; });
+}
+
+bool thread_stats_overloaded(ThreadStage stage)
+{
+    return overloaded[stage].load(std::memory_order_relaxed);
+}
+
+static std::string format_percent(double share)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.0f%%", share * 100);
+    return buf;
+}
+
+static void sample_loop(uint64_t frame_budget_usec, bool verbose)
+{
+    uint64_t last_wall = metrics_now_usec() * 1000;
+    uint64_t last_process = clock_nsec(CLOCK_PROCESS_CPUTIME_ID);
+    uint64_t last_frames = metrics.counters[METRICS_FRAMES_ENCODED].load();
+
+    uint64_t summary_cpu[THREAD_STAGE_COUNT] = {};
+    uint64_t summary_other = 0;
+    uint64_t summary_wall = 0;
+    int summary_samples = 0;
+
+    std::unique_lock<std::mutex> lock(stats_mutex);
+    while (!stats_cond.wait_for(lock, std::chrono::milliseconds(THREAD_STATS_INTERVAL_MS),
+        [] () { return sampler_stop; }))
+    {
+        uint64_t wall = metrics_now_usec() * 1000;
+        uint64_t process = clock_nsec(CLOCK_PROCESS_CPUTIME_ID);
+        uint64_t elapsed = std::max<uint64_t>(wall - last_wall, 1);
+
+        uint64_t stage_cpu[THREAD_STAGE_COUNT] = {};
+        bool stage_overloaded[THREAD_STAGE_COUNT] = {};
+        for (int i = 0; i < THREAD_STAGE_COUNT; i++)
+        {
+            stage_cpu[i] = exited_cpu_nsec[i];
+            exited_cpu_nsec[i] = 0;
+        }
+
+        for (auto& entry : entries)
+        {
+            uint64_t cpu = clock_nsec(entry.clock);
+            uint64_t delta = cpu - std::min(cpu, entry.last_cpu_nsec);
+            entry.last_cpu_nsec = cpu;
+            stage_cpu[entry.stage] += delta;
+
+            if (delta * 100 < elapsed * THREAD_OVERLOAD_PERCENT)
+            {
+                entry.overloaded_samples = 0;
+                continue;
+            }
+
+            stage_overloaded[entry.stage] = true;
+            if (++entry.overloaded_samples == THREAD_OVERLOAD_SAMPLES)
+            {
+                std::cerr << "Thread " << entry.name << " (" << stage_names[entry.stage]
+                    << ") uses " << format_percent(1.0 * delta / elapsed)
+                    << " of a CPU and can't keep up, frames will be dropped" << std::endl;
+            }
+        }
+
+        for (int i = 0; i < THREAD_STAGE_COUNT; i++)
+            overloaded[i] = stage_overloaded[i];
+
+        /* Whatever is not in the registered threads: the libav worker
+         * threads and the threads of the audio server libraries */
+        uint64_t registered = 0;
+        for (int i = 0; i < THREAD_STAGE_COUNT; i++)
+            registered += stage_cpu[i];
+        uint64_t process_delta = process - last_process;
+        uint64_t other = process_delta - std::min(process_delta, registered);
+
+        last_wall = wall;
+        last_process = process;
+
+        if (!verbose)
+            continue;
+
+        for (int i = 0; i < THREAD_STAGE_COUNT; i++)
+            summary_cpu[i] += stage_cpu[i];
+        summary_other += other;
+        summary_wall += elapsed;
+        if (++summary_samples < THREAD_STATS_SUMMARY_SAMPLES)
+            continue;
+
+        std::ostringstream line;
+        line << "CPU:";
+        for (int i = 0; i < THREAD_STAGE_COUNT; i++)
+        {
+            if (summary_cpu[i])
+                line << " " << stage_names[i] << " " << format_percent(1.0 * summary_cpu[i] / summary_wall);
+        }
+        line << " libav/other " << format_percent(1.0 * summary_other / summary_wall);
+
+        uint64_t frames = metrics.counters[METRICS_FRAMES_ENCODED].load();
+        if (frames > last_frames)
+        {
+            char buf[64];
+            /* The writer thread handles its frames one after another, so
+             * it has to stay below the budget, unlike the libav threads */
+            snprintf(buf, sizeof(buf), ", writer %.1f ms/frame", 1e-6 *
+                summary_cpu[THREAD_STAGE_WRITER] / (frames - last_frames));
+            line << buf;
+            if (frame_budget_usec)
+            {
+                snprintf(buf, sizeof(buf), " of %.1f ms budget", frame_budget_usec / 1000.0);
+                line << buf;
+            }
+        }
+        std::cerr << line.str() << std::endl;
+
+        last_frames = frames;
+        std::fill(summary_cpu, summary_cpu + THREAD_STAGE_COUNT, 0);
+        summary_other = 0;
+        summary_wall = 0;
+        summary_samples = 0;
+    }
+}
+
+void thread_stats_start(uint64_t frame_budget_usec, bool verbose)
+{
+    sampler = std::thread(sample_loop, frame_budget_usec, verbose);
+}
+
+void thread_stats_stop()
+{
+    if (!sampler.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        sampler_stop = true;
+    }
+    stats_cond.notify_all();
+    sampler.join();
+}
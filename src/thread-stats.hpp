@@ -0,0 +1,60 @@
+#ifndef THREAD_STATS_HPP
+#define THREAD_STATS_HPP
+
+#include <stdint.h>
+#include <string>
+
+/* The kinds of threads whose CPU time is accounted separately. The threads
+ * of libav and of the audio servers are not registered, their time is what
+ * remains of the CPU time of the process. */
+enum ThreadStage
+{
+    /* The main thread, which captures the frames */
+    THREAD_STAGE_CAPTURE,
+    /* Converting and encoding the frames of an output */
+    THREAD_STAGE_WRITER,
+    /* Scaling and encoding a rendition */
+    THREAD_STAGE_RENDITION,
+    /* Muxing the packets of an output file */
+    THREAD_STAGE_MUXER,
+    /* Reading and encoding the audio */
+    THREAD_STAGE_AUDIO,
+    /* Slices of the encoders and filters, in the shared thread pool */
+    THREAD_STAGE_POOL,
+    THREAD_STAGE_COUNT,
+};
+
+/* The name of the stage, as used in the options and the statistics */
+const char *thread_stage_name(ThreadStage stage);
+
+/**
+ * Accounts the CPU time of the calling thread to a stage while it exists, and
+ * applies the scheduling configured for the stage to the thread.
+ * Create it at the start of the thread and destroy it before the thread exits.
+ */
+class ThreadCpuRegistration
+{
+    struct ThreadEntry *entry;
+
+  public:
+    ThreadCpuRegistration(ThreadStage stage, const std::string& name);
+    ~ThreadCpuRegistration();
+
+    ThreadCpuRegistration(const ThreadCpuRegistration&) = delete;
+    ThreadCpuRegistration& operator=(const ThreadCpuRegistration&) = delete;
+};
+
+/**
+ * Sample the CPU time of the threads every second. A warning is printed when
+ * a thread uses almost a whole CPU, because it can't keep up from then on.
+ * When verbose, a summary of the utilization of each stage and the CPU time
+ * of the writers per frame compared to frame_budget_usec is printed every
+ * few seconds.
+ */
+void thread_stats_start(uint64_t frame_budget_usec, bool verbose);
+void thread_stats_stop();
+
+/* Whether a thread of the stage was overloaded in the last sample */
+bool thread_stats_overloaded(ThreadStage stage);
+
+#endif /* end of include guard: THREAD_STATS_HPP */
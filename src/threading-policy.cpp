@@ -0,0 +1,91 @@
+#include "threading-policy.hpp"
+
+#include <algorithm>
+#include <stdlib.h>
+
+extern "C"
+{
+    #include <libavutil/cpu.h>
+}
+
+/* Slices shorter than this don't have enough work to be worth a thread */
+#define MIN_SLICE_ROWS 64
+
+bool parse_threading(const std::string& str, ThreadingParams& params)
+{
+    std::string policy = str;
+    size_t colon = str.find(':');
+    if (colon != std::string::npos)
+    {
+        policy = str.substr(0, colon);
+        char *end;
+        long threads = strtol(str.c_str() + colon + 1, &end, 10);
+        if (*end || threads <= 0 || end == str.c_str() + colon + 1)
+            return false;
+
+        params.threads = threads;
+    }
+
+    if (policy == "auto")
+        params.policy = THREADING_AUTO;
+    else if (policy == "latency")
+        params.policy = THREADING_LATENCY;
+    else if (policy == "throughput")
+        params.policy = THREADING_THROUGHPUT;
+    else
+        return false;
+
+    return true;
+}
+
+const char *threading_policy_name(ThreadingPolicy policy)
+{
+    switch (policy)
+    {
+      case THREADING_LATENCY:
+        return "latency";
+      case THREADING_THROUGHPUT:
+        return "throughput";
+      case THREADING_AUTO:
+      default:
+        return "auto";
+    }
+}
+
+ThreadingConfig choose_threading(const ThreadingParams& params, const AVCodec *codec,
+    int height, bool live)
+{
+    ThreadingConfig config{};
+    config.policy = params.policy;
+    if (config.policy == THREADING_AUTO)
+        config.policy = live ? THREADING_LATENCY : THREADING_THROUGHPUT;
+
+    /* Every thread gets a band of rows, so short frames can use fewer */
+    int cpus = std::max(1, av_cpu_count() / std::max(1, params.shared_by));
+    int slice_threads = params.threads ? params.threads :
+        std::max(1, std::min(cpus, height / MIN_SLICE_ROWS));
+    config.filter_threads = slice_threads;
+
+    /* Encoders with their own threads, like libx264, follow thread_type too */
+    bool own_threads = codec->capabilities & AV_CODEC_CAP_OTHER_THREADS;
+    bool slices = own_threads || (codec->capabilities & AV_CODEC_CAP_SLICE_THREADS);
+    bool frames = own_threads || (codec->capabilities & AV_CODEC_CAP_FRAME_THREADS);
+
+    if (config.policy == THREADING_LATENCY && slices)
+    {
+        config.codec_thread_type = FF_THREAD_SLICE;
+        config.codec_threads = slice_threads;
+    } else if (frames)
+    {
+        config.codec_thread_type = FF_THREAD_FRAME;
+        /* The codec would take all the CPUs if it could choose */
+        config.codec_threads = params.threads ? params.threads :
+            params.shared_by > 1 ? cpus : 0;
+    } else if (slices)
+    {
+        config.codec_thread_type = FF_THREAD_SLICE;
+        config.codec_threads = slice_threads;
+    }
+
+    return config;
+}
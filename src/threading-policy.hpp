@@ -0,0 +1,50 @@
+#ifndef THREADING_POLICY_HPP
+#define THREADING_POLICY_HPP
+
+#include <string>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+}
+
+enum ThreadingPolicy
+{
+    /* Latency for live outputs, throughput for files */
+    THREADING_AUTO,
+    /* Slice threads, every frame is encoded as soon as it arrives */
+    THREADING_LATENCY,
+    /* Frame threads, which encode several frames at once and therefore
+     * delay the packets by about one frame per thread */
+    THREADING_THROUGHPUT,
+};
+
+struct ThreadingParams
+{
+    ThreadingPolicy policy = THREADING_AUTO;
+    int threads = 0; // chosen from the CPUs and the resolution if 0
+    /* Streams which are encoded at the same time and share the CPUs */
+    int shared_by = 1;
+};
+
+/* How an encoder and its filtergraph are threaded */
+struct ThreadingConfig
+{
+    ThreadingPolicy policy;
+    /* FF_THREAD_SLICE or FF_THREAD_FRAME, 0 to keep the default of a codec
+     * without threading support */
+    int codec_thread_type;
+    int codec_threads; // 0 lets the codec choose
+    int filter_threads;
+};
+
+/* Parse POLICY[:THREADS], where POLICY is auto, latency or throughput */
+bool parse_threading(const std::string& str, ThreadingParams& params);
+const char *threading_policy_name(ThreadingPolicy policy);
+
+/* The threading of a stream of the given codec and input height. live is
+ * whether the stream is sent to the network. */
+ThreadingConfig choose_threading(const ThreadingParams& params, const AVCodec *codec,
+    int height, bool live);
+
+#endif /* end of include guard: THREADING_POLICY_HPP */
@@ -0,0 +1,189 @@
+#include "trace.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+
+/* Events are stored in chunks, so that a full buffer never has to be moved */
+#define TRACE_CHUNK_EVENTS 4096
+/* Limit of the memory used by each thread, about 14 MiB. Once it is used
+ * up, the chunk with the oldest events is reused, so the end of a long
+ * recording is kept. */
+#define TRACE_MAX_CHUNKS 64
+
+std::atomic<bool> trace_active{false};
+
+struct TraceEvent
+{
+    const char *name;
+    uint64_t start_usec;
+    uint64_t end_usec;
+    const char *arg;
+    int64_t value;
+    const char *arg2;
+    int64_t value2;
+};
+
+/* Written only by its thread. The count of all events recorded so far is
+ * published after the event is stored, so the buffer can be read while the
+ * thread is still running. */
+struct TraceBuffer
+{
+    int tid;
+    std::string name;
+    std::unique_ptr<TraceEvent[]> chunks[TRACE_MAX_CHUNKS];
+    std::atomic<size_t> count{0};
+};
+
+static std::mutex buffers_mutex;
+static std::vector<std::unique_ptr<TraceBuffer>> buffers;
+static std::string trace_file;
+static uint64_t trace_start_usec;
+
+static thread_local TraceBuffer *thread_buffer = nullptr;
+
+static TraceBuffer *get_thread_buffer()
+{
+    if (!thread_buffer)
+    {
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+        buffers.emplace_back(new TraceBuffer);
+        thread_buffer = buffers.back().get();
+        thread_buffer->tid = buffers.size();
+    }
+
+    return thread_buffer;
+}
+
+void trace_record(const char *name, uint64_t start_usec, uint64_t end_usec,
+    const char *arg, int64_t value, const char *arg2, int64_t value2)
+{
+    TraceBuffer *buffer = get_thread_buffer();
+    size_t index = buffer->count.load(std::memory_order_relaxed);
+    size_t chunk = index / TRACE_CHUNK_EVENTS % TRACE_MAX_CHUNKS;
+    if (!buffer->chunks[chunk])
+        buffer->chunks[chunk].reset(new TraceEvent[TRACE_CHUNK_EVENTS]);
+
+    buffer->chunks[chunk][index % TRACE_CHUNK_EVENTS] =
+        {name, start_usec, end_usec, arg, value, arg2, value2};
+    buffer->count.store(index + 1, std::memory_order_release);
+}
+
+void trace_thread_name(const std::string& name)
+{
+    if (trace_enabled())
+        get_thread_buffer()->name = name;
+}
+
+static std::string json_escape(const std::string& str)
+{
+    std::string result;
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+            result += '\\';
+        if ((unsigned char)c < 0x20)
+            continue;
+        result += c;
+    }
+
+    return result;
+}
+
+static void write_event(std::ostream& out, int tid, const TraceEvent& event)
+{
+    /* Events which started before the trace are clamped to its start */
+    uint64_t start = std::max(event.start_usec, trace_start_usec);
+    uint64_t end = std::max(event.end_usec, start);
+
+    out << ",\n{\"name\":\"" << event.name << "\",\"cat\":\"wf-recorder\",\"ph\":\"X\""
+        << ",\"pid\":" << getpid() << ",\"tid\":" << tid
+        << ",\"ts\":" << start - trace_start_usec << ",\"dur\":" << end - start;
+
+    if (event.arg)
+    {
+        out << ",\"args\":{\"" << event.arg << "\":" << event.value;
+        if (event.arg2)
+            out << ",\"" << event.arg2 << "\":" << event.value2;
+        out << "}";
+    }
+
+    out << "}";
+}
+
+bool trace_start(const std::string& file)
+{
+    /* Fail now rather than losing the trace at the end of the recording */
+    std::ofstream out(file);
+    if (!out)
+    {
+        std::cerr << "Failed to open trace file " << file << std::endl;
+        return false;
+    }
+
+    trace_file = file;
+    trace_start_usec = metrics_now_usec();
+    trace_active = true;
+    return true;
+}
+
+void trace_stop()
+{
+    if (!trace_active.exchange(false))
+        return;
+
+    std::ofstream out(trace_file);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+        << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << getpid()
+        << ",\"args\":{\"name\":\"wf-recorder\"}}";
+
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    size_t dropped = 0;
+    for (auto& buffer : buffers)
+    {
+        if (!buffer->name.empty())
+        {
+            out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << getpid()
+                << ",\"tid\":" << buffer->tid
+                << ",\"args\":{\"name\":\"" << json_escape(buffer->name) << "\"}}";
+        }
+
+        /* Once the chunks were reused, the oldest chunk is left out too, the
+         * thread may still be overwriting it */
+        size_t count = buffer->count.load(std::memory_order_acquire);
+        size_t chunks = (count + TRACE_CHUNK_EVENTS - 1) / TRACE_CHUNK_EVENTS;
+        size_t first = chunks > TRACE_MAX_CHUNKS ?
+            (chunks + 1 - TRACE_MAX_CHUNKS) * TRACE_CHUNK_EVENTS : 0;
+        if (first)
+        {
+            /* Mark where the thread's events start in the timeline */
+            auto& oldest = buffer->chunks[first / TRACE_CHUNK_EVENTS % TRACE_MAX_CHUNKS][0];
+            uint64_t ts = std::max(oldest.start_usec, trace_start_usec) - trace_start_usec;
+            out << ",\n{\"name\":\"trace truncated\",\"cat\":\"wf-recorder\",\"ph\":\"i\""
+                << ",\"s\":\"t\",\"pid\":" << getpid() << ",\"tid\":" << buffer->tid
+                << ",\"ts\":" << ts << ",\"args\":{\"dropped_events\":" << first << "}}";
+        }
+
+        for (size_t i = first; i < count; i++)
+        {
+            write_event(out, buffer->tid,
+                buffer->chunks[i / TRACE_CHUNK_EVENTS % TRACE_MAX_CHUNKS][i % TRACE_CHUNK_EVENTS]);
+        }
+
+        dropped += first;
+    }
+
+    out << "\n],\"otherData\":{\"dropped_events\":\"" << dropped << "\"}}\n";
+    if (!out)
+        std::cerr << "Failed to write trace file " << trace_file << std::endl;
+
+    if (dropped)
+    {
+        std::cerr << "Trace buffers were full, the oldest " << dropped
+            << " events were dropped" << std::endl;
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include "metrics.hpp"
+
+/**
+ * Timeline of the recording in the Chrome trace format, which can be opened
+ * in Perfetto or chrome://tracing. Every thread records its events into its
+ * own buffer without locking, the buffers are written out by trace_stop().
+ *
+ * The events of a frame can be followed across the threads by their
+ * arguments: the capture carries the presentation time of the frame as
+ * "frame", the writer thread maps it to "pts", the timestamp in the stream in
+ * microseconds, which the later stages and the packets carry.
+ */
+
+extern std::atomic<bool> trace_active;
+
+static inline bool trace_enabled()
+{
+    return trace_active.load(std::memory_order_relaxed);
+}
+
+/* The name must be a string literal, it is only stored as a pointer */
+void trace_record(const char *name, uint64_t start_usec, uint64_t end_usec,
+    const char *arg = nullptr, int64_t value = 0,
+    const char *arg2 = nullptr, int64_t value2 = 0);
+
+static inline void trace_event(const char *name, uint64_t start_usec, uint64_t end_usec,
+    const char *arg = nullptr, int64_t value = 0,
+    const char *arg2 = nullptr, int64_t value2 = 0)
+{
+    if (trace_enabled())
+        trace_record(name, start_usec, end_usec, arg, value, arg2, value2);
+}
+
+/* Name the calling thread in the trace */
+void trace_thread_name(const std::string& name);
+
+/* Records the time from its creation to its destruction as an event */
+class TraceScope
+{
+    const char *name;
+    const char *arg;
+    int64_t value;
+    uint64_t start;
+
+  public:
+    TraceScope(const char *_name, const char *_arg = nullptr, int64_t _value = 0) :
+        name(_name), arg(_arg), value(_value),
+        start(trace_enabled() ? metrics_now_usec() : 0) {}
+
+    ~TraceScope()
+    {
+        if (start)
+            trace_record(name, start, metrics_now_usec(), arg, value);
+    }
+};
+
+/* Start recording events, which are written to file by trace_stop(). Must be
+ * called before the threads which record events are started, and trace_stop()
+ * after they are joined. */
+bool trace_start(const std::string& file);
+void trace_stop();
+
+#endif /* end of include guard: TRACE_HPP */